@@ -3,6 +3,7 @@
 #include <image_transport/image_transport.h>
 #include <sensor_msgs/image_encodings.h>
 #include <boost/thread.hpp>
+#include <image_proc/nodelet_stats.h>
 
 namespace depth_image_proc {
 
@@ -18,6 +19,9 @@ class ConvertMetricNodelet : public nodelet::Nodelet
   boost::mutex connect_mutex_;
   image_transport::Publisher pub_depth_;
 
+  // Frame statistics
+  image_proc::NodeletStats stats_;
+
   virtual void onInit();
 
   void connectCb();
@@ -28,6 +32,7 @@ class ConvertMetricNodelet : public nodelet::Nodelet
 void ConvertMetricNodelet::onInit()
 {
   ros::NodeHandle& nh = getNodeHandle();
+  ros::NodeHandle& private_nh = getPrivateNodeHandle();
   it_.reset(new image_transport::ImageTransport(nh));
 
   // Monitor whether anyone is subscribed to the output
@@ -35,6 +40,8 @@ void ConvertMetricNodelet::onInit()
   // Make sure we don't enter connectCb() between advertising and assigning to pub_depth_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_depth_ = it_->advertise("image", 1, connect_cb, connect_cb);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -54,6 +61,8 @@ void ConvertMetricNodelet::connectCb()
 
 void ConvertMetricNodelet::depthCb(const sensor_msgs::ImageConstPtr& raw_msg)
 {
+  image_proc::FrameTimer timer(stats_, raw_msg->header);
+
   if (raw_msg->encoding != enc::TYPE_16UC1)
   {
     NODELET_ERROR_THROTTLE(2, "Expected data of type [%s], got [%s]", enc::TYPE_16UC1.c_str(),
@@ -82,6 +91,7 @@ void ConvertMetricNodelet::depthCb(const sensor_msgs::ImageConstPtr& raw_msg)
   }
 
   pub_depth_.publish(depth_msg);
+  timer.published();
 }
 
 } // namespace depth_image_proc
@@ -7,6 +7,7 @@
 #include <sensor_msgs/image_encodings.h>
 #include <stereo_msgs/DisparityImage.h>
 #include "depth_traits.h"
+#include <image_proc/nodelet_stats.h>
 
 namespace depth_image_proc {
 
@@ -19,6 +20,8 @@ class DisparityNodelet : public nodelet::Nodelet
   image_transport::SubscriberFilter sub_depth_image_;
   message_filters::Subscriber<sensor_msgs::CameraInfo> sub_info_;
   typedef message_filters::TimeSynchronizer<sensor_msgs::Image, sensor_msgs::CameraInfo> Sync;
+  typedef ros::MessageEvent<sensor_msgs::Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<sensor_msgs::CameraInfo const> InfoEvent;
   boost::shared_ptr<Sync> sync_;
   
   boost::mutex connect_mutex_;
@@ -27,12 +30,14 @@ class DisparityNodelet : public nodelet::Nodelet
   double max_range_;
   double delta_d_;
 
+  // Frame statistics
+  image_proc::NodeletStats stats_;
+
   virtual void onInit();
 
   void connectCb();
 
-  void depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
-               const sensor_msgs::CameraInfoConstPtr& info_msg);
+  void depthCb(const ImageEvent& depth_event, const InfoEvent& info_event);
 
   template<typename T>
   void convert(const sensor_msgs::ImageConstPtr& depth_msg,
@@ -56,13 +61,15 @@ void DisparityNodelet::onInit()
 
   // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
   sync_.reset( new Sync(sub_depth_image_, sub_info_, queue_size) );
-  sync_->registerCallback(boost::bind(&DisparityNodelet::depthCb, this, _1, _2));
+  sync_->registerCallback(&DisparityNodelet::depthCb, this);
 
   // Monitor whether anyone is subscribed to the output
   ros::SubscriberStatusCallback connect_cb = boost::bind(&DisparityNodelet::connectCb, this);
   // Make sure we don't enter connectCb() between advertising and assigning to pub_disparity_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_disparity_ = left_nh.advertise<stereo_msgs::DisparityImage>("disparity", 1, connect_cb, connect_cb);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -82,9 +89,14 @@ void DisparityNodelet::connectCb()
   }
 }
 
-void DisparityNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
-                               const sensor_msgs::CameraInfoConstPtr& info_msg)
+void DisparityNodelet::depthCb(const ImageEvent& depth_event, const InfoEvent& info_event)
 {
+  sensor_msgs::ImageConstPtr depth_msg = depth_event.getMessage();
+  sensor_msgs::CameraInfoConstPtr info_msg = info_event.getMessage();
+  image_proc::FrameTimer timer(stats_, depth_msg->header,
+                               image_proc::lastReceipt(depth_event.getReceiptTime(),
+                                                       info_event.getReceiptTime()));
+
   // Allocate new DisparityImage message
   stereo_msgs::DisparityImagePtr disp_msg( new stereo_msgs::DisparityImage );
   disp_msg->header         = depth_msg->header;
@@ -117,6 +129,7 @@ void DisparityNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
   }
 
   pub_disparity_.publish(disp_msg);
+  timer.published();
 }
 
 template<typename T>
@@ -7,6 +7,8 @@
 #include <image_geometry/pinhole_camera_model.h>
 #include <boost/thread.hpp>
 #include "depth_traits.h"
+#include <image_proc/nodelet_stats.h>
+#include <image_proc/voxel_grid.h>
 
 namespace depth_image_proc {
 
@@ -23,8 +25,14 @@ class PointCloudXyzNodelet : public nodelet::Nodelet
   boost::mutex connect_mutex_;
   typedef pcl::PointCloud<pcl::PointXYZ> PointCloud;
   ros::Publisher pub_point_cloud_;
+  ros::Publisher pub_voxels_;
 
   image_geometry::PinholeCameraModel model_;
+  image_proc::VoxelGrid voxel_grid_;
+  std::vector<float> voxel_row_; // x, y, z, rgb scratch points
+
+  // Frame statistics
+  image_proc::NodeletStats stats_;
 
   virtual void onInit();
 
@@ -36,6 +44,9 @@ class PointCloudXyzNodelet : public nodelet::Nodelet
   // Handles float or uint16 depths
   template<typename T>
   void convert(const sensor_msgs::ImageConstPtr& depth_msg, PointCloud::Ptr& cloud_msg);
+
+  template<typename T>
+  void voxelize(const sensor_msgs::ImageConstPtr& depth_msg);
 };
 
 void PointCloudXyzNodelet::onInit()
@@ -46,19 +57,29 @@ void PointCloudXyzNodelet::onInit()
 
   // Read parameters
   private_nh.param("queue_size", queue_size_, 5);
+  // Optional downsampled cloud of voxel centroids, <= 0 to disable
+  double voxel_leaf_size;
+  private_nh.param("voxel_leaf_size", voxel_leaf_size, 0.0);
 
   // Monitor whether anyone is subscribed to the output
   ros::SubscriberStatusCallback connect_cb = boost::bind(&PointCloudXyzNodelet::connectCb, this);
   // Make sure we don't enter connectCb() between advertising and assigning to pub_point_cloud_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_point_cloud_ = nh.advertise<PointCloud>("points", 1, connect_cb, connect_cb);
+  if (voxel_leaf_size > 0.0)
+  {
+    voxel_grid_.reset(voxel_leaf_size);
+    pub_voxels_ = nh.advertise<sensor_msgs::PointCloud2>("points_voxels", 1, connect_cb, connect_cb);
+  }
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void PointCloudXyzNodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_point_cloud_.getNumSubscribers() == 0)
+  if (pub_point_cloud_.getNumSubscribers() == 0 && pub_voxels_.getNumSubscribers() == 0)
   {
     sub_depth_.shutdown();
   }
@@ -72,31 +93,46 @@ void PointCloudXyzNodelet::connectCb()
 void PointCloudXyzNodelet::depthCb(const sensor_msgs::ImageConstPtr& depth_msg,
                                    const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
-  PointCloud::Ptr cloud_msg(new PointCloud);
-  cloud_msg->header = depth_msg->header;
-  cloud_msg->height = depth_msg->height;
-  cloud_msg->width  = depth_msg->width;
-  cloud_msg->is_dense = false;
-  cloud_msg->points.resize(cloud_msg->height * cloud_msg->width);
+  image_proc::FrameTimer timer(stats_, depth_msg->header);
+
+  if (depth_msg->encoding != enc::TYPE_16UC1 && depth_msg->encoding != enc::TYPE_32FC1)
+  {
+    NODELET_ERROR_THROTTLE(5, "Depth image has unsupported encoding [%s]", depth_msg->encoding.c_str());
+    return;
+  }
+  bool depth_mm = depth_msg->encoding == enc::TYPE_16UC1;
 
   // Update camera model
   model_.fromCameraInfo(info_msg);
 
-  if (depth_msg->encoding == enc::TYPE_16UC1)
-  {
-    convert<uint16_t>(depth_msg, cloud_msg);
-  }
-  else if (depth_msg->encoding == enc::TYPE_32FC1)
+  if (pub_point_cloud_.getNumSubscribers() > 0)
   {
-    convert<float>(depth_msg, cloud_msg);
+    PointCloud::Ptr cloud_msg(new PointCloud);
+    cloud_msg->header = depth_msg->header;
+    cloud_msg->height = depth_msg->height;
+    cloud_msg->width  = depth_msg->width;
+    cloud_msg->is_dense = false;
+    cloud_msg->points.resize(cloud_msg->height * cloud_msg->width);
+
+    if (depth_mm)
+      convert<uint16_t>(depth_msg, cloud_msg);
+    else
+      convert<float>(depth_msg, cloud_msg);
+    pub_point_cloud_.publish (cloud_msg);
   }
-  else
+
+  if (pub_voxels_.getNumSubscribers() > 0)
   {
-    NODELET_ERROR_THROTTLE(5, "Depth image has unsupported encoding [%s]", depth_msg->encoding.c_str());
-    return;
+    if (depth_mm)
+      voxelize<uint16_t>(depth_msg);
+    else
+      voxelize<float>(depth_msg);
+    sensor_msgs::PointCloud2Ptr voxels_msg(new sensor_msgs::PointCloud2);
+    voxels_msg->header = depth_msg->header;
+    voxel_grid_.toPointCloud2(*voxels_msg, false);
+    pub_voxels_.publish(voxels_msg);
   }
-
-  pub_point_cloud_.publish (cloud_msg);
+  timer.published();
 }
 
 template<typename T>
@@ -137,6 +173,41 @@ void PointCloudXyzNodelet::convert(const sensor_msgs::ImageConstPtr& depth_msg,
   }
 }
 
+// Averages each row's points into the voxel grid, without building the full cloud
+template<typename T>
+void PointCloudXyzNodelet::voxelize(const sensor_msgs::ImageConstPtr& depth_msg)
+{
+  float center_x = model_.cx();
+  float center_y = model_.cy();
+  double unit_scaling = DepthTraits<T>::toMeters( T(1) );
+  float constant_x = unit_scaling / model_.fx();
+  float constant_y = unit_scaling / model_.fy();
+  float bad_point = std::numeric_limits<float>::quiet_NaN();
+
+  voxel_grid_.reset(voxel_grid_.leafSize());
+  voxel_row_.resize(4 * depth_msg->width);
+  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
+  int row_step = depth_msg->step / sizeof(T);
+  for (int v = 0; v < (int)depth_msg->height; ++v, depth_row += row_step)
+  {
+    float* pt = &voxel_row_[0];
+    for (int u = 0; u < (int)depth_msg->width; ++u, pt += 4)
+    {
+      T depth = depth_row[u];
+      if (!DepthTraits<T>::valid(depth))
+      {
+        pt[0] = pt[1] = pt[2] = bad_point;
+        continue;
+      }
+      pt[0] = (u - center_x) * depth * constant_x;
+      pt[1] = (v - center_y) * depth * constant_y;
+      pt[2] = DepthTraits<T>::toMeters(depth);
+      pt[3] = 0.0f;
+    }
+    voxel_grid_.addPoints(&voxel_row_[0], depth_msg->width);
+  }
+}
+
 } // namespace depth_image_proc
 
 // Register as nodelet
@@ -12,6 +12,8 @@
 #include "depth_traits.h"
 #include <cv_bridge/cv_bridge.h>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <image_proc/nodelet_stats.h>
+#include <image_proc/voxel_grid.h>
 
 namespace depth_image_proc {
 
@@ -41,28 +43,41 @@ class PointCloudXyzrgbNodelet : public nodelet::Nodelet
   message_filters::Subscriber<sensor_msgs::CameraInfo> sub_info_;
   typedef ApproximateTime<sensor_msgs::Image, sensor_msgs::Image, sensor_msgs::CameraInfo> SyncPolicy;
   typedef message_filters::Synchronizer<SyncPolicy> Synchronizer;
+  typedef ros::MessageEvent<sensor_msgs::Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<sensor_msgs::CameraInfo const> InfoEvent;
   boost::shared_ptr<Synchronizer> sync_;
 
   // Publications
   boost::mutex connect_mutex_;
   typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloud;
   ros::Publisher pub_point_cloud_;
+  ros::Publisher pub_voxels_;
 
   image_geometry::PinholeCameraModel model_;
+  image_proc::VoxelGrid voxel_grid_;
+  std::vector<float> voxel_row_; // x, y, z, rgb scratch points
+
+  // Frame statistics
+  image_proc::NodeletStats stats_;
 
   virtual void onInit();
 
   void connectCb();
 
-  void imageCb(const sensor_msgs::ImageConstPtr& depth_msg,
-               const sensor_msgs::ImageConstPtr& rgb_msg,
-               const sensor_msgs::CameraInfoConstPtr& info_msg);
+  void imageCb(const ImageEvent& depth_event,
+               const ImageEvent& rgb_event,
+               const InfoEvent& info_event);
 
   template<typename T>
   void convert(const sensor_msgs::ImageConstPtr& depth_msg,
                const sensor_msgs::ImageConstPtr& rgb_msg,
                const PointCloud::Ptr& cloud_msg,
                int red_offset, int green_offset, int blue_offset, int color_step);
+
+  template<typename T>
+  void voxelize(const sensor_msgs::ImageConstPtr& depth_msg,
+                const sensor_msgs::ImageConstPtr& rgb_msg,
+                int red_offset, int green_offset, int blue_offset, int color_step);
 };
 
 void PointCloudXyzrgbNodelet::onInit()
@@ -77,23 +92,33 @@ void PointCloudXyzrgbNodelet::onInit()
   // Read parameters
   int queue_size;
   private_nh.param("queue_size", queue_size, 5);
+  // Optional downsampled cloud of voxel centroids, <= 0 to disable
+  double voxel_leaf_size;
+  private_nh.param("voxel_leaf_size", voxel_leaf_size, 0.0);
 
   // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
   sync_.reset( new Synchronizer(SyncPolicy(queue_size), sub_depth_, sub_rgb_, sub_info_) );
-  sync_->registerCallback(boost::bind(&PointCloudXyzrgbNodelet::imageCb, this, _1, _2, _3));
+  sync_->registerCallback(&PointCloudXyzrgbNodelet::imageCb, this);
   
   // Monitor whether anyone is subscribed to the output
   ros::SubscriberStatusCallback connect_cb = boost::bind(&PointCloudXyzrgbNodelet::connectCb, this);
   // Make sure we don't enter connectCb() between advertising and assigning to pub_point_cloud_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_point_cloud_ = depth_nh.advertise<PointCloud>("points", 1, connect_cb, connect_cb);
+  if (voxel_leaf_size > 0.0)
+  {
+    voxel_grid_.reset(voxel_leaf_size);
+    pub_voxels_ = depth_nh.advertise<sensor_msgs::PointCloud2>("points_voxels", 1, connect_cb, connect_cb);
+  }
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void PointCloudXyzrgbNodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_point_cloud_.getNumSubscribers() == 0)
+  if (pub_point_cloud_.getNumSubscribers() == 0 && pub_voxels_.getNumSubscribers() == 0)
   {
     sub_depth_.unsubscribe();
     sub_rgb_  .unsubscribe();
@@ -108,10 +133,18 @@ void PointCloudXyzrgbNodelet::connectCb()
   }
 }
 
-void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_msg,
-                                      const sensor_msgs::ImageConstPtr& rgb_msg_in,
-                                      const sensor_msgs::CameraInfoConstPtr& info_msg)
+void PointCloudXyzrgbNodelet::imageCb(const ImageEvent& depth_event,
+                                      const ImageEvent& rgb_event,
+                                      const InfoEvent& info_event)
 {
+  sensor_msgs::ImageConstPtr depth_msg = depth_event.getMessage();
+  sensor_msgs::ImageConstPtr rgb_msg_in = rgb_event.getMessage();
+  sensor_msgs::CameraInfoConstPtr info_msg = info_event.getMessage();
+  image_proc::FrameTimer timer(stats_, depth_msg->header,
+                               image_proc::lastReceipt(depth_event.getReceiptTime(),
+                                                       rgb_event.getReceiptTime(),
+                                                       info_event.getReceiptTime()));
+
   // Check for bad inputs
   if (depth_msg->header.frame_id != rgb_msg_in->header.frame_id)
   {
@@ -192,29 +225,42 @@ void PointCloudXyzrgbNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_ms
     return;
   }
 
-  // Allocate new point cloud message
-  PointCloud::Ptr cloud_msg (new PointCloud);
-  cloud_msg->header = depth_msg->header; // Use depth image time stamp
-  cloud_msg->height = depth_msg->height;
-  cloud_msg->width  = depth_msg->width;
-  cloud_msg->is_dense = false;
-  cloud_msg->points.resize (cloud_msg->height * cloud_msg->width);
-
-  if (depth_msg->encoding == enc::TYPE_16UC1)
+  if (depth_msg->encoding != enc::TYPE_16UC1 && depth_msg->encoding != enc::TYPE_32FC1)
   {
-    convert<uint16_t>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step);
+    NODELET_ERROR_THROTTLE(5, "Depth image has unsupported encoding [%s]", depth_msg->encoding.c_str());
+    return;
   }
-  else if (depth_msg->encoding == enc::TYPE_32FC1)
+  bool depth_mm = depth_msg->encoding == enc::TYPE_16UC1;
+
+  if (pub_point_cloud_.getNumSubscribers() > 0)
   {
-    convert<float>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step);
+    // Allocate new point cloud message
+    PointCloud::Ptr cloud_msg (new PointCloud);
+    cloud_msg->header = depth_msg->header; // Use depth image time stamp
+    cloud_msg->height = depth_msg->height;
+    cloud_msg->width  = depth_msg->width;
+    cloud_msg->is_dense = false;
+    cloud_msg->points.resize (cloud_msg->height * cloud_msg->width);
+
+    if (depth_mm)
+      convert<uint16_t>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step);
+    else
+      convert<float>(depth_msg, rgb_msg, cloud_msg, red_offset, green_offset, blue_offset, color_step);
+    pub_point_cloud_.publish (cloud_msg);
   }
-  else
+
+  if (pub_voxels_.getNumSubscribers() > 0)
   {
-    NODELET_ERROR_THROTTLE(5, "Depth image has unsupported encoding [%s]", depth_msg->encoding.c_str());
-    return;
+    if (depth_mm)
+      voxelize<uint16_t>(depth_msg, rgb_msg, red_offset, green_offset, blue_offset, color_step);
+    else
+      voxelize<float>(depth_msg, rgb_msg, red_offset, green_offset, blue_offset, color_step);
+    sensor_msgs::PointCloud2Ptr voxels_msg(new sensor_msgs::PointCloud2);
+    voxels_msg->header = depth_msg->header;
+    voxel_grid_.toPointCloud2(*voxels_msg, true);
+    pub_voxels_.publish(voxels_msg);
   }
-
-  pub_point_cloud_.publish (cloud_msg);
+  timer.published();
 }
 
 template<typename T>
@@ -270,6 +316,51 @@ void PointCloudXyzrgbNodelet::convert(const sensor_msgs::ImageConstPtr& depth_ms
   }
 }
 
+// Averages each row's points and colors into the voxel grid, without building the full cloud
+template<typename T>
+void PointCloudXyzrgbNodelet::voxelize(const sensor_msgs::ImageConstPtr& depth_msg,
+                                       const sensor_msgs::ImageConstPtr& rgb_msg,
+                                       int red_offset, int green_offset, int blue_offset, int color_step)
+{
+  float center_x = model_.cx();
+  float center_y = model_.cy();
+  double unit_scaling = DepthTraits<T>::toMeters( T(1) );
+  float constant_x = unit_scaling / model_.fx();
+  float constant_y = unit_scaling / model_.fy();
+  float bad_point = std::numeric_limits<float>::quiet_NaN ();
+
+  voxel_grid_.reset(voxel_grid_.leafSize());
+  voxel_row_.resize(4 * depth_msg->width);
+  const T* depth_row = reinterpret_cast<const T*>(&depth_msg->data[0]);
+  int row_step = depth_msg->step / sizeof(T);
+  const uint8_t* rgb_row = &rgb_msg->data[0];
+  for (int v = 0; v < (int)depth_msg->height; ++v, depth_row += row_step, rgb_row += rgb_msg->step)
+  {
+    float* pt = &voxel_row_[0];
+    const uint8_t* rgb = rgb_row;
+    for (int u = 0; u < (int)depth_msg->width; ++u, pt += 4, rgb += color_step)
+    {
+      T depth = depth_row[u];
+      if (!DepthTraits<T>::valid(depth))
+      {
+        pt[0] = pt[1] = pt[2] = bad_point;
+        continue;
+      }
+      pt[0] = (u - center_x) * depth * constant_x;
+      pt[1] = (v - center_y) * depth * constant_y;
+      pt[2] = DepthTraits<T>::toMeters(depth);
+
+      RGBValue color;
+      color.Red   = rgb[red_offset];
+      color.Green = rgb[green_offset];
+      color.Blue  = rgb[blue_offset];
+      color.Alpha = 0;
+      pt[3] = color.float_value;
+    }
+    voxel_grid_.addPoints(&voxel_row_[0], depth_msg->width);
+  }
+}
+
 } // namespace depth_image_proc
 
 // Register as nodelet
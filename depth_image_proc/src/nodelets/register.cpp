@@ -10,6 +10,7 @@
 #include <image_geometry/pinhole_camera_model.h>
 #include <Eigen/Core>
 #include "depth_traits.h"
+#include <image_proc/nodelet_stats.h>
 
 namespace depth_image_proc {
 
@@ -27,6 +28,8 @@ class RegisterNodelet : public nodelet::Nodelet
   boost::shared_ptr<tf::TransformListener> tf_;
   typedef ApproximateTime<sensor_msgs::Image, sensor_msgs::CameraInfo, sensor_msgs::CameraInfo> SyncPolicy;
   typedef message_filters::Synchronizer<SyncPolicy> Synchronizer;
+  typedef ros::MessageEvent<sensor_msgs::Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<sensor_msgs::CameraInfo const> InfoEvent;
   boost::shared_ptr<Synchronizer> sync_;
 
   // Publications
@@ -35,13 +38,16 @@ class RegisterNodelet : public nodelet::Nodelet
 
   image_geometry::PinholeCameraModel depth_model_, rgb_model_;
 
+  // Frame statistics
+  image_proc::NodeletStats stats_;
+
   virtual void onInit();
 
   void connectCb();
 
-  void imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
-               const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
-               const sensor_msgs::CameraInfoConstPtr& rgb_info_msg);
+  void imageCb(const ImageEvent& depth_image_event,
+               const InfoEvent& depth_info_event,
+               const InfoEvent& rgb_info_event);
 
   template<typename T>
   void convert(const sensor_msgs::ImageConstPtr& depth_msg,
@@ -64,7 +70,7 @@ void RegisterNodelet::onInit()
 
   // Synchronize inputs. Topic subscriptions happen on demand in the connection callback.
   sync_.reset( new Synchronizer(SyncPolicy(queue_size), sub_depth_image_, sub_depth_info_, sub_rgb_info_) );
-  sync_->registerCallback(boost::bind(&RegisterNodelet::imageCb, this, _1, _2, _3));
+  sync_->registerCallback(&RegisterNodelet::imageCb, this);
 
   // Monitor whether anyone is subscribed to the output
   image_transport::ImageTransport it_depth_reg(ros::NodeHandle(nh, "depth_registered"));
@@ -75,6 +81,8 @@ void RegisterNodelet::onInit()
   pub_registered_ = it_depth_reg.advertiseCamera("image_rect", 1,
                                                  image_connect_cb, image_connect_cb,
                                                  info_connect_cb, info_connect_cb);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -96,10 +104,18 @@ void RegisterNodelet::connectCb()
   }
 }
 
-void RegisterNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
-                              const sensor_msgs::CameraInfoConstPtr& depth_info_msg,
-                              const sensor_msgs::CameraInfoConstPtr& rgb_info_msg)
+void RegisterNodelet::imageCb(const ImageEvent& depth_image_event,
+                              const InfoEvent& depth_info_event,
+                              const InfoEvent& rgb_info_event)
 {
+  sensor_msgs::ImageConstPtr depth_image_msg = depth_image_event.getMessage();
+  sensor_msgs::CameraInfoConstPtr depth_info_msg = depth_info_event.getMessage();
+  sensor_msgs::CameraInfoConstPtr rgb_info_msg = rgb_info_event.getMessage();
+  image_proc::FrameTimer timer(stats_, depth_image_msg->header,
+                               image_proc::lastReceipt(depth_image_event.getReceiptTime(),
+                                                       depth_info_event.getReceiptTime(),
+                                                       rgb_info_event.getReceiptTime()));
+
   // Update camera models - these take binning & ROI into account
   depth_model_.fromCameraInfo(depth_info_msg);
   rgb_model_  .fromCameraInfo(rgb_info_msg);
@@ -160,6 +176,7 @@ void RegisterNodelet::imageCb(const sensor_msgs::ImageConstPtr& depth_image_msg,
   registered_info_msg->header.stamp = registered_msg->header.stamp;
 
   pub_registered_.publish(registered_msg, registered_info_msg);
+  timer.published();
 }
 
 template<typename T>
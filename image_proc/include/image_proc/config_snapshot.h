@@ -0,0 +1,53 @@
+#ifndef IMAGE_PROC_CONFIG_SNAPSHOT_H
+#define IMAGE_PROC_CONFIG_SNAPSHOT_H
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace image_proc {
+
+/**
+ * Holds the current dynamic_reconfigure config of a nodelet as an immutable snapshot.
+ * The reconfigure callback store()s each new config; image callbacks load() the latest
+ * one without taking the reconfigure server's recursive mutex. A loaded snapshot stays
+ * valid and unchanged for as long as the caller holds it, even across a reconfigure.
+ *
+ * Only the pointer swap and copy happen under mutex_, so an image callback never waits
+ * for more than that, however long reconfiguring takes.
+ */
+template <class Config>
+class ConfigSnapshot
+{
+public:
+  typedef boost::shared_ptr<const Config> ConstPtr;
+
+  ConfigSnapshot()
+    : current_(new Config)
+  {
+  }
+
+  void store(const Config& config)
+  {
+    ConstPtr snapshot(new Config(config));
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      current_.swap(snapshot);
+    }
+    // The old snapshot, if no one holds it anymore, is freed here, outside the lock
+  }
+
+  ConstPtr load() const
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return current_;
+  }
+
+private:
+  mutable boost::mutex mutex_;
+  ConstPtr current_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef IMAGE_PROC_NODELET_STATS_H
+#define IMAGE_PROC_NODELET_STATS_H
+
+#include <ros/ros.h>
+#include <std_msgs/Header.h>
+#include <diagnostic_msgs/DiagnosticStatus.h>
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+
+namespace image_proc {
+
+/**
+ * Histogram of durations that any number of threads can add() to without locking.
+ * Buckets are 4 per power of two of microseconds, so percentiles are accurate to
+ * within 25%.
+ */
+class LatencyHistogram : boost::noncopyable
+{
+public:
+  enum { NUM_BUCKETS = 124 }; // up to 2^31 us
+
+  struct Summary
+  {
+    uint32_t count;
+    double mean, p50, p90, p99, max; // seconds
+  };
+
+  LatencyHistogram();
+
+  void add(double seconds);
+
+  // Summarizes everything added since the last call, and starts over
+  Summary takeSummary();
+
+private:
+  volatile uint32_t buckets_[NUM_BUCKETS];
+  volatile uint64_t sum_us_;
+  volatile uint32_t max_us_;
+};
+
+/**
+ * Per-nodelet frame statistics, published as a diagnostic_msgs/DiagnosticArray on
+ * /diagnostics every ~diagnostics_period seconds (default 1.0, 0 disables):
+ *  - latency:    receipt of the frame's inputs to its (last) publish, so includes time
+ *                spent queued or waiting for a pipeline stage
+ *  - processing: time spent working on the frame, in the callback or pipeline stages
+ *  - input age:  callback entry minus header stamp
+ *  - dropped:    gaps in the input header sequence numbers, plus frames the nodelet
+ *                drops itself (e.g. from a full pipeline queue)
+ * Receipt times come from ros::MessageEvent::getReceiptTime() where the callback gets
+ * message events; image_transport subscribers pass none, so there it is the callback entry.
+ * Recording a frame costs a few atomic adds and clock reads.
+ */
+class NodeletStats : boost::noncopyable
+{
+public:
+  NodeletStats();
+
+  void init(ros::NodeHandle& nh, ros::NodeHandle& private_nh, const std::string& name);
+
+  // Returns the callback entry time
+  ros::WallTime frameReceived(const std_msgs::Header& header);
+
+  // Time spent working on a frame, once per frame
+  void addProcessing(const ros::WallDuration& duration);
+
+  // A frame whose inputs were received at receipt_time was published at publish_time
+  void framePublished(const ros::Time& receipt_time, const ros::Time& publish_time);
+
+  // A received frame was dropped without being published
+  void frameDropped();
+
+private:
+  std::string name_;
+  ros::Publisher pub_diagnostics_;
+  ros::WallTimer timer_;
+  ros::WallTime last_report_;
+
+  LatencyHistogram latency_, processing_, input_age_;
+  volatile uint32_t frames_;
+  volatile uint32_t published_;
+  volatile uint32_t dropped_;
+  volatile uint32_t last_seq_;
+  volatile int64_t last_receive_ns_;
+
+  void timerCb(const ros::WallTimerEvent& event);
+  void addSummary(diagnostic_msgs::DiagnosticStatus& status, const std::string& name,
+                  const LatencyHistogram::Summary& summary);
+};
+
+// When the last of a synchronized set of messages was received
+inline ros::Time lastReceipt(const ros::Time& a, const ros::Time& b, const ros::Time& c = ros::Time(),
+                             const ros::Time& d = ros::Time(), const ros::Time& e = ros::Time())
+{
+  return std::max(std::max(std::max(a, b), std::max(c, d)), e);
+}
+
+/**
+ * Records one callback in a NodeletStats from construction to destruction:
+ *
+ *   FrameTimer timer(stats_, image_msg->header, image_event.getReceiptTime());
+ *   ...
+ *   pub_.publish(out_msg);
+ *   timer.published();
+ *
+ * Without a receipt time, latency is measured from the callback entry.
+ */
+class FrameTimer : boost::noncopyable
+{
+public:
+  FrameTimer(NodeletStats& stats, const std_msgs::Header& header,
+             const ros::Time& receipt_time = ros::Time())
+    : stats_(stats), started_(stats.frameReceived(header)),
+      receipt_time_(receipt_time.isZero() ? ros::Time::now() : receipt_time)
+  {
+  }
+
+  ~FrameTimer()
+  {
+    stats_.addProcessing(ros::WallTime::now() - started_);
+    if (!published_.isZero())
+      stats_.framePublished(receipt_time_, published_);
+  }
+
+  void published()
+  {
+    published_ = ros::Time::now();
+  }
+
+private:
+  NodeletStats& stats_;
+  ros::WallTime started_;
+  ros::Time receipt_time_;
+  ros::Time published_;
+};
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef IMAGE_PROC_PARALLEL_H
+#define IMAGE_PROC_PARALLEL_H
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <deque>
+#include <string>
+
+namespace image_proc {
+
+// Body of a parallel loop, called on the half-open range [begin, end)
+typedef boost::function<void (int, int)> RangeFunction;
+
+/**
+ * Fixed set of worker threads that run parallel loops split into bands (typically
+ * bands of image rows). The calling thread works on its own loop too, so a pool of
+ * N threads starts N-1 workers. Several threads may run loops on the same pool at
+ * once, and a loop body may itself call parallelFor().
+ */
+class WorkerPool
+{
+public:
+  // num_threads <= 0 uses one thread per hardware core
+  explicit WorkerPool(int num_threads = 0);
+  ~WorkerPool();
+
+  // Number of threads a loop is spread over, including the caller
+  int numThreads() const { return workers_.size() + 1; }
+
+  // Calls body on bands covering [begin, end), each at least min_band long, and
+  // returns once all bands are done. An exception thrown by the body is rethrown
+  // here as std::runtime_error.
+  void parallelFor(int begin, int end, const RangeFunction& body, int min_band = 1);
+
+private:
+  struct Job
+  {
+    const RangeFunction* body;
+    int remaining;
+    std::string error;
+    boost::condition_variable done;
+  };
+
+  struct Task
+  {
+    Job* job;
+    int begin, end;
+  };
+
+  boost::thread_group workers_;
+  boost::mutex mutex_;
+  boost::condition_variable task_available_;
+  std::deque<Task> tasks_;
+  bool shutdown_;
+
+  void workerThread();
+  void runTask(const Task& task);
+  bool popTaskOf(Job* job, Task& task);
+};
+
+// Pool shared by the parallel loops in image_pipeline
+boost::shared_ptr<WorkerPool> globalWorkerPool();
+
+// Replaces the shared pool, e.g. to limit the CPU used by a node. Loops already
+// running finish on the old pool.
+void setGlobalWorkerThreads(int num_threads);
+
+// Runs a loop on the shared pool
+void parallelFor(int begin, int end, const RangeFunction& body, int min_band = 1);
+
+} // namespace image_proc
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef IMAGE_PROC_PIPELINE_H
+#define IMAGE_PROC_PIPELINE_H
+
+#include <ros/console.h>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * Runs items (typically frames) through a fixed sequence of stages, each stage on its
+ * own thread, so consecutive items overlap: while one stage works on item N, the one
+ * before it works on item N+1. Items leave every stage in the order they were pushed.
+ * Stages may still spread their own work over the worker pool with parallelFor().
+ *
+ * Each stage is fed by a queue of at most depth items. The first queue never blocks
+ * push(): when it is full, its oldest item is dropped, so a pipeline slower than its
+ * input drops items instead of falling further behind. The other queues block the
+ * stage feeding them, so an item that was started is always finished. The latency of
+ * an item is thus bounded by depth + 1 items per stage.
+ *
+ * An exception thrown by a stage is logged and drops the item.
+ */
+template <class Item>
+class Pipeline : boost::noncopyable
+{
+public:
+  typedef boost::shared_ptr<Item> ItemPtr;
+  typedef boost::function<void (Item&)> Stage;
+
+  Pipeline(const std::vector<Stage>& stages, int depth)
+    : stages_(stages), queues_(stages.size()), depth_(std::max(depth, 1)), in_flight_(0), shutdown_(false)
+  {
+    for (size_t i = 0; i < stages_.size(); ++i)
+      threads_.create_thread(boost::bind(&Pipeline::run, this, i));
+  }
+
+  // Finishes the items already pushed
+  ~Pipeline()
+  {
+    flush();
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      shutdown_ = true;
+    }
+    changed_.notify_all();
+    threads_.join_all();
+  }
+
+  // Queues an item for the first stage. Returns false if the oldest waiting item was
+  // dropped to make room.
+  bool push(const ItemPtr& item)
+  {
+    bool kept_all = true;
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      std::deque<ItemPtr>& queue = queues_[0];
+      if ((int)queue.size() >= depth_) {
+        queue.pop_front();
+        kept_all = false;
+      }
+      else {
+        ++in_flight_;
+      }
+      queue.push_back(item);
+    }
+    changed_.notify_all();
+    return kept_all;
+  }
+
+  // Waits until every item pushed so far went through all stages
+  void flush()
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (in_flight_ > 0)
+      changed_.wait(lock);
+  }
+
+  int depth() const { return depth_; }
+
+private:
+  std::vector<Stage> stages_;
+  std::vector< std::deque<ItemPtr> > queues_; // queues_[i] feeds stages_[i]
+  int depth_;
+  int in_flight_; // pushed and not yet through the last stage
+  bool shutdown_;
+  boost::mutex mutex_;
+  boost::condition_variable changed_; // any queue or in_flight_ changed
+  boost::thread_group threads_;
+
+  void run(size_t stage)
+  {
+    const bool last = stage + 1 == stages_.size();
+    for (;;) {
+      ItemPtr item;
+      {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (queues_[stage].empty() && !shutdown_)
+          changed_.wait(lock);
+        if (queues_[stage].empty())
+          return;
+        item = queues_[stage].front();
+        queues_[stage].pop_front();
+      }
+      changed_.notify_all();
+
+      bool ok = true;
+      try {
+        stages_[stage](*item);
+      }
+      catch (std::exception& e) {
+        ROS_ERROR("[image_proc] Pipeline stage %d failed: %s", (int)stage, e.what());
+        ok = false;
+      }
+
+      {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        if (ok && !last) {
+          while ((int)queues_[stage + 1].size() >= depth_)
+            changed_.wait(lock);
+          queues_[stage + 1].push_back(item);
+        }
+        else {
+          --in_flight_;
+        }
+      }
+      changed_.notify_all();
+    }
+  }
+};
+
+} // namespace image_proc
+
+#endif
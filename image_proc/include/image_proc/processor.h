@@ -20,11 +20,13 @@ class Processor
 {
 public:
   Processor()
-    : interpolation_(CV_INTER_LINEAR)
+    : interpolation_(CV_INTER_LINEAR),
+      yuv_matrix_(0)
   {
   }
   
   int interpolation_;
+  int yuv_matrix_; // image_proc::YuvMatrix, for YUV raw images
 
   enum {
     MONO       = 1 << 0,
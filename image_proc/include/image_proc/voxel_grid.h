@@ -0,0 +1,70 @@
+#ifndef IMAGE_PROC_VOXEL_GRID_H
+#define IMAGE_PROC_VOXEL_GRID_H
+
+#include <sensor_msgs/PointCloud2.h>
+#include <stdint.h>
+#include <vector>
+
+namespace image_proc {
+
+/**
+ * Downsamples points to the centroid and mean color of each occupied cube of a fixed
+ * leaf size. Voxels are found through an open addressing hash table of packed integer
+ * keys, probed linearly, so a lookup usually reads a single cache line; the per-voxel
+ * sums are kept apart in insertion order. Memory is kept across reset() calls, so a
+ * grid reused for every frame stops allocating once it has seen the largest frame.
+ *
+ * Voxel indices are limited to +-2^20 per axis (+-10 km at 1 cm leaves); points
+ * beyond that are dropped.
+ */
+class VoxelGrid
+{
+public:
+  VoxelGrid();
+
+  // Empties the grid and sets the voxel edge length, in the units of the points
+  void reset(float leaf_size);
+
+  float leafSize() const { return leaf_size_; }
+
+  // Number of occupied voxels
+  size_t size() const { return cells_.size(); }
+
+  // Adds count points laid out as x, y, z, rgb floats, the rgb float holding a packed
+  // 0x00RRGGBB color as in PointCloud2. Points with a NaN coordinate are skipped.
+  void addPoints(const float* points, int count);
+
+  // Adds the voxels of a grid with the same leaf size
+  void merge(const VoxelGrid& other);
+
+  // Fills a dense, unorganized cloud with the voxel centroids: fields x, y, z and, if
+  // color is set, rgb averaged per channel. Header is left untouched.
+  void toPointCloud2(sensor_msgs::PointCloud2& cloud, bool color) const;
+
+private:
+  struct Slot
+  {
+    uint64_t key;  // EMPTY_KEY if unused
+    uint32_t cell; // index into cells_
+  };
+
+  struct Cell
+  {
+    uint64_t key;
+    uint32_t count;
+    float sum[3];    // offsets from the voxel's low corner, to keep float precision
+    uint32_t rgb[3]; // r, g, b
+  };
+
+  float leaf_size_, inv_leaf_;
+  std::vector<Slot> slots_; // power of two size, at most half full
+  std::vector<Cell> cells_;
+  int shift_;               // 64 - log2(slots_.size())
+
+  Cell& cell(uint64_t key);
+  void grow();
+};
+
+} // namespace image_proc
+
+#endif
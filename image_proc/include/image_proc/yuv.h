@@ -0,0 +1,55 @@
+#ifndef IMAGE_PROC_YUV_H
+#define IMAGE_PROC_YUV_H
+
+#include <opencv2/core/core.hpp>
+#include <string>
+
+// YUV to BGR/mono conversion for the common camera layouts, intended for eventual
+// inclusion in OpenCV. Large images are converted in row bands on the shared worker
+// pool (see parallel.h); the result does not depend on the number of threads.
+
+namespace image_proc {
+
+// Encodings not (yet) defined in sensor_msgs/image_encodings.h. The packed 4:2:2
+// UYVY layout is sensor_msgs::image_encodings::YUV422.
+namespace yuv_encodings
+{
+  const std::string YUV422_YUY2 = "yuv422_yuy2"; // packed 4:2:2, Y0 U Y1 V
+  const std::string NV12        = "nv12";        // Y plane, then interleaved U V plane at 4:2:0
+  const std::string I420        = "i420";        // Y plane, then U and V planes at 4:2:0
+}
+
+enum YuvFormat
+{
+  YUV_UYVY, // packed 4:2:2, U Y0 V Y1
+  YUV_YUYV, // packed 4:2:2, Y0 U Y1 V
+  YUV_NV12, // planar 4:2:0, interleaved chroma
+  YUV_I420  // planar 4:2:0, separate chroma planes
+};
+
+// Matrix used to map YUV to RGB. Values match the Debayer.cfg yuv_matrix enum.
+enum YuvMatrix
+{
+  YUV_BT601 = 0, // SD cameras, most USB webcams
+  YUV_BT709 = 1  // HD cameras
+};
+
+// Returns false if the encoding is not one of the supported YUV layouts.
+bool yuvFormatFromEncoding(const std::string& encoding, YuvFormat& format);
+
+// Wraps raw image data in a cv::Mat suitable for the conversions below. Packed formats
+// become height x width CV_8UC2; planar formats become (height*3/2) x width CV_8UC1,
+// with the chroma rows following the luma rows and step/2 bytes per chroma row.
+cv::Mat wrapYuv(uint8_t* data, int width, int height, size_t step, YuvFormat format);
+
+// (Re)allocates gray as CV_8UC1 at the image size of yuv. For planar formats
+// this is a copy of the Y plane.
+void yuvToGray(const cv::Mat& yuv, cv::Mat& gray, YuvFormat format);
+
+// (Re)allocates color as CV_8UC3 (BGR) at the image size of yuv.
+void yuvToColor(const cv::Mat& yuv, cv::Mat& color, YuvFormat format,
+                YuvMatrix matrix = YUV_BT601);
+
+} // namespace image_proc
+
+#endif
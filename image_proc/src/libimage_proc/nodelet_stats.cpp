@@ -0,0 +1,205 @@
+#include "image_proc/nodelet_stats.h"
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <algorithm>
+#include <cstdio>
+
+namespace image_proc {
+
+namespace {
+
+// Bucket i < 4 holds exactly i us. Above that, each power of two [2^k, 2^(k+1)) is
+// split into 4 buckets.
+inline int bucketIndex(uint32_t us)
+{
+  if (us < 4)
+    return us;
+  int msb = 31 - __builtin_clz(us);
+  return (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+}
+
+// Largest value in bucket i, in us
+inline double bucketUpper(int i)
+{
+  if (i < 4)
+    return i;
+  int shift = i / 4 - 1;
+  uint64_t lower = (uint64_t)(4 + i % 4) << shift;
+  return lower + ((uint64_t)1 << shift) - 1;
+}
+
+// A receive gap longer than this (e.g. after a lazy unsubscribe) starts a new
+// sequence instead of counting as drops
+const int64_t SEQUENCE_PAUSE_NS = 2000000000LL;
+
+void addValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, double value)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.3f", value);
+  diagnostic_msgs::KeyValue kv;
+  kv.key = key;
+  kv.value = buf;
+  status.values.push_back(kv);
+}
+
+} // namespace
+
+LatencyHistogram::LatencyHistogram()
+  : sum_us_(0), max_us_(0)
+{
+  for (int i = 0; i < NUM_BUCKETS; ++i)
+    buckets_[i] = 0;
+}
+
+void LatencyHistogram::add(double seconds)
+{
+  double us_d = seconds * 1e6;
+  uint32_t us = us_d <= 0.0 ? 0 : us_d >= 2147483647.0 ? 2147483647u : (uint32_t)us_d;
+
+  __sync_fetch_and_add(&buckets_[bucketIndex(us)], 1);
+  __sync_fetch_and_add(&sum_us_, (uint64_t)us);
+  uint32_t old_max = max_us_;
+  while (us > old_max) {
+    uint32_t seen = __sync_val_compare_and_swap(&max_us_, old_max, us);
+    if (seen == old_max)
+      break;
+    old_max = seen;
+  }
+}
+
+LatencyHistogram::Summary LatencyHistogram::takeSummary()
+{
+  // Values added while we swap out the buckets land in either this summary or the next
+  uint32_t counts[NUM_BUCKETS];
+  uint32_t count = 0;
+  for (int i = 0; i < NUM_BUCKETS; ++i) {
+    counts[i] = __sync_lock_test_and_set(&buckets_[i], 0);
+    count += counts[i];
+  }
+  uint64_t sum_us = __sync_lock_test_and_set(&sum_us_, 0);
+  uint32_t max_us = __sync_lock_test_and_set(&max_us_, 0);
+
+  Summary summary;
+  summary.count = count;
+  summary.mean = count ? sum_us * 1e-6 / count : 0.0;
+  summary.max = max_us * 1e-6;
+  summary.p50 = summary.p90 = summary.p99 = 0.0;
+  if (count == 0)
+    return summary;
+
+  uint32_t rank50 = (count * 50 + 99) / 100, rank90 = (count * 90 + 99) / 100,
+           rank99 = (count * 99 + 99) / 100;
+  uint32_t seen = 0;
+  for (int i = 0; i < NUM_BUCKETS; ++i) {
+    if (counts[i] == 0)
+      continue;
+    uint32_t before = seen;
+    seen += counts[i];
+    double upper = std::min(bucketUpper(i) * 1e-6, summary.max);
+    if (before < rank50 && seen >= rank50) summary.p50 = upper;
+    if (before < rank90 && seen >= rank90) summary.p90 = upper;
+    if (before < rank99 && seen >= rank99) summary.p99 = upper;
+  }
+  return summary;
+}
+
+NodeletStats::NodeletStats()
+  : frames_(0), published_(0), dropped_(0), last_seq_(0), last_receive_ns_(0)
+{
+}
+
+void NodeletStats::init(ros::NodeHandle& nh, ros::NodeHandle& private_nh, const std::string& name)
+{
+  name_ = name;
+  double period;
+  private_nh.param("diagnostics_period", period, 1.0);
+  if (period <= 0.0)
+    return;
+
+  pub_diagnostics_ = nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+  last_report_ = ros::WallTime::now();
+  timer_ = nh.createWallTimer(ros::WallDuration(period), &NodeletStats::timerCb, this);
+}
+
+ros::WallTime NodeletStats::frameReceived(const std_msgs::Header& header)
+{
+  ros::WallTime now = ros::WallTime::now();
+  __sync_fetch_and_add(&frames_, 1);
+
+  int64_t now_ns = now.toNSec();
+  int64_t last_ns = __sync_lock_test_and_set(&last_receive_ns_, now_ns);
+  uint32_t last_seq = __sync_lock_test_and_set(&last_seq_, header.seq);
+  uint32_t gap = header.seq - last_seq;
+  if (last_ns != 0 && now_ns - last_ns < SEQUENCE_PAUSE_NS && gap > 1 && gap < 0x80000000u)
+    __sync_fetch_and_add(&dropped_, gap - 1);
+
+  if (!header.stamp.isZero())
+    input_age_.add((ros::Time::now() - header.stamp).toSec());
+
+  return now;
+}
+
+void NodeletStats::addProcessing(const ros::WallDuration& duration)
+{
+  processing_.add(duration.toSec());
+}
+
+void NodeletStats::framePublished(const ros::Time& receipt_time, const ros::Time& publish_time)
+{
+  __sync_fetch_and_add(&published_, 1);
+  latency_.add((publish_time - receipt_time).toSec());
+}
+
+void NodeletStats::frameDropped()
+{
+  __sync_fetch_and_add(&dropped_, 1);
+}
+
+void NodeletStats::timerCb(const ros::WallTimerEvent& event)
+{
+  ros::WallTime now = ros::WallTime::now();
+  double elapsed = (now - last_report_).toSec();
+  last_report_ = now;
+
+  uint32_t frames = __sync_lock_test_and_set(&frames_, 0);
+  uint32_t published = __sync_lock_test_and_set(&published_, 0);
+  uint32_t dropped = __sync_lock_test_and_set(&dropped_, 0);
+  LatencyHistogram::Summary latency = latency_.takeSummary();
+  LatencyHistogram::Summary processing = processing_.takeSummary();
+  LatencyHistogram::Summary input_age = input_age_.takeSummary();
+
+  if (pub_diagnostics_.getNumSubscribers() == 0)
+    return;
+
+  diagnostic_msgs::DiagnosticArrayPtr array(new diagnostic_msgs::DiagnosticArray);
+  array->header.stamp = ros::Time::now();
+  array->status.resize(1);
+  diagnostic_msgs::DiagnosticStatus& status = array->status[0];
+  status.name = name_;
+  status.level = diagnostic_msgs::DiagnosticStatus::OK;
+  double rate = elapsed > 0.0 ? published / elapsed : 0.0;
+  char message[64];
+  snprintf(message, sizeof(message), "%.1f Hz, %u dropped", rate, dropped);
+  status.message = message;
+
+  addValue(status, "frames received", frames);
+  addValue(status, "frames published", published);
+  addValue(status, "frames dropped", dropped);
+  addValue(status, "publish rate (Hz)", rate);
+  addSummary(status, "latency", latency);
+  addSummary(status, "processing", processing);
+  addSummary(status, "input age", input_age);
+
+  pub_diagnostics_.publish(array);
+}
+
+void NodeletStats::addSummary(diagnostic_msgs::DiagnosticStatus& status, const std::string& name,
+                              const LatencyHistogram::Summary& summary)
+{
+  addValue(status, name + " mean (ms)", summary.mean * 1000.0);
+  addValue(status, name + " p50 (ms)",  summary.p50 * 1000.0);
+  addValue(status, name + " p90 (ms)",  summary.p90 * 1000.0);
+  addValue(status, name + " p99 (ms)",  summary.p99 * 1000.0);
+  addValue(status, name + " max (ms)",  summary.max * 1000.0);
+}
+
+} // namespace image_proc
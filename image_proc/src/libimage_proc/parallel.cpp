@@ -0,0 +1,160 @@
+#include "image_proc/parallel.h"
+#include <boost/bind.hpp>
+#include <boost/thread/once.hpp>
+#include <algorithm>
+#include <stdexcept>
+
+namespace image_proc {
+
+WorkerPool::WorkerPool(int num_threads)
+  : shutdown_(false)
+{
+  if (num_threads <= 0)
+    num_threads = std::max(1u, boost::thread::hardware_concurrency());
+  for (int i = 1; i < num_threads; ++i)
+    workers_.create_thread(boost::bind(&WorkerPool::workerThread, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  task_available_.notify_all();
+  workers_.join_all();
+}
+
+void WorkerPool::parallelFor(int begin, int end, const RangeFunction& body, int min_band)
+{
+  int count = end - begin;
+  if (count <= 0)
+    return;
+  int num_bands = std::min(numThreads(), count / std::max(min_band, 1));
+  if (num_bands <= 1) {
+    body(begin, end);
+    return;
+  }
+
+  Job job;
+  job.body = &body;
+  job.remaining = num_bands;
+
+  // Queue all but the first band for the workers, then work on the first band here
+  int first_end = begin + count / num_bands;
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    for (int i = 1; i < num_bands; ++i) {
+      Task task = { &job, begin + (int)((long long)count * i / num_bands),
+                    begin + (int)((long long)count * (i + 1) / num_bands) };
+      tasks_.push_back(task);
+    }
+  }
+  task_available_.notify_all();
+
+  Task first = { &job, begin, first_end };
+  runTask(first);
+
+  // Help with any of our bands the workers have not picked up yet, then wait
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  Task task;
+  while (job.remaining > 0) {
+    if (popTaskOf(&job, task)) {
+      lock.unlock();
+      runTask(task);
+      lock.lock();
+    }
+    else {
+      job.done.wait(lock);
+    }
+  }
+
+  if (!job.error.empty())
+    throw std::runtime_error(job.error);
+}
+
+void WorkerPool::workerThread()
+{
+  boost::unique_lock<boost::mutex> lock(mutex_);
+  while (true) {
+    while (tasks_.empty() && !shutdown_)
+      task_available_.wait(lock);
+    if (shutdown_)
+      return;
+
+    Task task = tasks_.front();
+    tasks_.pop_front();
+    lock.unlock();
+    runTask(task);
+    lock.lock();
+  }
+}
+
+void WorkerPool::runTask(const Task& task)
+{
+  std::string error;
+  try {
+    (*task.job->body)(task.begin, task.end);
+  }
+  catch (std::exception& e) {
+    error = e.what();
+  }
+  catch (...) {
+    error = "unknown exception in parallel loop body";
+  }
+
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  if (!error.empty() && task.job->error.empty())
+    task.job->error = error;
+  if (--task.job->remaining == 0)
+    task.job->done.notify_all();
+}
+
+// Must be called with mutex_ held
+bool WorkerPool::popTaskOf(Job* job, Task& task)
+{
+  for (std::deque<Task>::iterator it = tasks_.begin(); it != tasks_.end(); ++it) {
+    if (it->job == job) {
+      task = *it;
+      tasks_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace {
+
+boost::mutex g_pool_mutex;
+boost::shared_ptr<WorkerPool> g_pool;
+boost::once_flag g_pool_once = BOOST_ONCE_INIT;
+
+void createGlobalPool()
+{
+  g_pool.reset(new WorkerPool);
+}
+
+} // namespace
+
+boost::shared_ptr<WorkerPool> globalWorkerPool()
+{
+  boost::call_once(createGlobalPool, g_pool_once);
+  boost::lock_guard<boost::mutex> lock(g_pool_mutex);
+  return g_pool;
+}
+
+void setGlobalWorkerThreads(int num_threads)
+{
+  boost::shared_ptr<WorkerPool> pool(new WorkerPool(num_threads));
+  boost::call_once(createGlobalPool, g_pool_once);
+  boost::lock_guard<boost::mutex> lock(g_pool_mutex);
+  g_pool.swap(pool);
+  // The old pool is released once the last loop running on it returns
+}
+
+void parallelFor(int begin, int end, const RangeFunction& body, int min_band)
+{
+  globalWorkerPool()->parallelFor(begin, end, body, min_band);
+}
+
+} // namespace image_proc
@@ -1,4 +1,5 @@
 #include "image_proc/processor.h"
+#include "image_proc/yuv.h"
 #include <sensor_msgs/image_encodings.h>
 #include <ros/console.h>
 
@@ -21,6 +22,7 @@ bool Processor::process(const sensor_msgs::ImageConstPtr& raw_image,
     raw_type = CV_8UC3;
     output.color_encoding = raw_encoding;
   }
+  YuvFormat yuv_format;
   // Construct cv::Mat pointing to raw_image data
   const cv::Mat raw(raw_image->height, raw_image->width, raw_type,
                     const_cast<uint8_t*>(&raw_image->data[0]), raw_image->step);
@@ -52,6 +54,23 @@ bool Processor::process(const sensor_msgs::ImageConstPtr& raw_image,
     if (flags & MONO_EITHER)
       cv::cvtColor(output.color, output.mono, CV_BGR2GRAY);
   }
+  // YUV case
+  else if (yuvFormatFromEncoding(raw_encoding, yuv_format)) {
+    const cv::Mat yuv = wrapYuv(const_cast<uint8_t*>(&raw_image->data[0]), raw_image->width,
+                                raw_image->height, raw_image->step, yuv_format);
+    if (flags & COLOR_EITHER) {
+      yuvToColor(yuv, output.color, yuv_format, YuvMatrix(yuv_matrix_));
+      output.color_encoding = enc::BGR8;
+    }
+    // Luma is the mono image, no need to go through color. For RECT alone this is
+    // all we compute, and rectification remaps the luma directly.
+    if (flags & MONO_EITHER) {
+      if (yuv_format == YUV_NV12 || yuv_format == YUV_I420)
+        output.mono = yuv.rowRange(0, raw_image->height); // Y plane, no copy
+      else
+        yuvToGray(yuv, output.mono, yuv_format); // packed luma must be gathered for remap
+    }
+  }
   // Color case
   else if (raw_type == CV_8UC3) {
     output.color = raw;
@@ -0,0 +1,228 @@
+#include "image_proc/voxel_grid.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace image_proc {
+
+namespace {
+
+// Keys pack the three voxel indices, offset to be non-negative, in 21 bits each
+const int KEY_BITS = 21;
+const int64_t KEY_OFFSET = 1 << (KEY_BITS - 1);
+const uint64_t KEY_MASK = (1 << KEY_BITS) - 1;
+const uint64_t EMPTY_KEY = ~0ULL; // top bit is never set in a real key
+
+const int MIN_SLOTS_LOG2 = 10;
+
+inline uint32_t floatBits(float f)
+{
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+inline float bitsFloat(uint32_t u)
+{
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+inline int64_t keyIndex(uint64_t key, int axis)
+{
+  return (int64_t)((key >> (KEY_BITS * (2 - axis))) & KEY_MASK) - KEY_OFFSET;
+}
+
+// Voxel indices of a point (floor of the coordinates in leaf units) and the point's
+// offsets from the voxel's low corner. False if outside the key range or NaN.
+inline bool voxelOf(const float* point, float leaf_size, float inv_leaf, int* index, float* offset)
+{
+  const float limit = (float)KEY_OFFSET;
+#if defined(__SSE2__)
+  // The 4th float is the packed color, often a denormal; clear it so it costs no microcode assists
+  const __m128 p = _mm_and_ps(_mm_loadu_ps(point), _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+  const __m128 f = _mm_mul_ps(p, _mm_set1_ps(inv_leaf));
+  const __m128 inside = _mm_and_ps(_mm_cmpge_ps(f, _mm_set1_ps(-limit)), _mm_cmplt_ps(f, _mm_set1_ps(limit)));
+  if ((_mm_movemask_ps(inside) & 7) != 7)
+    return false;
+  __m128i i = _mm_cvttps_epi32(f);
+  i = _mm_add_epi32(i, _mm_castps_si128(_mm_cmplt_ps(f, _mm_cvtepi32_ps(i)))); // floor
+  const __m128 o = _mm_sub_ps(p, _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(leaf_size)));
+  int i4[4];
+  float o4[4];
+  _mm_storeu_si128((__m128i*)i4, i);
+  _mm_storeu_ps(o4, o);
+  for (int j = 0; j < 3; ++j) {
+    index[j] = i4[j];
+    offset[j] = o4[j];
+  }
+  return true;
+#else
+  for (int j = 0; j < 3; ++j) {
+    float f = point[j] * inv_leaf;
+    if (!(f >= -limit && f < limit))
+      return false;
+    index[j] = (int)f;
+    index[j] -= f < index[j]; // floor
+    offset[j] = point[j] - index[j] * leaf_size;
+  }
+  return true;
+#endif
+}
+
+} // namespace
+
+VoxelGrid::VoxelGrid()
+  : leaf_size_(1.0f), inv_leaf_(1.0f), shift_(64)
+{
+}
+
+void VoxelGrid::reset(float leaf_size)
+{
+  leaf_size_ = leaf_size;
+  inv_leaf_ = 1.0f / leaf_size;
+  cells_.clear();
+  Slot empty = { EMPTY_KEY, 0 };
+  std::fill(slots_.begin(), slots_.end(), empty);
+}
+
+void VoxelGrid::grow()
+{
+  // Double the table and reinsert every key
+  int log2 = slots_.empty() ? MIN_SLOTS_LOG2 : 64 - shift_ + 1;
+  Slot empty = { EMPTY_KEY, 0 };
+  slots_.assign(size_t(1) << log2, empty);
+  shift_ = 64 - log2;
+  const size_t mask = slots_.size() - 1;
+  for (size_t i = 0; i < cells_.size(); ++i) {
+    size_t s = (cells_[i].key * 0x9E3779B97F4A7C15ULL) >> shift_;
+    while (slots_[s].key != EMPTY_KEY)
+      s = (s + 1) & mask;
+    slots_[s].key = cells_[i].key;
+    slots_[s].cell = i;
+  }
+}
+
+VoxelGrid::Cell& VoxelGrid::cell(uint64_t key)
+{
+  if (2 * (cells_.size() + 1) > slots_.size())
+    grow();
+
+  // Fibonacci hashing spreads neighboring voxels over the table
+  const size_t mask = slots_.size() - 1;
+  size_t s = (key * 0x9E3779B97F4A7C15ULL) >> shift_;
+  while (slots_[s].key != key) {
+    if (slots_[s].key == EMPTY_KEY) {
+      slots_[s].key = key;
+      slots_[s].cell = cells_.size();
+      Cell c;
+      memset(&c, 0, sizeof(c));
+      c.key = key;
+      cells_.push_back(c);
+      break;
+    }
+    s = (s + 1) & mask;
+  }
+  return cells_[slots_[s].cell];
+}
+
+void VoxelGrid::addPoints(const float* points, int count)
+{
+  // Neighboring pixels mostly fall in the same voxel, so points are summed locally
+  // until the voxel changes and only then added to the table
+  uint64_t run_key = EMPTY_KEY;
+  uint32_t run_count = 0, run_rgb[3] = { 0, 0, 0 };
+  float run_sum[3] = { 0.0f, 0.0f, 0.0f };
+  for (int i = 0; i <= count; ++i, points += 4) {
+    uint64_t key = EMPTY_KEY;
+    int index[3];
+    float offset[3];
+    if (i < count) {
+      if (!voxelOf(points, leaf_size_, inv_leaf_, index, offset))
+        continue;
+      key = ((uint64_t)(index[0] + KEY_OFFSET) << (2 * KEY_BITS)) |
+            ((uint64_t)(index[1] + KEY_OFFSET) << KEY_BITS) |
+             (uint64_t)(index[2] + KEY_OFFSET);
+    }
+
+    if (key != run_key) {
+      if (run_count) {
+        Cell& c = cell(run_key);
+        c.count += run_count;
+        for (int j = 0; j < 3; ++j) {
+          c.sum[j] += run_sum[j];
+          c.rgb[j] += run_rgb[j];
+          run_sum[j] = 0.0f;
+          run_rgb[j] = 0;
+        }
+      }
+      run_key = key;
+      run_count = 0;
+    }
+    if (i == count)
+      break;
+
+    ++run_count;
+    for (int j = 0; j < 3; ++j)
+      run_sum[j] += offset[j];
+    uint32_t rgb = floatBits(points[3]);
+    run_rgb[0] += (rgb >> 16) & 0xff;
+    run_rgb[1] += (rgb >> 8) & 0xff;
+    run_rgb[2] += rgb & 0xff;
+  }
+}
+
+void VoxelGrid::merge(const VoxelGrid& other)
+{
+  for (size_t i = 0; i < other.cells_.size(); ++i) {
+    const Cell& o = other.cells_[i];
+    Cell& c = cell(o.key);
+    c.count += o.count;
+    for (int j = 0; j < 3; ++j) {
+      c.sum[j] += o.sum[j];
+      c.rgb[j] += o.rgb[j];
+    }
+  }
+}
+
+void VoxelGrid::toPointCloud2(sensor_msgs::PointCloud2& cloud, bool color) const
+{
+  const int num_fields = color ? 4 : 3;
+  cloud.fields.resize(num_fields);
+  const char* names[4] = { "x", "y", "z", "rgb" };
+  for (int i = 0; i < num_fields; ++i) {
+    cloud.fields[i].name = names[i];
+    cloud.fields[i].offset = 4 * i;
+    cloud.fields[i].count = 1;
+    cloud.fields[i].datatype = sensor_msgs::PointField::FLOAT32;
+  }
+  cloud.height = 1;
+  cloud.width = cells_.size();
+  cloud.is_bigendian = false;
+  cloud.point_step = 4 * num_fields;
+  cloud.row_step = cloud.point_step * cloud.width;
+  cloud.data.resize(cloud.row_step);
+  cloud.is_dense = true;
+
+  float* out = cloud.data.empty() ? NULL : reinterpret_cast<float*>(&cloud.data[0]);
+  for (size_t i = 0; i < cells_.size(); ++i, out += num_fields) {
+    const Cell& c = cells_[i];
+    const float inv_count = 1.0f / c.count;
+    for (int j = 0; j < 3; ++j)
+      out[j] = keyIndex(c.key, j) * leaf_size_ + c.sum[j] * inv_count;
+    if (color) {
+      uint32_t half = c.count / 2;
+      uint32_t r = (c.rgb[0] + half) / c.count;
+      uint32_t g = (c.rgb[1] + half) / c.count;
+      uint32_t b = (c.rgb[2] + half) / c.count;
+      out[3] = bitsFloat((r << 16) | (g << 8) | b);
+    }
+  }
+}
+
+} // namespace image_proc
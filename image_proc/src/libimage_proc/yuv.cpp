@@ -0,0 +1,352 @@
+#include "image_proc/yuv.h"
+#include "image_proc/parallel.h"
+#include <sensor_msgs/image_encodings.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CLIP_CHAR(c) ((c)>255?255:(c)<0?0:(c))
+
+namespace image_proc {
+
+namespace {
+
+// Chroma contributions in 14-bit fixed point:
+//   B = Y + ub*U
+//   G = Y + ug*U + vg*V
+//   R = Y + vr*V
+// with U, V centered on zero.
+struct YuvCoeffs
+{
+  int ub, ug, vg, vr;
+};
+
+const YuvCoeffs BT601_COEFFS = { 33292, -6472, -9519, 18678 };
+const YuvCoeffs BT709_COEFFS = { 34865, -3520, -6236, 20977 };
+
+inline const YuvCoeffs& coeffsFor(YuvMatrix matrix)
+{
+  return (matrix == YUV_BT709) ? BT709_COEFFS : BT601_COEFFS;
+}
+
+// Byte strides of one layout within a row. Luma sample i is at y[i*Y_STEP], the chroma
+// pair shared by pixels 2j and 2j+1 is at u[j*C_STEP] and v[j*C_STEP].
+template <YuvFormat F> struct Layout;
+template <> struct Layout<YUV_UYVY> { enum { Y_STEP = 2, C_STEP = 4 }; };
+template <> struct Layout<YUV_YUYV> { enum { Y_STEP = 2, C_STEP = 4 }; };
+template <> struct Layout<YUV_NV12> { enum { Y_STEP = 1, C_STEP = 2 }; };
+template <> struct Layout<YUV_I420> { enum { Y_STEP = 1, C_STEP = 1 }; };
+
+struct RowPointers
+{
+  const uint8_t* y;
+  const uint8_t* u;
+  const uint8_t* v;
+};
+
+// Locates the luma and chroma samples of image row r
+template <YuvFormat F>
+inline RowPointers rowPointers(const cv::Mat& yuv, int height, int r)
+{
+  RowPointers p;
+  const uint8_t* row = yuv.ptr<uint8_t>(r);
+  if (F == YUV_UYVY) {
+    p.u = row;
+    p.y = row + 1;
+    p.v = row + 2;
+  }
+  else if (F == YUV_YUYV) {
+    p.y = row;
+    p.u = row + 1;
+    p.v = row + 3;
+  }
+  else if (F == YUV_NV12) {
+    p.y = row;
+    p.u = yuv.ptr<uint8_t>(height + r/2);
+    p.v = p.u + 1;
+  }
+  else { // YUV_I420
+    size_t chroma_step = yuv.step[0] / 2;
+    const uint8_t* u_plane = yuv.ptr<uint8_t>(height);
+    p.y = row;
+    p.u = u_plane + (r/2) * chroma_step;
+    p.v = u_plane + (height/2) * chroma_step + (r/2) * chroma_step;
+  }
+  return p;
+}
+
+inline void storePixel(uint8_t* bgr, int y, int b_off, int g_off, int r_off)
+{
+  bgr[0] = CLIP_CHAR(y + b_off);
+  bgr[1] = CLIP_CHAR(y + g_off);
+  bgr[2] = CLIP_CHAR(y + r_off);
+}
+
+// Scalar conversion of pixels [x, width) of one row, x even
+template <YuvFormat F>
+void colorRowScalar(const RowPointers& p, int x, int width, uint8_t* bgr, const YuvCoeffs& c)
+{
+  enum { Y_STEP = Layout<F>::Y_STEP, C_STEP = Layout<F>::C_STEP };
+  for ( ; x < width; x += 2) {
+    int j = x / 2;
+    int u = p.u[j*C_STEP] - 128;
+    int v = p.v[j*C_STEP] - 128;
+    int b_off = (u * c.ub + 8192) >> 14;
+    int g_off = (v * c.vg + u * c.ug + 8192) >> 14;
+    int r_off = (v * c.vr + 8192) >> 14;
+
+    storePixel(bgr + x*3, p.y[x*Y_STEP], b_off, g_off, r_off);
+    if (x + 1 < width)
+      storePixel(bgr + x*3 + 3, p.y[(x+1)*Y_STEP], b_off, g_off, r_off);
+  }
+}
+
+#if defined(__SSE2__)
+
+// Loads 16 pixels starting at x as 16-bit luma (two halves) and 8 16-bit chroma pairs
+template <YuvFormat F>
+inline void load16(const RowPointers& p, int x,
+                   __m128i& y_lo, __m128i& y_hi, __m128i& u, __m128i& v);
+
+template <>
+inline void load16<YUV_UYVY>(const RowPointers& p, int x,
+                             __m128i& y_lo, __m128i& y_hi, __m128i& u, __m128i& v)
+{
+  // U Y0 V Y1 ...: luma in the high byte of each 16-bit lane, chroma in the low byte
+  const __m128i low_byte = _mm_set1_epi16(0x00ff);
+  const __m128i low_word = _mm_set1_epi32(0x0000ffff);
+  __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p.u + 2*x));
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p.u + 2*x + 16));
+  y_lo = _mm_srli_epi16(a, 8);
+  y_hi = _mm_srli_epi16(b, 8);
+  __m128i uv_a = _mm_and_si128(a, low_byte);
+  __m128i uv_b = _mm_and_si128(b, low_byte);
+  u = _mm_packs_epi32(_mm_and_si128(uv_a, low_word), _mm_and_si128(uv_b, low_word));
+  v = _mm_packs_epi32(_mm_srli_epi32(uv_a, 16), _mm_srli_epi32(uv_b, 16));
+}
+
+template <>
+inline void load16<YUV_YUYV>(const RowPointers& p, int x,
+                             __m128i& y_lo, __m128i& y_hi, __m128i& u, __m128i& v)
+{
+  // Y0 U Y1 V ...: luma in the low byte of each 16-bit lane, chroma in the high byte
+  const __m128i low_byte = _mm_set1_epi16(0x00ff);
+  const __m128i low_word = _mm_set1_epi32(0x0000ffff);
+  __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p.y + 2*x));
+  __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p.y + 2*x + 16));
+  y_lo = _mm_and_si128(a, low_byte);
+  y_hi = _mm_and_si128(b, low_byte);
+  __m128i uv_a = _mm_srli_epi16(a, 8);
+  __m128i uv_b = _mm_srli_epi16(b, 8);
+  u = _mm_packs_epi32(_mm_and_si128(uv_a, low_word), _mm_and_si128(uv_b, low_word));
+  v = _mm_packs_epi32(_mm_srli_epi32(uv_a, 16), _mm_srli_epi32(uv_b, 16));
+}
+
+template <>
+inline void load16<YUV_NV12>(const RowPointers& p, int x,
+                             __m128i& y_lo, __m128i& y_hi, __m128i& u, __m128i& v)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low_byte = _mm_set1_epi16(0x00ff);
+  __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p.y + x));
+  y_lo = _mm_unpacklo_epi8(y, zero);
+  y_hi = _mm_unpackhi_epi8(y, zero);
+  __m128i uv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p.u + x));
+  u = _mm_and_si128(uv, low_byte);
+  v = _mm_srli_epi16(uv, 8);
+}
+
+template <>
+inline void load16<YUV_I420>(const RowPointers& p, int x,
+                             __m128i& y_lo, __m128i& y_hi, __m128i& u, __m128i& v)
+{
+  const __m128i zero = _mm_setzero_si128();
+  __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p.y + x));
+  y_lo = _mm_unpacklo_epi8(y, zero);
+  y_hi = _mm_unpackhi_epi8(y, zero);
+  u = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p.u + x/2)), zero);
+  v = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p.v + x/2)), zero);
+}
+
+// Builds a _mm_madd_epi16 operand computing a*c0 + b*c1 on interleaved 16-bit (a,b)
+inline __m128i maddCoeffs(int c0, int c1)
+{
+  return _mm_set1_epi32((int)(((unsigned)c1 << 16) | ((unsigned)c0 & 0xffff)));
+}
+
+// Computes ((a*c0 + b*c1 + 8192) >> 14) for 8 chroma pairs, saturated to 16 bits
+inline __m128i chromaOffset(const __m128i& a, const __m128i& b, const __m128i& coeffs)
+{
+  const __m128i round = _mm_set1_epi32(8192);
+  __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), coeffs);
+  __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), coeffs);
+  lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 14);
+  hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 14);
+  return _mm_packs_epi32(lo, hi);
+}
+
+// Adds a per-pair chroma offset to 16 luma values and saturates to [0, 255]
+inline __m128i applyOffset(const __m128i& y_lo, const __m128i& y_hi, const __m128i& offset)
+{
+  __m128i lo = _mm_add_epi16(y_lo, _mm_unpacklo_epi16(offset, offset));
+  __m128i hi = _mm_add_epi16(y_hi, _mm_unpackhi_epi16(offset, offset));
+  return _mm_packus_epi16(lo, hi);
+}
+
+template <YuvFormat F>
+void colorRow(const RowPointers& p, int width, uint8_t* bgr, const YuvCoeffs& c)
+{
+  // Coefficients larger than 16 bits are split across both halves of the madd pair
+  const __m128i b_coeffs = maddCoeffs(c.ub / 2, c.ub - c.ub / 2);
+  const __m128i g_coeffs = maddCoeffs(c.vg, c.ug);
+  const __m128i r_coeffs = maddCoeffs(c.vr / 2, c.vr - c.vr / 2);
+  const __m128i bias = _mm_set1_epi16(128);
+
+  int x = 0;
+  for ( ; x + 16 <= width; x += 16) {
+    __m128i y_lo, y_hi, u, v;
+    load16<F>(p, x, y_lo, y_hi, u, v);
+    u = _mm_sub_epi16(u, bias);
+    v = _mm_sub_epi16(v, bias);
+
+    union { __m128i v; uint8_t b[16]; } b, g, r;
+    b.v = applyOffset(y_lo, y_hi, chromaOffset(u, u, b_coeffs));
+    g.v = applyOffset(y_lo, y_hi, chromaOffset(v, u, g_coeffs));
+    r.v = applyOffset(y_lo, y_hi, chromaOffset(v, v, r_coeffs));
+
+    uint8_t* out = bgr + x*3;
+    for (int i = 0; i < 16; ++i, out += 3) {
+      out[0] = b.b[i];
+      out[1] = g.b[i];
+      out[2] = r.b[i];
+    }
+  }
+  colorRowScalar<F>(p, x, width, bgr, c);
+}
+
+#else
+
+template <YuvFormat F>
+void colorRow(const RowPointers& p, int width, uint8_t* bgr, const YuvCoeffs& c)
+{
+  colorRowScalar<F>(p, 0, width, bgr, c);
+}
+
+#endif
+
+// Converts rows [begin, end) of the image
+template <YuvFormat F>
+void convertColor(const cv::Mat& yuv, cv::Mat& color, int height, YuvCoeffs c, int begin, int end)
+{
+  for (int r = begin; r < end; ++r)
+    colorRow<F>(rowPointers<F>(yuv, height, r), color.cols, color.ptr<uint8_t>(r), c);
+}
+
+// Copies the luma samples of a packed 4:2:2 row, offset = 1 for UYVY and 0 for YUYV
+void grayRowPacked(const uint8_t* yuv, int width, uint8_t* gray, int offset)
+{
+  int x = 0;
+#if defined(__SSE2__)
+  const __m128i low_byte = _mm_set1_epi16(0x00ff);
+  for ( ; x + 16 <= width; x += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(yuv + 2*x));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(yuv + 2*x + 16));
+    if (offset) {
+      a = _mm_srli_epi16(a, 8);
+      b = _mm_srli_epi16(b, 8);
+    }
+    else {
+      a = _mm_and_si128(a, low_byte);
+      b = _mm_and_si128(b, low_byte);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(gray + x), _mm_packus_epi16(a, b));
+  }
+#endif
+  for ( ; x < width; ++x)
+    gray[x] = yuv[2*x + offset];
+}
+
+void convertGray(const cv::Mat& yuv, cv::Mat& gray, YuvFormat format, int begin, int end)
+{
+  if (format == YUV_UYVY || format == YUV_YUYV) {
+    int offset = (format == YUV_UYVY) ? 1 : 0;
+    for (int r = begin; r < end; ++r)
+      grayRowPacked(yuv.ptr<uint8_t>(r), gray.cols, gray.ptr<uint8_t>(r), offset);
+  }
+  else {
+    // Luma plane is already a mono image
+    for (int r = begin; r < end; ++r)
+      memcpy(gray.ptr<uint8_t>(r), yuv.ptr<uint8_t>(r), gray.cols);
+  }
+}
+
+inline int imageHeight(const cv::Mat& yuv, YuvFormat format)
+{
+  return (format == YUV_UYVY || format == YUV_YUYV) ? yuv.rows : yuv.rows * 2 / 3;
+}
+
+// Rows are converted in bands of at least this many pixels, so small images
+// are not worth waking the workers for
+const int MIN_BAND_PIXELS = 1 << 16;
+
+inline int minBandRows(int width)
+{
+  return std::max(1, MIN_BAND_PIXELS / std::max(width, 1));
+}
+
+} // namespace
+
+bool yuvFormatFromEncoding(const std::string& encoding, YuvFormat& format)
+{
+  if (encoding == sensor_msgs::image_encodings::YUV422)
+    format = YUV_UYVY;
+  else if (encoding == yuv_encodings::YUV422_YUY2)
+    format = YUV_YUYV;
+  else if (encoding == yuv_encodings::NV12)
+    format = YUV_NV12;
+  else if (encoding == yuv_encodings::I420)
+    format = YUV_I420;
+  else
+    return false;
+  return true;
+}
+
+cv::Mat wrapYuv(uint8_t* data, int width, int height, size_t step, YuvFormat format)
+{
+  if (format == YUV_UYVY || format == YUV_YUYV)
+    return cv::Mat(height, width, CV_8UC2, data, step);
+  return cv::Mat(height * 3 / 2, width, CV_8UC1, data, step);
+}
+
+void yuvToGray(const cv::Mat& yuv, cv::Mat& gray, YuvFormat format)
+{
+  int height = imageHeight(yuv, format);
+  gray.create(height, yuv.cols, CV_8UC1);
+
+  parallelFor(0, height, boost::bind(convertGray, boost::cref(yuv), boost::ref(gray), format, _1, _2),
+              minBandRows(gray.cols));
+}
+
+void yuvToColor(const cv::Mat& yuv, cv::Mat& color, YuvFormat format, YuvMatrix matrix)
+{
+  int height = imageHeight(yuv, format);
+  color.create(height, yuv.cols, CV_8UC3);
+
+  // Every output row depends only on its own input rows, so bands can run in any order
+  const YuvCoeffs& c = coeffsFor(matrix);
+  void (*convert)(const cv::Mat&, cv::Mat&, int, YuvCoeffs, int, int) = NULL;
+  switch (format) {
+    case YUV_UYVY: convert = convertColor<YUV_UYVY>; break;
+    case YUV_YUYV: convert = convertColor<YUV_YUYV>; break;
+    case YUV_NV12: convert = convertColor<YUV_NV12>; break;
+    case YUV_I420: convert = convertColor<YUV_I420>; break;
+  }
+  parallelFor(0, height, boost::bind(convert, boost::cref(yuv), boost::ref(color), height, c, _1, _2),
+              minBandRows(color.cols));
+}
+
+} // namespace image_proc
@@ -5,7 +5,9 @@
 #include <dynamic_reconfigure/server.h>
 #include <cv_bridge/cv_bridge.h>
 #include <image_proc/CropDecimateConfig.h>
+#include <image_proc/config_snapshot.h>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <image_proc/nodelet_stats.h>
 
 namespace image_proc {
 
@@ -26,7 +28,10 @@ class CropDecimateNodelet : public nodelet::Nodelet
   typedef image_proc::CropDecimateConfig Config;
   typedef dynamic_reconfigure::Server<Config> ReconfigureServer;
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
-  Config config_;
+  ConfigSnapshot<Config> config_;
+
+  // Frame statistics
+  NodeletStats stats_;
 
   virtual void onInit();
 
@@ -61,6 +66,8 @@ void CropDecimateNodelet::onInit()
   // Make sure we don't enter connectCb() between advertising and assigning to pub_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_ = it_out_->advertiseCamera("image_raw",  1, connect_cb, connect_cb, connect_cb_info, connect_cb_info);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -132,16 +139,19 @@ void decimate(const cv::Mat& src, cv::Mat& dst, int decimation_x, int decimation
 void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
                                   const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
+  FrameTimer timer(stats_, image_msg->header);
+
   /// @todo Check image dimensions match info_msg
   /// @todo Publish tweaks to config_ so they appear in reconfigure_gui
 
-  Config config;
-  {
-    boost::lock_guard<boost::recursive_mutex> lock(config_mutex_);
-    config = config_;
-  }
+  ConfigSnapshot<Config>::ConstPtr config_ptr = config_.load();
+  const Config& config = *config_ptr;
   int decimation_x = config.decimation_x;
   int decimation_y = config.decimation_y;
+  int x_offset = config.x_offset;
+  int y_offset = config.y_offset;
+  int width = config.width;
+  int height = config.height;
 
   // Compute the ROI we'll actually use
   bool is_bayer = sensor_msgs::image_encodings::isBayer(image_msg->encoding);
@@ -149,16 +159,14 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   {
     // Odd offsets for Bayer images basically change the Bayer pattern, but that's
     // unnecessarily complicated to support
-    config.x_offset &= ~0x1;
-    config.y_offset &= ~0x1;
-    config.width &= ~0x1;
-    config.height &= ~0x1;    
+    x_offset &= ~0x1;
+    y_offset &= ~0x1;
+    width &= ~0x1;
+    height &= ~0x1;
   }
 
-  int max_width = image_msg->width - config.x_offset;
-  int max_height = image_msg->height - config.y_offset;
-  int width = config.width;
-  int height = config.height;
+  int max_width = image_msg->width - x_offset;
+  int max_height = image_msg->height - y_offset;
   if (width == 0 || width > max_width)
     width = max_width;
   if (height == 0 || height > max_height)
@@ -167,12 +175,13 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   // On no-op, just pass the messages along
   if (decimation_x == 1               &&
       decimation_y == 1               &&
-      config.x_offset == 0            &&
-      config.y_offset == 0            &&
+      x_offset == 0                   &&
+      y_offset == 0                   &&
       width  == (int)image_msg->width &&
       height == (int)image_msg->height)
   {
     pub_.publish(image_msg, info_msg);
+    timer.published();
     return;
   }
 
@@ -182,7 +191,7 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   // Except in Bayer downsampling case, output has same encoding as the input
   CvImage output(source->header, source->encoding);
   // Apply ROI (no copy, still a view of the image_msg data)
-  output.image = source->image(cv::Rect(config.x_offset, config.y_offset, width, height));
+  output.image = source->image(cv::Rect(x_offset, y_offset, width, height));
 
   // Special case: when decimating Bayer images, we first do a 2x2 decimation to BGR
   if (is_bayer && (decimation_x > 1 || decimation_y > 1))
@@ -285,8 +294,8 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   int binning_y = std::max((int)info_msg->binning_y, 1);
   out_info->binning_x = binning_x * config.decimation_x;
   out_info->binning_y = binning_y * config.decimation_y;
-  out_info->roi.x_offset += config.x_offset * binning_x;
-  out_info->roi.y_offset += config.y_offset * binning_y;
+  out_info->roi.x_offset += x_offset * binning_x;
+  out_info->roi.y_offset += y_offset * binning_y;
   out_info->roi.height = height * binning_y;
   out_info->roi.width = width * binning_x;
   // If no ROI specified, leave do_rectify as-is. If ROI specified, set do_rectify = true.
@@ -294,11 +303,12 @@ void CropDecimateNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
     out_info->roi.do_rectify = true;
   
   pub_.publish(out_image, out_info);
+  timer.published();
 }
 
 void CropDecimateNodelet::configCb(Config &config, uint32_t level)
 {
-  config_ = config;
+  config_.store(config);
 }
 
 } // namespace image_proc
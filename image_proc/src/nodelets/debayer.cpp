@@ -8,7 +8,9 @@
 #include <opencv2/imgproc/imgproc.hpp>
 // Until merged into OpenCV
 #include "edge_aware.h"
-#include "yuv422.h"
+#include "image_proc/yuv.h"
+#include "image_proc/config_snapshot.h"
+#include "image_proc/nodelet_stats.h"
 
 #include <boost/make_shared.hpp>
 
@@ -31,7 +33,10 @@ class DebayerNodelet : public nodelet::Nodelet
   typedef image_proc::DebayerConfig Config;
   typedef dynamic_reconfigure::Server<Config> ReconfigureServer;
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
-  Config config_;
+  ConfigSnapshot<Config> config_;
+
+  // Frame statistics
+  NodeletStats stats_;
 
   virtual void onInit();
 
@@ -60,6 +65,8 @@ void DebayerNodelet::onInit()
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_mono_  = it_->advertise("image_mono",  1, connect_cb, connect_cb);
   pub_color_ = it_->advertise("image_color", 1, connect_cb, connect_cb);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -77,14 +84,18 @@ void DebayerNodelet::connectCb()
 
 void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
 {
+  FrameTimer timer(stats_, raw_msg->header);
+
   /// @todo Could simplify this whole method by explicitly constructing a map
   /// from raw encoding to OpenCV cvtColor code
+  YuvFormat yuv_format;
   
   if (enc::isMono(raw_msg->encoding))
   {
     // For monochrome, no processing needed!
     pub_mono_.publish(raw_msg);
     pub_color_.publish(raw_msg);
+    timer.published();
     
     // Warn if the user asked for color
     if (pub_color_.getNumSubscribers() > 0)
@@ -97,6 +108,7 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
   else if (enc::isColor(raw_msg->encoding))
   {
     pub_color_.publish(raw_msg);
+    timer.published();
     
     // Convert to monochrome if needed
     if (pub_mono_.getNumSubscribers() > 0)
@@ -133,6 +145,7 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
       cv::cvtColor(color, gray, code);
 
       pub_mono_.publish(gray_msg);
+      timer.published();
     }
   }
   else if (enc::isBayer(raw_msg->encoding)) {
@@ -170,6 +183,7 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
       cv::cvtColor(bayer, gray, code);
       
       pub_mono_.publish(gray_msg);
+      timer.published();
     }
 
     if (pub_color_.getNumSubscribers() > 0)
@@ -185,11 +199,7 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
       cv::Mat color(color_msg->height, color_msg->width, CV_MAKETYPE(type, 3),
                     &color_msg->data[0], color_msg->step);
 
-      int algorithm;
-      {
-        boost::lock_guard<boost::recursive_mutex> lock(config_mutex_);
-        algorithm = config_.debayer;
-      }
+      int algorithm = config_.load()->debayer;
       
       if (algorithm == Debayer_EdgeAware ||
           algorithm == Debayer_EdgeAwareWeighted)
@@ -233,12 +243,13 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
       }
       
       pub_color_.publish(color_msg);
+      timer.published();
     }
   }
-  else if (raw_msg->encoding == enc::YUV422)
+  else if (yuvFormatFromEncoding(raw_msg->encoding, yuv_format))
   {
-    const cv::Mat yuv(raw_msg->height, raw_msg->width, CV_8UC2,
-                      const_cast<uint8_t*>(&raw_msg->data[0]), raw_msg->step);
+    const cv::Mat yuv = wrapYuv(const_cast<uint8_t*>(&raw_msg->data[0]), raw_msg->width,
+                                raw_msg->height, raw_msg->step, yuv_format);
     
     if (pub_mono_.getNumSubscribers() > 0)
     {
@@ -252,9 +263,10 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
 
       cv::Mat gray(gray_msg->height, gray_msg->width, CV_8UC1,
                    &gray_msg->data[0], gray_msg->step);
-      yuv422ToGray(yuv, gray);
+      yuvToGray(yuv, gray, yuv_format);
 
       pub_mono_.publish(gray_msg);
+      timer.published();
     }
 
     if (pub_color_.getNumSubscribers() > 0)
@@ -269,9 +281,11 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
 
       cv::Mat color(color_msg->height, color_msg->width, CV_8UC3,
                     &color_msg->data[0], color_msg->step);
-      yuv422ToColor(yuv, color);
+
+      yuvToColor(yuv, color, yuv_format, YuvMatrix(config_.load()->yuv_matrix));
 
       pub_color_.publish(color_msg);
+      timer.published();
     }
   }
   else if (raw_msg->encoding == enc::TYPE_8UC3)
@@ -291,7 +305,7 @@ void DebayerNodelet::imageCb(const sensor_msgs::ImageConstPtr& raw_msg)
 
 void DebayerNodelet::configCb(Config &config, uint32_t level)
 {
-  config_ = config;
+  config_.store(config);
 }
 
 } // namespace image_proc
@@ -5,6 +5,8 @@
 #include <cv_bridge/CvBridge.h>
 #include <dynamic_reconfigure/server.h>
 #include <image_proc/RectifyConfig.h>
+#include <image_proc/config_snapshot.h>
+#include <image_proc/nodelet_stats.h>
 
 namespace image_proc {
 
@@ -23,11 +25,14 @@ class RectifyNodelet : public nodelet::Nodelet
   typedef image_proc::RectifyConfig Config;
   typedef dynamic_reconfigure::Server<Config> ReconfigureServer;
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
-  Config config_;
+  ConfigSnapshot<Config> config_;
 
   // Processing state (note: only safe because we're using single-threaded NodeHandle!)
   image_geometry::PinholeCameraModel model_;
 
+  // Frame statistics
+  NodeletStats stats_;
+
   virtual void onInit();
 
   void connectCb();
@@ -57,6 +62,8 @@ void RectifyNodelet::onInit()
   // Make sure we don't enter connectCb() between advertising and assigning to pub_rect_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_rect_  = it_->advertise("image_rect",  1, connect_cb, connect_cb);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -75,6 +82,8 @@ void RectifyNodelet::connectCb()
 void RectifyNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
                              const sensor_msgs::CameraInfoConstPtr& info_msg)
 {
+  FrameTimer timer(stats_, image_msg->header);
+
   // Verify camera is actually calibrated
   if (info_msg->K[0] == 0.0) {
     NODELET_ERROR_THROTTLE(30, "Rectified topic '%s' requested but camera publishing '%s' "
@@ -87,6 +96,7 @@ void RectifyNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   if (info_msg->D.empty() || info_msg->D[0] == 0.0)
   {
     pub_rect_.publish(image_msg);
+    timer.published();
     return;
   }
 
@@ -108,18 +118,14 @@ void RectifyNodelet::imageCb(const sensor_msgs::ImageConstPtr& image_msg,
   cv::Mat rect = rect_bridge.imgMsgToCv(rect_msg);
 
   // Rectify and publish
-  int interpolation;
-  {
-    boost::lock_guard<boost::recursive_mutex> lock(config_mutex_);
-    interpolation = config_.interpolation;
-  }
-  model_.rectifyImage(image, rect, interpolation);
+  model_.rectifyImage(image, rect, config_.load()->interpolation);
   pub_rect_.publish(rect_msg);
+  timer.published();
 }
 
 void RectifyNodelet::configCb(Config &config, uint32_t level)
 {
-  config_ = config;
+  config_.store(config);
 }
 
 } // namespace image_proc
@@ -0,0 +1,198 @@
+#include <gtest/gtest.h>
+#include <image_proc/pipeline.h>
+#include <boost/make_shared.hpp>
+#include <boost/thread/thread.hpp>
+#include <stdexcept>
+#include <vector>
+
+using namespace image_proc;
+
+namespace {
+
+struct Item
+{
+  int id;
+  std::vector<int> stages; // stages the item went through, in order
+};
+
+typedef Pipeline<Item> ItemPipeline;
+
+// Records the ids of the items leaving the last stage
+class Sink
+{
+public:
+  void operator()(Item& item)
+  {
+    item.stages.push_back(2);
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    ids_.push_back(item.id);
+    items_.push_back(item);
+  }
+
+  std::vector<int> ids() const
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return ids_;
+  }
+
+  std::vector<Item> items() const
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return items_;
+  }
+
+private:
+  mutable boost::mutex mutex_;
+  std::vector<int> ids_;
+  std::vector<Item> items_;
+};
+
+// Holds the items entering a stage until opened, and tells when one is held
+class Gate
+{
+public:
+  Gate() : open_(false), waiting_(0) {}
+
+  void operator()(Item& item)
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    ++waiting_;
+    changed_.notify_all();
+    while (!open_)
+      changed_.wait(lock);
+    item.stages.push_back(0);
+  }
+
+  void waitForItem()
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (waiting_ == 0)
+      changed_.wait(lock);
+  }
+
+  void open()
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    open_ = true;
+    changed_.notify_all();
+  }
+
+private:
+  boost::mutex mutex_;
+  boost::condition_variable changed_;
+  bool open_;
+  int waiting_;
+};
+
+// Sleeps for a time that varies with the item, so stages finish out of step
+void sleepy(Item& item, int stage, int period)
+{
+  boost::this_thread::sleep(boost::posix_time::microseconds(100 * (item.id % period)));
+  item.stages.push_back(stage);
+}
+
+void failOn(Item& item, int id)
+{
+  if (item.id == id)
+    throw std::runtime_error("failing on purpose");
+  item.stages.push_back(1);
+}
+
+boost::shared_ptr<Item> makeItem(int id)
+{
+  boost::shared_ptr<Item> item = boost::make_shared<Item>();
+  item->id = id;
+  return item;
+}
+
+} // namespace
+
+TEST(Pipeline, order)
+{
+  Sink sink;
+  std::vector<ItemPipeline::Stage> stages;
+  stages.push_back(boost::bind(sleepy, _1, 0, 3));
+  stages.push_back(boost::bind(sleepy, _1, 1, 5));
+  stages.push_back(boost::ref(sink));
+  const int num_items = 40;
+  {
+    // Deep enough that nothing is dropped
+    ItemPipeline pipeline(stages, num_items);
+    for (int i = 0; i < num_items; ++i)
+      EXPECT_TRUE(pipeline.push(makeItem(i)));
+  }
+
+  // The destructor finished them all, in order, through every stage
+  std::vector<Item> items = sink.items();
+  ASSERT_EQ(num_items, (int)items.size());
+  for (int i = 0; i < num_items; ++i) {
+    EXPECT_EQ(i, items[i].id);
+    ASSERT_EQ(3u, items[i].stages.size());
+    for (int s = 0; s < 3; ++s)
+      EXPECT_EQ(s, items[i].stages[s]);
+  }
+}
+
+TEST(Pipeline, dropOldest)
+{
+  Gate gate;
+  Sink sink;
+  std::vector<ItemPipeline::Stage> stages;
+  stages.push_back(boost::ref(gate));
+  stages.push_back(boost::bind(sleepy, _1, 1, 1));
+  stages.push_back(boost::ref(sink));
+  ItemPipeline pipeline(stages, 2);
+
+  // Item 0 is held in the first stage, items 1 and 2 fill its queue
+  EXPECT_TRUE(pipeline.push(makeItem(0)));
+  gate.waitForItem();
+  EXPECT_TRUE(pipeline.push(makeItem(1)));
+  EXPECT_TRUE(pipeline.push(makeItem(2)));
+  // Each further item drops the oldest waiting one, never the one being worked on
+  EXPECT_FALSE(pipeline.push(makeItem(3)));
+  EXPECT_FALSE(pipeline.push(makeItem(4)));
+  gate.open();
+  pipeline.flush();
+
+  std::vector<int> ids = sink.ids();
+  ASSERT_EQ(3u, ids.size());
+  EXPECT_EQ(0, ids[0]);
+  EXPECT_EQ(3, ids[1]);
+  EXPECT_EQ(4, ids[2]);
+}
+
+TEST(Pipeline, flush)
+{
+  Sink sink;
+  std::vector<ItemPipeline::Stage> stages;
+  stages.push_back(boost::bind(sleepy, _1, 0, 4));
+  stages.push_back(boost::bind(failOn, _1, 5));
+  stages.push_back(boost::ref(sink));
+  ItemPipeline pipeline(stages, 16);
+
+  // Returns at once with nothing pushed
+  pipeline.flush();
+  EXPECT_TRUE(sink.ids().empty());
+
+  // Waits for every item pushed so far, including the one dropped by a failing stage
+  for (int i = 0; i < 10; ++i)
+    pipeline.push(makeItem(i));
+  pipeline.flush();
+  std::vector<int> ids = sink.ids();
+  ASSERT_EQ(9u, ids.size());
+  for (int i = 0; i < 9; ++i)
+    EXPECT_EQ(i < 5 ? i : i + 1, ids[i]);
+
+  // And the pipeline keeps going afterwards
+  pipeline.push(makeItem(10));
+  pipeline.flush();
+  ids = sink.ids();
+  ASSERT_EQ(10u, ids.size());
+  EXPECT_EQ(10, ids.back());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
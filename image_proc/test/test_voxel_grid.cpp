@@ -0,0 +1,243 @@
+#include <gtest/gtest.h>
+#include <image_proc/voxel_grid.h>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <vector>
+
+using namespace image_proc;
+
+namespace {
+
+struct Voxel
+{
+  int x, y, z;
+
+  bool operator<(const Voxel& other) const
+  {
+    if (x != other.x) return x < other.x;
+    if (y != other.y) return y < other.y;
+    return z < other.z;
+  }
+};
+
+struct Sums
+{
+  int count;
+  double sum[3];
+  int rgb[3];
+
+  Sums() : count(0)
+  {
+    for (int j = 0; j < 3; ++j) {
+      sum[j] = 0.0;
+      rgb[j] = 0;
+    }
+  }
+};
+
+typedef std::map<Voxel, Sums> Reference;
+
+float packColor(int r, int g, int b)
+{
+  uint32_t rgb = (r << 16) | (g << 8) | b;
+  float f;
+  memcpy(&f, &rgb, sizeof(f));
+  return f;
+}
+
+void unpackColor(float f, int* rgb)
+{
+  uint32_t u;
+  memcpy(&u, &f, sizeof(u));
+  rgb[0] = (u >> 16) & 0xff;
+  rgb[1] = (u >> 8) & 0xff;
+  rgb[2] = u & 0xff;
+}
+
+void addPoint(std::vector<float>& points, float x, float y, float z, int r, int g, int b)
+{
+  points.push_back(x);
+  points.push_back(y);
+  points.push_back(z);
+  points.push_back(packColor(r, g, b));
+}
+
+// Straightforward voxelization, summing in double precision
+void addReference(Reference& reference, const std::vector<float>& points, float leaf_size)
+{
+  const float inv_leaf = 1.0f / leaf_size;
+  for (size_t i = 0; i + 3 < points.size(); i += 4) {
+    const float* p = &points[i];
+    if (std::isnan(p[0]) || std::isnan(p[1]) || std::isnan(p[2]))
+      continue;
+    Voxel v = { (int)std::floor(p[0] * inv_leaf), (int)std::floor(p[1] * inv_leaf),
+                (int)std::floor(p[2] * inv_leaf) };
+    Sums& s = reference[v];
+    ++s.count;
+    int rgb[3];
+    unpackColor(p[3], rgb);
+    for (int j = 0; j < 3; ++j) {
+      s.sum[j] += p[j];
+      s.rgb[j] += rgb[j];
+    }
+  }
+}
+
+// Reference voxel of a centroid, which may be on a face of its voxel up to rounding
+Reference::const_iterator findVoxel(const Reference& reference, const float* centroid, float leaf_size)
+{
+  const double offsets[3] = { 0.0, 1e-4, -1e-4 };
+  for (int k = 0; k < 3; ++k) {
+    Voxel v = { (int)std::floor(centroid[0] / leaf_size + offsets[k]),
+                (int)std::floor(centroid[1] / leaf_size + offsets[k]),
+                (int)std::floor(centroid[2] / leaf_size + offsets[k]) };
+    Reference::const_iterator it = reference.find(v);
+    if (it != reference.end())
+      return it;
+  }
+  return reference.end();
+}
+
+// The grid's centroids, each in the reference voxel it falls in, and mean colors
+void checkGrid(const VoxelGrid& grid, const Reference& reference)
+{
+  ASSERT_EQ(reference.size(), grid.size());
+  sensor_msgs::PointCloud2 cloud;
+  grid.toPointCloud2(cloud, true);
+  ASSERT_EQ(grid.size(), cloud.width);
+  ASSERT_EQ(16u, cloud.point_step);
+
+  const float leaf = grid.leafSize();
+  std::map<Voxel, int> seen;
+  for (size_t i = 0; i < cloud.width; ++i) {
+    const float* p = reinterpret_cast<const float*>(&cloud.data[i * cloud.point_step]);
+    Reference::const_iterator it = findVoxel(reference, p, leaf);
+    ASSERT_TRUE(it != reference.end()) << "no points around " << p[0] << " " << p[1] << " " << p[2];
+    const Voxel& v = it->first;
+    EXPECT_EQ(0, seen[v]++) << "voxel " << v.x << " " << v.y << " " << v.z << " output twice";
+    const Sums& s = it->second;
+    int rgb[3];
+    unpackColor(p[3], rgb);
+    for (int j = 0; j < 3; ++j) {
+      EXPECT_NEAR(s.sum[j] / s.count, p[j], 1e-3 * leaf);
+      EXPECT_EQ((s.rgb[j] + s.count / 2) / s.count, rgb[j]);
+    }
+  }
+}
+
+float uniform(float lo, float hi)
+{
+  return lo + (hi - lo) * (rand() / (RAND_MAX + 1.0f));
+}
+
+} // namespace
+
+// Tens of thousands of neighboring voxels, so many keys share probe runs
+TEST(VoxelGrid, collisions)
+{
+  const float leaf = 0.1f;
+  std::vector<float> points;
+  for (int x = 0; x < 30; ++x)
+    for (int y = 0; y < 30; ++y)
+      for (int z = 0; z < 30; ++z)
+        for (int k = 0; k < 2; ++k)
+          addPoint(points, (x + uniform(0.0f, 1.0f)) * leaf, (y + uniform(0.0f, 1.0f)) * leaf,
+                   (z + uniform(0.0f, 1.0f)) * leaf, rand() & 0xff, rand() & 0xff, rand() & 0xff);
+  // Shuffled, so the points of a voxel are not consecutive
+  for (size_t i = points.size() / 4 - 1; i > 0; --i) {
+    size_t j = rand() % (i + 1);
+    for (int k = 0; k < 4; ++k)
+      std::swap(points[4 * i + k], points[4 * j + k]);
+  }
+
+  VoxelGrid grid;
+  grid.reset(leaf);
+  grid.addPoints(&points[0], points.size() / 4);
+  Reference reference;
+  addReference(reference, points, leaf);
+  EXPECT_EQ(27000u, grid.size());
+  checkGrid(grid, reference);
+}
+
+// The table grows while points are added, and is kept but emptied by reset()
+TEST(VoxelGrid, growth)
+{
+  const float leaf = 0.05f;
+  VoxelGrid grid;
+  grid.reset(leaf);
+  Reference reference;
+  size_t previous = 0;
+  for (int batch = 0; batch < 20; ++batch) {
+    std::vector<float> points;
+    for (int i = 0; i < 500 * (batch + 1); ++i)
+      addPoint(points, uniform(-5.0f, 5.0f), uniform(-5.0f, 5.0f), uniform(0.0f, 10.0f), 10, 20, 30);
+    grid.addPoints(&points[0], points.size() / 4);
+    addReference(reference, points, leaf);
+    EXPECT_GE(grid.size(), previous);
+    previous = grid.size();
+  }
+  checkGrid(grid, reference);
+
+  // A smaller frame after the large ones
+  grid.reset(leaf);
+  EXPECT_EQ(0u, grid.size());
+  std::vector<float> points;
+  for (int i = 0; i < 100; ++i)
+    addPoint(points, uniform(0.0f, 1.0f), uniform(0.0f, 1.0f), uniform(0.0f, 1.0f), 255, 0, 0);
+  grid.addPoints(&points[0], points.size() / 4);
+  reference.clear();
+  addReference(reference, points, leaf);
+  checkGrid(grid, reference);
+
+  // Merging two halves gives the same voxels as adding all at once
+  VoxelGrid first, second;
+  first.reset(leaf);
+  second.reset(leaf);
+  first.addPoints(&points[0], 50);
+  second.addPoints(&points[200], 50);
+  first.merge(second);
+  checkGrid(first, reference);
+}
+
+// Voxels are found by flooring, so a point just below zero is in voxel -1
+TEST(VoxelGrid, negativeCoordinates)
+{
+  const float leaf = 0.5f;
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  std::vector<float> points;
+  addPoint(points, -0.1f, 0.1f, -0.1f, 0, 0, 0);
+  addPoint(points, -0.4f, 0.4f, -0.4f, 100, 100, 100);
+  addPoint(points, 0.1f, -0.1f, 0.1f, 0, 0, 0);
+  addPoint(points, -0.5f, -1.0f, -1.5f, 0, 0, 0);  // exactly on voxel faces
+  addPoint(points, -1e-7f, -1e-7f, -1e-7f, 0, 0, 0);
+  addPoint(points, -3.7f, -12.3f, -0.6f, 7, 8, 9);
+  for (int i = 0; i < 200; ++i)
+    addPoint(points, uniform(-20.0f, 20.0f), uniform(-20.0f, 20.0f), uniform(-20.0f, 20.0f),
+             rand() & 0xff, rand() & 0xff, rand() & 0xff);
+
+  VoxelGrid grid;
+  grid.reset(leaf);
+  grid.addPoints(&points[0], points.size() / 4);
+  Reference reference;
+  addReference(reference, points, leaf);
+  checkGrid(grid, reference);
+
+  // NaN points and points beyond the key range (2^20 leaves) are skipped
+  std::vector<float> skipped;
+  addPoint(skipped, nan, 0.0f, 1.0f, 0, 0, 0);
+  addPoint(skipped, 0.0f, 0.0f, nan, 0, 0, 0);
+  addPoint(skipped, -1.0e6f, 0.0f, 1.0f, 0, 0, 0);
+  addPoint(skipped, 0.0f, 1.0e6f, 1.0f, 0, 0, 0);
+  const size_t size = grid.size();
+  grid.addPoints(&skipped[0], skipped.size() / 4);
+  EXPECT_EQ(size, grid.size());
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+#include <image_proc/yuv.h>
+#include <image_proc/parallel.h>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace image_proc;
+
+namespace {
+
+int clip(int c)
+{
+  return c > 255 ? 255 : c < 0 ? 0 : c;
+}
+
+// Straightforward per-pixel conversion, matching the original UYVY implementation
+void referenceBgr(int y, int u, int v, YuvMatrix matrix, uint8_t* bgr)
+{
+  int ub = 33292, ug = -6472, vg = -9519, vr = 18678;
+  if (matrix == YUV_BT709) {
+    ub = 34865; ug = -3520; vg = -6236; vr = 20977;
+  }
+  u -= 128;
+  v -= 128;
+  bgr[0] = clip(y + ((u * ub + 8192) >> 14));
+  bgr[1] = clip(y + ((v * vg + u * ug + 8192) >> 14));
+  bgr[2] = clip(y + ((v * vr + 8192) >> 14));
+}
+
+// Returns the Y, U, V samples of pixel (x, r) from a buffer laid out as wrapYuv() expects
+void samples(const std::vector<uint8_t>& buf, int height, size_t step, YuvFormat format,
+             int x, int r, int& y, int& u, int& v)
+{
+  const uint8_t* row = &buf[r * step];
+  int j = x / 2;
+  switch (format) {
+    case YUV_UYVY:
+      y = row[2*x + 1]; u = row[4*j]; v = row[4*j + 2];
+      break;
+    case YUV_YUYV:
+      y = row[2*x]; u = row[4*j + 1]; v = row[4*j + 3];
+      break;
+    case YUV_NV12:
+      y = row[x]; u = buf[(height + r/2) * step + 2*j]; v = buf[(height + r/2) * step + 2*j + 1];
+      break;
+    case YUV_I420:
+    {
+      size_t chroma_step = step / 2;
+      const uint8_t* u_plane = &buf[height * step];
+      y = row[x];
+      u = u_plane[(r/2) * chroma_step + j];
+      v = u_plane[(height/2 + r/2) * chroma_step + j];
+      break;
+    }
+  }
+}
+
+void checkFormat(YuvFormat format, int width, int height)
+{
+  bool packed = (format == YUV_UYVY || format == YUV_YUYV);
+  // Padded rows, to catch any assumptions about continuous data
+  size_t step = (packed ? width * 2 : width) + 8;
+  std::vector<uint8_t> buf(step * (packed ? height : height * 3 / 2));
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = rand() & 0xff;
+  cv::Mat yuv = wrapYuv(&buf[0], width, height, step, format);
+
+  cv::Mat gray;
+  yuvToGray(yuv, gray, format);
+  ASSERT_EQ(height, gray.rows);
+  ASSERT_EQ(width, gray.cols);
+
+  for (int m = YUV_BT601; m <= YUV_BT709; ++m) {
+    cv::Mat color;
+    yuvToColor(yuv, color, format, YuvMatrix(m));
+    ASSERT_EQ(height, color.rows);
+    ASSERT_EQ(width, color.cols);
+
+    for (int r = 0; r < height; ++r) {
+      for (int x = 0; x < width; ++x) {
+        int y, u, v;
+        samples(buf, height, step, format, x, r, y, u, v);
+        uint8_t expected[3];
+        referenceBgr(y, u, v, YuvMatrix(m), expected);
+        const uint8_t* actual = color.ptr<uint8_t>(r) + 3*x;
+        ASSERT_EQ(expected[0], actual[0]) << "B at (" << x << "," << r << ")";
+        ASSERT_EQ(expected[1], actual[1]) << "G at (" << x << "," << r << ")";
+        ASSERT_EQ(expected[2], actual[2]) << "R at (" << x << "," << r << ")";
+        ASSERT_EQ(y, gray.at<uint8_t>(r, x));
+      }
+    }
+  }
+}
+
+bool sameImage(const cv::Mat& a, const cv::Mat& b)
+{
+  if (a.size() != b.size() || a.type() != b.type())
+    return false;
+  for (int r = 0; r < a.rows; ++r)
+    if (memcmp(a.ptr(r), b.ptr(r), a.cols * a.elemSize()) != 0)
+      return false;
+  return true;
+}
+
+// Widths exercise both the vectorized body and the scalar tail
+const int WIDTHS[] = { 2, 14, 16, 30, 64, 642 };
+const int NUM_WIDTHS = sizeof(WIDTHS) / sizeof(WIDTHS[0]);
+
+} // namespace
+
+TEST(Yuv, uyvy)
+{
+  for (int i = 0; i < NUM_WIDTHS; ++i)
+    checkFormat(YUV_UYVY, WIDTHS[i], 6);
+}
+
+TEST(Yuv, yuyv)
+{
+  for (int i = 0; i < NUM_WIDTHS; ++i)
+    checkFormat(YUV_YUYV, WIDTHS[i], 6);
+}
+
+TEST(Yuv, nv12)
+{
+  for (int i = 0; i < NUM_WIDTHS; ++i)
+    checkFormat(YUV_NV12, WIDTHS[i], 6);
+}
+
+TEST(Yuv, i420)
+{
+  for (int i = 0; i < NUM_WIDTHS; ++i)
+    checkFormat(YUV_I420, WIDTHS[i], 6);
+}
+
+// Output must not depend on how the rows are split between threads
+TEST(Yuv, bands)
+{
+  const int width = 1920, height = 1080;
+  for (int f = YUV_UYVY; f <= YUV_I420; ++f) {
+    YuvFormat format = YuvFormat(f);
+    bool packed = (format == YUV_UYVY || format == YUV_YUYV);
+    size_t step = packed ? width * 2 : width;
+    std::vector<uint8_t> buf(step * (packed ? height : height * 3 / 2));
+    for (size_t i = 0; i < buf.size(); ++i)
+      buf[i] = rand() & 0xff;
+    cv::Mat yuv = wrapYuv(&buf[0], width, height, step, format);
+
+    cv::Mat serial_color, serial_gray;
+    setGlobalWorkerThreads(1);
+    yuvToColor(yuv, serial_color, format);
+    yuvToGray(yuv, serial_gray, format);
+
+    cv::Mat color, gray;
+    setGlobalWorkerThreads(7);
+    yuvToColor(yuv, color, format);
+    yuvToGray(yuv, gray, format);
+    EXPECT_TRUE(sameImage(serial_color, color)) << "format " << f;
+    EXPECT_TRUE(sameImage(serial_gray, gray)) << "format " << f;
+  }
+  setGlobalWorkerThreads(0);
+}
+
+TEST(Yuv, encodings)
+{
+  YuvFormat format;
+  EXPECT_TRUE(yuvFormatFromEncoding("yuv422", format));
+  EXPECT_EQ(YUV_UYVY, format);
+  EXPECT_TRUE(yuvFormatFromEncoding(yuv_encodings::YUV422_YUY2, format));
+  EXPECT_EQ(YUV_YUYV, format);
+  EXPECT_TRUE(yuvFormatFromEncoding(yuv_encodings::NV12, format));
+  EXPECT_EQ(YUV_NV12, format);
+  EXPECT_TRUE(yuvFormatFromEncoding(yuv_encodings::I420, format));
+  EXPECT_EQ(YUV_I420, format);
+  EXPECT_FALSE(yuvFormatFromEncoding("bgr8", format));
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,57 @@
+#include <image_proc/yuv.h>
+#include <image_proc/parallel.h>
+#include <boost/thread/thread.hpp>
+#include <ros/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Times yuvToColor and yuvToGray on a 1080p UYVY frame for 1..N worker threads.
+// Usage: yuv_benchmark [max_threads] [iterations]
+
+using namespace image_proc;
+
+double timeConversion(const cv::Mat& yuv, bool color, int iterations)
+{
+  cv::Mat out;
+  // Warm up, also allocates the output
+  if (color) yuvToColor(yuv, out, YUV_UYVY);
+  else       yuvToGray(yuv, out, YUV_UYVY);
+
+  ros::WallTime start = ros::WallTime::now();
+  for (int i = 0; i < iterations; ++i) {
+    if (color) yuvToColor(yuv, out, YUV_UYVY);
+    else       yuvToGray(yuv, out, YUV_UYVY);
+  }
+  return (ros::WallTime::now() - start).toSec() * 1000.0 / iterations;
+}
+
+int main(int argc, char** argv)
+{
+  int max_threads = (argc > 1) ? atoi(argv[1]) : boost::thread::hardware_concurrency();
+  int iterations = (argc > 2) ? atoi(argv[2]) : 200;
+  if (max_threads < 1) max_threads = 1;
+
+  const int width = 1920, height = 1080;
+  std::vector<uint8_t> buf(width * height * 2);
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = rand() & 0xff;
+  cv::Mat yuv = wrapYuv(&buf[0], width, height, width * 2, YUV_UYVY);
+
+  printf("%dx%d UYVY, %d iterations\n", width, height, iterations);
+  printf("threads   color ms  speedup    gray ms  speedup\n");
+  double color_serial = 0.0, gray_serial = 0.0;
+  for (int n = 1; n <= max_threads; ++n) {
+    setGlobalWorkerThreads(n);
+    double color_ms = timeConversion(yuv, true, iterations);
+    double gray_ms = timeConversion(yuv, false, iterations);
+    if (n == 1) {
+      color_serial = color_ms;
+      gray_serial = gray_ms;
+    }
+    printf("%7d %10.3f %8.2f %10.3f %8.2f\n", n,
+           color_ms, color_serial / color_ms, gray_ms, gray_serial / gray_ms);
+  }
+
+  return 0;
+}
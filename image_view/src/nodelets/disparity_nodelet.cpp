@@ -34,6 +34,7 @@ class DisparityNodelet : public nodelet::Nodelet
 
   std::string window_name_;
   ros::Subscriber sub_;
+  cv::Mat_<float> disparity_float_; // converted 16SC1 disparities
   cv::Mat_<cv::Vec3b> disparity_color_;
   
   virtual void onInit();
@@ -92,11 +93,12 @@ void DisparityNodelet::imageCb(const stereo_msgs::DisparityImageConstPtr& msg)
                            "max_disparity are not set");
     return;
   }
-  if (msg->image.encoding != sensor_msgs::image_encodings::TYPE_32FC1)
+  namespace enc = sensor_msgs::image_encodings;
+  if (msg->image.encoding != enc::TYPE_32FC1 && msg->image.encoding != enc::TYPE_16SC1)
   {
     NODELET_ERROR_THROTTLE(30, "Disparity image must be 32-bit floating point "
-                           "(encoding '32FC1'), but has encoding '%s'",
-                           msg->image.encoding.c_str());
+                           "(encoding '32FC1') or 16-bit fixed point (encoding '16SC1'), "
+                           "but has encoding '%s'", msg->image.encoding.c_str());
     return;
   }
   
@@ -105,8 +107,18 @@ void DisparityNodelet::imageCb(const stereo_msgs::DisparityImageConstPtr& msg)
   float max_disparity = msg->max_disparity;
   float multiplier = 255.0f / (max_disparity - min_disparity);
 
-  const cv::Mat_<float> dmat(msg->image.height, msg->image.width,
-                             (float*)&msg->image.data[0], msg->image.step);
+  cv::Mat_<float> dmat;
+  if (msg->image.encoding == enc::TYPE_16SC1) {
+    // Fixed point, d = value * delta_d
+    const cv::Mat_<int16_t> fixed(msg->image.height, msg->image.width,
+                                  (int16_t*)&msg->image.data[0], msg->image.step);
+    fixed.convertTo(disparity_float_, CV_32F, msg->delta_d);
+    dmat = disparity_float_;
+  }
+  else {
+    dmat = cv::Mat_<float>(msg->image.height, msg->image.width,
+                           (float*)&msg->image.data[0], msg->image.step);
+  }
   disparity_color_.create(msg->image.height, msg->image.width);
     
   for (int row = 0; row < disparity_color_.rows; ++row) {
@@ -349,6 +349,7 @@ private:
   ImageConstPtr last_left_msg_, last_right_msg_;
   cv::Mat last_left_image_, last_right_image_;
   CvBridge left_bridge_, right_bridge_;
+  cv::Mat_<float> disparity_float_; // converted 16SC1 disparities
   cv::Mat_<cv::Vec3b> disparity_color_;
   boost::mutex image_mutex_;
   
@@ -465,9 +466,19 @@ public:
     float max_disparity = disparity_msg->max_disparity;
     float multiplier = 255.0f / (max_disparity - min_disparity);
 
-    assert(disparity_msg->image.encoding == enc::TYPE_32FC1);
-    const cv::Mat_<float> dmat(disparity_msg->image.height, disparity_msg->image.width,
-                               (float*)&disparity_msg->image.data[0], disparity_msg->image.step);
+    cv::Mat_<float> dmat;
+    if (disparity_msg->image.encoding == enc::TYPE_16SC1) {
+      // Fixed point, d = value * delta_d
+      const cv::Mat_<int16_t> fixed(disparity_msg->image.height, disparity_msg->image.width,
+                                    (int16_t*)&disparity_msg->image.data[0], disparity_msg->image.step);
+      fixed.convertTo(disparity_float_, CV_32F, disparity_msg->delta_d);
+      dmat = disparity_float_;
+    }
+    else {
+      assert(disparity_msg->image.encoding == enc::TYPE_32FC1);
+      dmat = cv::Mat_<float>(disparity_msg->image.height, disparity_msg->image.width,
+                             (float*)&disparity_msg->image.data[0], disparity_msg->image.step);
+    }
     disparity_color_.create(disparity_msg->image.height, disparity_msg->image.width);
     
     for (int row = 0; row < disparity_color_.rows; ++row) {
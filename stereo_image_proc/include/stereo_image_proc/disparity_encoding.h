@@ -0,0 +1,65 @@
+#ifndef STEREO_IMAGE_PROC_DISPARITY_ENCODING_H
+#define STEREO_IMAGE_PROC_DISPARITY_ENCODING_H
+
+#include <stereo_msgs/DisparityImage.h>
+#include <sensor_msgs/image_encodings.h>
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+
+namespace stereo_image_proc {
+
+/**
+ * DisparityImage data is either TYPE_32FC1 disparities, or the compact TYPE_16SC1 fixed
+ * point format where d = value * delta_d (delta_d = 1/16 from the stereo matchers). Both
+ * include the principal point offset correction; rejected pixels have the lowest value.
+ *
+ * Returns the disparities as floats, wrapping 32FC1 data without copying and converting
+ * 16SC1 data into buffer. Returns an empty matrix for other encodings, or if the data is
+ * shorter than the size and step imply.
+ */
+inline cv::Mat_<float> floatDisparity(const stereo_msgs::DisparityImage& disparity, cv::Mat_<float>& buffer)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  const sensor_msgs::Image& dimage = disparity.image;
+  if (dimage.height == 0 || dimage.width == 0 || dimage.data.size() < (size_t)dimage.height * dimage.step)
+    return cv::Mat_<float>();
+  if (dimage.encoding == enc::TYPE_32FC1 && dimage.step >= dimage.width * sizeof(float))
+    return cv::Mat_<float>(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
+  if (dimage.encoding == enc::TYPE_16SC1 && dimage.step >= dimage.width * sizeof(int16_t)) {
+    const cv::Mat_<int16_t> fixed(dimage.height, dimage.width, (int16_t*)&dimage.data[0], dimage.step);
+    fixed.convertTo(buffer, CV_32F, disparity.delta_d);
+    return buffer;
+  }
+  return cv::Mat_<float>();
+}
+
+/**
+ * The valid_window of a DisparityImage as a rectangle clipped to the image; pixels
+ * outside it are all rejected. An unset window (zero size) stands for the whole image.
+ */
+inline cv::Rect validWindow(const stereo_msgs::DisparityImage& disparity)
+{
+  const sensor_msgs::RegionOfInterest& roi = disparity.valid_window;
+  const int width = disparity.image.width, height = disparity.image.height;
+  if (roi.width == 0 || roi.height == 0)
+    return cv::Rect(0, 0, width, height);
+  int x0 = std::min<int>(roi.x_offset, width), y0 = std::min<int>(roi.y_offset, height);
+  int x1 = std::min<int>(roi.x_offset + roi.width, width);
+  int y1 = std::min<int>(roi.y_offset + roi.height, height);
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Sets the pixels of image outside window (which lies within the image) to value
+template <typename T>
+void fillOutside(cv::Mat_<T>& image, const cv::Rect& window, T value)
+{
+  image.rowRange(0, window.y).setTo(value);
+  image.rowRange(window.y + window.height, image.rows).setTo(value);
+  cv::Mat_<T> middle = image.rowRange(window.y, window.y + window.height);
+  middle.colRange(0, window.x).setTo(value);
+  middle.colRange(window.x + window.width, image.cols).setTo(value);
+}
+
+} // namespace stereo_image_proc
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef STEREO_IMAGE_PROC_NODELET_PARAMS_H
+#define STEREO_IMAGE_PROC_NODELET_PARAMS_H
+
+#include <ros/node_handle.h>
+#include <stereo_image_proc/DisparityConfig.h>
+#include "stereo_image_proc/processor.h"
+#include "stereo_image_proc/reprojection.h"
+
+namespace stereo_image_proc {
+
+// Tweaks the settings of a dynamic_reconfigure request to be valid, in place
+void fixDisparityConfig(DisparityConfig& config);
+
+// Gives the stereo matching and disparity output settings of config to processor
+void applyDisparityConfig(const DisparityConfig& config, StereoProcessor& processor);
+
+// PointCloud2 output settings of the nodelets that reproject disparities
+struct CloudParams
+{
+  PointFilter filter;
+  bool dense;
+  PointLayout layout;
+};
+
+// Reads ~min_range, ~max_range, ~crop_min_{x,y,z}, ~crop_max_{x,y,z} (the points kept, in
+// the optical frame of the disparity image), ~dense (unorganized output with the kept
+// points only) and ~point_layout (xyzrgb, xyz, xyz_mm or xyz_half; xyzrgb if unknown)
+CloudParams loadCloudParams(const ros::NodeHandle& private_nh);
+
+} // namespace stereo_image_proc
+
+#endif
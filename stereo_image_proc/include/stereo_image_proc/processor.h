@@ -2,6 +2,8 @@
 #define STEREO_IMAGE_PROC_PROCESSOR_H
 
 #include <image_proc/processor.h>
+#include "stereo_image_proc/stereo_matcher.h"
+#include "stereo_image_proc/reprojection.h"
 #include <image_geometry/stereo_camera_model.h>
 #include <stereo_msgs/DisparityImage.h>
 #include <sensor_msgs/PointCloud.h>
@@ -23,7 +25,7 @@ class StereoProcessor
 public:
   
   StereoProcessor()
-    : block_matcher_(cv::StereoBM::BASIC_PRESET)
+    : algorithm_(STEREO_BM), compact_disparity_(false), dense_cloud_(false), point_layout_(LAYOUT_XYZRGB)
   {
   }
 
@@ -49,6 +51,12 @@ public:
   int getInterpolation() const;
   void setInterpolation(int interp);
 
+  int getYuvMatrix() const;
+  void setYuvMatrix(int matrix); // image_proc::YuvMatrix, for YUV raw images
+
+  int getStereoAlgorithm() const;
+  void setStereoAlgorithm(int algorithm); // StereoAlgorithm
+
   // Disparity pre-filtering parameters
 
   int getPreFilterSize() const;
@@ -82,16 +90,93 @@ public:
   int getSpeckleRange() const;
   void setSpeckleRange(int range);
 
+  int getDisp12MaxDiff() const;
+  void setDisp12MaxDiff(int max_diff); // Left-right consistency check, negative disables
+
+  // Semi-global matching parameters
+
+  int getP1() const;
+  void setP1(int P1);
+
+  int getP2() const;
+  void setP2(int P2);
+
+  int getSgmPaths() const;
+  void setSgmPaths(int paths); // 4 or 8
+
+  // Coarse-to-fine block matching parameters
+
+  int getCoarseLevels() const;
+  void setCoarseLevels(int levels); // 0 to match at full resolution only
+
+  int getRefineRadius() const;
+  void setRefineRadius(int radius);
+
+  // Temporal block matching parameters
+
+  bool getTemporalPrior() const;
+  void setTemporalPrior(bool enable);
+
+  int getMotionThreshold() const;
+  void setMotionThreshold(int threshold);
+
+  // Subpixel refinement
+
+  int getSubpixelFit() const;
+  void setSubpixelFit(int fit); // SubpixelFit
+
+  // Block matching parallelism
+
+  int getStripes() const;
+  void setStripes(int stripes); // 0 for one per worker pool thread
+
+  // Disparity output format
+
+  bool getCompactDisparity() const;
+  void setCompactDisparity(bool compact); // 16SC1 fixed point instead of 32FC1
+
+  // PointCloud2 output
+
+  const PointFilter& getPointFilter() const;
+  void setPointFilter(const PointFilter& filter); // range limits and crop box
+
+  bool getDenseCloud() const;
+  void setDenseCloud(bool dense); // kept points only, instead of organized
+
+  PointLayout getPointLayout() const;
+  void setPointLayout(PointLayout layout);
+
   // Do all the work!
   bool process(const sensor_msgs::ImageConstPtr& left_raw,
                const sensor_msgs::ImageConstPtr& right_raw,
                const image_geometry::StereoCameraModel& model,
                StereoImageSet& output, int flags) const;
 
+  // The steps of process(), for callers that run or time them separately.
+  // neededFlags() adds the intermediate outputs the requested ones depend on, and
+  // processMonocular() does the left and right images only. The monocular, disparity and
+  // point cloud steps use separate scratch buffers, so each may run on its own thread
+  // while the others work on different frames, as long as the settings do not change.
+  static int neededFlags(int flags);
+
+  bool processMonocular(const sensor_msgs::ImageConstPtr& left_raw,
+                        const sensor_msgs::ImageConstPtr& right_raw,
+                        const image_geometry::StereoCameraModel& model,
+                        StereoImageSet& output, int flags) const;
+
   void processDisparity(const cv::Mat& left_rect, const cv::Mat& right_rect,
                         const image_geometry::StereoCameraModel& model,
                         stereo_msgs::DisparityImage& disparity) const;
 
+  // The two halves of processDisparity(): matching to a fixed point disparity image (16
+  // times the true value), and converting that to a DisparityImage
+  void matchDisparity(const cv::Mat& left_rect, const cv::Mat& right_rect,
+                      cv::Mat_<int16_t>& disparity16) const;
+
+  void convertDisparity(const cv::Mat_<int16_t>& disparity16,
+                        const image_geometry::StereoCameraModel& model,
+                        stereo_msgs::DisparityImage& disparity) const;
+
   void processPoints(const stereo_msgs::DisparityImage& disparity,
                      const cv::Mat& color, const std::string& encoding,
                      const image_geometry::StereoCameraModel& model,
@@ -105,13 +190,16 @@ private:
   image_proc::Processor mono_processor_;
   
   mutable cv::Mat_<int16_t> disparity16_; // scratch buffer for 16-bit signed disparity image
-  mutable cv::StereoBM block_matcher_; // contains scratch buffers for block matching
-  // scratch buffers for speckle filtering
-  mutable cv::Mat_<uint32_t> labels_;
-  mutable cv::Mat_<uint32_t> wavefront_;
-  mutable cv::Mat_<uint8_t> region_types_;
-  // scratch buffer for dense point cloud
-  mutable cv::Mat_<cv::Vec3f> dense_points_;
+  MatcherParams params_;
+  int algorithm_;
+  bool compact_disparity_;
+  PointFilter point_filter_;
+  bool dense_cloud_;
+  PointLayout point_layout_;
+  mutable MatcherSet matchers_; // contains scratch buffers for stereo matching
+  mutable Reprojector reprojector_; // rays cached from the camera model
+  // scratch buffer for converting 16-bit disparity images
+  mutable cv::Mat_<float> float_disparity_;
 };
 
 
@@ -125,94 +213,254 @@ inline void StereoProcessor::setInterpolation(int interp)
   mono_processor_.interpolation_ = interp;
 }
 
+inline int StereoProcessor::getYuvMatrix() const
+{
+  return mono_processor_.yuv_matrix_;
+}
+
+inline void StereoProcessor::setYuvMatrix(int matrix)
+{
+  mono_processor_.yuv_matrix_ = matrix;
+}
+
+inline int StereoProcessor::getStereoAlgorithm() const
+{
+  return algorithm_;
+}
+
+inline void StereoProcessor::setStereoAlgorithm(int algorithm)
+{
+  algorithm_ = algorithm;
+}
+
 inline int StereoProcessor::getPreFilterSize() const
 {
-  return block_matcher_.state->preFilterSize;
+  return params_.prefilter_size;
 }
 
 inline void StereoProcessor::setPreFilterSize(int size)
 {
-  block_matcher_.state->preFilterSize = size;
+  params_.prefilter_size = size;
 }
 
 inline int StereoProcessor::getPreFilterCap() const
 {
-  return block_matcher_.state->preFilterCap;
+  return params_.prefilter_cap;
 }
 
 inline void StereoProcessor::setPreFilterCap(int cap)
 {
-  block_matcher_.state->preFilterCap = cap;
+  params_.prefilter_cap = cap;
 }
 
 inline int StereoProcessor::getCorrelationWindowSize() const
 {
-  return block_matcher_.state->SADWindowSize;
+  return params_.correlation_window_size;
 }
 
 inline void StereoProcessor::setCorrelationWindowSize(int size)
 {
-  block_matcher_.state->SADWindowSize = size;
+  params_.correlation_window_size = size;
 }
 
 inline int StereoProcessor::getMinDisparity() const
 {
-  return block_matcher_.state->minDisparity;
+  return params_.min_disparity;
 }
 
 inline void StereoProcessor::setMinDisparity(int min_d)
 {
-  block_matcher_.state->minDisparity = min_d;
+  params_.min_disparity = min_d;
 }
 
 inline int StereoProcessor::getDisparityRange() const
 {
-  return block_matcher_.state->numberOfDisparities;
+  return params_.disparity_range;
 }
 
 inline void StereoProcessor::setDisparityRange(int range)
 {
-  block_matcher_.state->numberOfDisparities = range;
+  params_.disparity_range = range;
 }
 
 inline int StereoProcessor::getTextureThreshold() const
 {
-  return block_matcher_.state->textureThreshold;
+  return params_.texture_threshold;
 }
 
 inline void StereoProcessor::setTextureThreshold(int threshold)
 {
-  block_matcher_.state->textureThreshold = threshold;
+  params_.texture_threshold = threshold;
 }
 
 inline float StereoProcessor::getUniquenessRatio() const
 {
-  return block_matcher_.state->uniquenessRatio;
+  return params_.uniqueness_ratio;
 }
 
 inline void StereoProcessor::setUniquenessRatio(float ratio)
 {
-  block_matcher_.state->uniquenessRatio = ratio;
+  params_.uniqueness_ratio = ratio;
 }
 
 inline int StereoProcessor::getSpeckleSize() const
 {
-  return block_matcher_.state->speckleWindowSize;
+  return params_.speckle_size;
 }
 
 inline void StereoProcessor::setSpeckleSize(int size)
 {
-  block_matcher_.state->speckleWindowSize = size;
+  params_.speckle_size = size;
 }
 
 inline int StereoProcessor::getSpeckleRange() const
 {
-  return block_matcher_.state->speckleRange;
+  return params_.speckle_range;
 }
 
 inline void StereoProcessor::setSpeckleRange(int range)
 {
-  block_matcher_.state->speckleRange = range;
+  params_.speckle_range = range;
+}
+
+inline int StereoProcessor::getDisp12MaxDiff() const
+{
+  return params_.disp12_max_diff;
+}
+
+inline void StereoProcessor::setDisp12MaxDiff(int max_diff)
+{
+  params_.disp12_max_diff = max_diff;
+}
+
+inline int StereoProcessor::getP1() const
+{
+  return params_.P1;
+}
+
+inline void StereoProcessor::setP1(int P1)
+{
+  params_.P1 = P1;
+}
+
+inline int StereoProcessor::getP2() const
+{
+  return params_.P2;
+}
+
+inline void StereoProcessor::setP2(int P2)
+{
+  params_.P2 = P2;
+}
+
+inline int StereoProcessor::getSgmPaths() const
+{
+  return params_.sgm_paths;
+}
+
+inline void StereoProcessor::setSgmPaths(int paths)
+{
+  params_.sgm_paths = paths;
+}
+
+inline int StereoProcessor::getCoarseLevels() const
+{
+  return params_.coarse_levels;
+}
+
+inline void StereoProcessor::setCoarseLevels(int levels)
+{
+  params_.coarse_levels = levels;
+}
+
+inline int StereoProcessor::getRefineRadius() const
+{
+  return params_.refine_radius;
+}
+
+inline void StereoProcessor::setRefineRadius(int radius)
+{
+  params_.refine_radius = radius;
+}
+
+inline bool StereoProcessor::getTemporalPrior() const
+{
+  return params_.temporal_prior;
+}
+
+inline void StereoProcessor::setTemporalPrior(bool enable)
+{
+  params_.temporal_prior = enable;
+}
+
+inline int StereoProcessor::getMotionThreshold() const
+{
+  return params_.motion_threshold;
+}
+
+inline void StereoProcessor::setMotionThreshold(int threshold)
+{
+  params_.motion_threshold = threshold;
+}
+
+inline int StereoProcessor::getSubpixelFit() const
+{
+  return params_.subpixel_fit;
+}
+
+inline void StereoProcessor::setSubpixelFit(int fit)
+{
+  params_.subpixel_fit = fit;
+}
+
+inline int StereoProcessor::getStripes() const
+{
+  return params_.stripes;
+}
+
+inline void StereoProcessor::setStripes(int stripes)
+{
+  params_.stripes = stripes;
+}
+
+inline bool StereoProcessor::getCompactDisparity() const
+{
+  return compact_disparity_;
+}
+
+inline void StereoProcessor::setCompactDisparity(bool compact)
+{
+  compact_disparity_ = compact;
+}
+
+inline const PointFilter& StereoProcessor::getPointFilter() const
+{
+  return point_filter_;
+}
+
+inline void StereoProcessor::setPointFilter(const PointFilter& filter)
+{
+  point_filter_ = filter;
+}
+
+inline bool StereoProcessor::getDenseCloud() const
+{
+  return dense_cloud_;
+}
+
+inline void StereoProcessor::setDenseCloud(bool dense)
+{
+  dense_cloud_ = dense;
+}
+
+inline PointLayout StereoProcessor::getPointLayout() const
+{
+  return point_layout_;
+}
+
+inline void StereoProcessor::setPointLayout(PointLayout layout)
+{
+  point_layout_ = layout;
 }
 
 } //namespace stereo_image_proc
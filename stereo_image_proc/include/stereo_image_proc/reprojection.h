@@ -0,0 +1,114 @@
+#ifndef STEREO_IMAGE_PROC_REPROJECTION_H
+#define STEREO_IMAGE_PROC_REPROJECTION_H
+
+#include <opencv2/core/core.hpp>
+#include <image_proc/voxel_grid.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/PointCloud.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <string>
+#include <vector>
+
+namespace stereo_image_proc {
+
+// Source of the rgb field of reprojected points
+enum PointColor
+{
+  COLOR_NONE,  // rgb = 0
+  COLOR_MONO8,
+  COLOR_RGB8,
+  COLOR_BGR8
+};
+
+// Color format of an image encoding, COLOR_NONE if unsupported
+PointColor pointColor(const std::string& encoding);
+
+// The pixels of a color image of the given format (not COLOR_NONE), without copying. Empty
+// if the data is shorter than the size and step imply.
+cv::Mat colorPixels(const sensor_msgs::Image& image, PointColor format);
+
+// Point formats of PointCloud2 output
+enum PointLayout
+{
+  LAYOUT_XYZRGB,  // FLOAT32 x, y, z, rgb; 16 bytes
+  LAYOUT_XYZ,     // FLOAT32 x, y, z; 12 bytes
+  LAYOUT_XYZ_MM,  // INT16 x_mm, y_mm, z_mm in millimeters; 6 bytes. Points beyond +-32.767 m are
+                  // dropped, and invalid points are all zero.
+  LAYOUT_XYZ_HALF // IEEE half floats x_f16, y_f16, z_f16, as UINT16 fields holding the bits; 6 bytes
+};
+
+// Layout of a name ("xyzrgb", "xyz", "xyz_mm" or "xyz_half"), false if unknown
+bool pointLayout(const std::string& name, PointLayout& layout);
+
+// IEEE half float bits of a float, as stored by LAYOUT_XYZ_HALF, rounding to nearest even.
+// Overflows become infinity, NaNs become a quiet NaN.
+uint16_t halfFloat(float value);
+
+// Points kept when reprojecting, in the optical frame of the disparity image. Keeps all by default.
+struct PointFilter
+{
+  float min_range, max_range; // distance from the camera center
+  float box_min[3], box_max[3]; // axis-aligned crop box, x y z
+  cv::Rect window; // pixels reprojected, the rest being invalid; empty for the whole image
+
+  PointFilter();
+  bool keepsAll() const; // no range or box limits
+};
+
+/**
+ * Reprojects disparity images to 3d points, as cv::reprojectImageTo3D does. The ray of each
+ * column and row is cached from the reprojection matrix Q of a rectified pair (from
+ * StereoCameraModel::reprojectionMatrix()), so a point is the ray scaled by 1/W, with
+ * W = Q(3,2)*d + Q(3,3). Pixels with the lowest disparity in the image (rejected by the
+ * matcher) or at infinity become NaN points.
+ *
+ * Disparity images must have the size given to update(), and color images (unless
+ * COLOR_NONE) the size of the disparity image; callers check messages from outside.
+ */
+class Reprojector
+{
+public:
+  Reprojector();
+
+  // Rebuilds the ray tables if the calibration or image size changed
+  void update(const cv::Matx44d& Q, int width, int height);
+
+  // PointCloud2 of the given layout, rgb being packed 0x00RRGGBB from color. Organized clouds
+  // have a point per pixel, NaN (zero for LAYOUT_XYZ_MM) where invalid or filtered out; dense
+  // clouds have a single row of the kept points only, so rejected points are never written.
+  void projectCloud(const cv::Mat_<float>& disparity, const cv::Mat& color, PointColor color_format,
+                    const PointFilter& filter, bool dense, PointLayout layout,
+                    sensor_msgs::PointCloud2& points) const;
+
+  // Averages the kept points into the voxels of grid, which is reset first (keeping its leaf
+  // size). Rows are reprojected in small chunks, never building the full cloud.
+  void voxelize(const cv::Mat_<float>& disparity, const cv::Mat& color, PointColor color_format,
+                const PointFilter& filter, image_proc::VoxelGrid& grid);
+
+  // Valid points within window (empty for the whole image) only, with channels rgb (empty
+  // for COLOR_NONE), u (row) and v (column). Valid pixels are counted per row first, so every
+  // array is sized once and filled in one row-parallel pass.
+  void projectSparse(const cv::Mat_<float>& disparity, const cv::Mat& color, PointColor color_format,
+                     const cv::Rect& window, sensor_msgs::PointCloud& points) const;
+
+private:
+  cv::Matx44d Q_;
+  std::vector<float> ray_x_; // per column
+  std::vector<float> ray_y_; // per row
+  float ray_z_;
+  float w_d_, w_0_; // W = w_d_*d + w_0_
+  std::vector<image_proc::VoxelGrid> chunk_grids_; // voxelize() scratch, one per chunk of rows
+
+  struct Job;
+
+  template <int Layout>
+  void rows(const Job* job, int begin, int end) const;
+  void voxelRows(const Job* job, float leaf_size, std::vector<image_proc::VoxelGrid>* grids,
+                 int begin, int end) const;
+  void countRows(const Job* job, int begin, int end) const;
+  void sparseRows(const Job* job, sensor_msgs::PointCloud* points, int begin, int end) const;
+};
+
+} // namespace stereo_image_proc
+
+#endif
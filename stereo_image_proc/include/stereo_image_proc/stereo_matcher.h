@@ -0,0 +1,356 @@
+#ifndef STEREO_IMAGE_PROC_STEREO_MATCHER_H
+#define STEREO_IMAGE_PROC_STEREO_MATCHER_H
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+namespace stereo_image_proc {
+
+// Values match the Disparity.cfg stereo_algorithm enum
+enum StereoAlgorithm
+{
+  STEREO_BM     = 0,
+  STEREO_SGM    = 1,
+  STEREO_CENSUS = 2
+};
+
+// Values match the Disparity.cfg subpixel_fit enum
+enum SubpixelFit
+{
+  SUBPIXEL_NONE        = 0,
+  SUBPIXEL_PARABOLA    = 1,
+  SUBPIXEL_EQUIANGULAR = 2
+};
+
+// Parameters shared by all matchers. Those that don't apply to a matcher are ignored.
+struct MatcherParams
+{
+  // Pre-filtering
+  int prefilter_size;
+  int prefilter_cap;
+
+  // Correlation
+  int correlation_window_size;
+  int min_disparity;
+  int disparity_range; // multiple of 16
+
+  // Post-filtering
+  float uniqueness_ratio;
+  int texture_threshold; // not SGM
+  int speckle_size;
+  int speckle_range;
+  int disp12_max_diff; // left-right consistency check tolerance, pixels; negative disables
+
+  // Semi-global matching
+  int P1;        // penalty on disparity changes of 1 between neighbors
+  int P2;        // penalty on larger disparity changes
+  int sgm_paths; // 4 or 8 aggregation directions
+
+  // Block matching
+  int stripes; // row stripes matched in parallel, 0 for one per worker pool thread
+
+  // Coarse-to-fine block matching
+  int coarse_levels; // image halvings for the coarse match, 0 to match at full resolution only
+  int refine_radius; // full resolution search around the coarse or previous estimate, pixels
+
+  // Temporal block matching
+  bool temporal_prior;  // search around the previous frame's disparities
+  int motion_threshold; // mean absolute change of a block of the left image that forces a full search
+
+  // Subpixel refinement
+  int subpixel_fit; // SubpixelFit
+
+  MatcherParams()
+    : prefilter_size(9), prefilter_cap(31),
+      correlation_window_size(15), min_disparity(0), disparity_range(64),
+      uniqueness_ratio(15), texture_threshold(10), speckle_size(100), speckle_range(4),
+      disp12_max_diff(-1),
+      P1(64), P2(256), sgm_paths(8), stripes(0),
+      coarse_levels(0), refine_radius(4),
+      temporal_prior(false), motion_threshold(10),
+      subpixel_fit(SUBPIXEL_NONE)
+  {
+  }
+};
+
+// Window of (potentially) valid disparities of block matching in a width x height
+// disparity image, as cv::getValidDisparityROI: pixels within half a correlation window
+// of the borders, or too close to the left border to search the whole disparity range,
+// are always rejected. Possibly empty.
+cv::Rect validDisparityWindow(const MatcherParams& params, int width, int height);
+
+/**
+ * Speckle filtering with the results of cv::filterSpeckles: 4-connected regions of
+ * disparities differing by at most max_diff between neighbors, of at most max_size
+ * pixels, are set to new_val. Regions are found by union-find in bands of rows labeled
+ * in parallel on the image_proc worker pool, joined across the band borders, and then
+ * cleared in parallel.
+ */
+class SpeckleFilter
+{
+public:
+  void filter(cv::Mat_<int16_t>& disparity, int16_t new_val, int max_size, int max_diff);
+
+private:
+  std::vector<int> parent_; // per pixel, -1 for new_val pixels
+  std::vector<int> size_;   // pixels under each root
+
+  void labelBands(const cv::Mat_<int16_t>& disparity, int16_t new_val, int max_diff, int begin, int end);
+  void clearBands(cv::Mat_<int16_t>& disparity, int16_t new_val, int max_size, int begin, int end) const;
+};
+
+/**
+ * Computes the disparity image of a rectified mono8 stereo pair, in the 16-bit fixed
+ * point format of cv::StereoBM: d_fp = 16 * (x_l - x_r). Rejected pixels are set to
+ * (min_disparity - 1) * 16.
+ */
+class StereoMatcher
+{
+public:
+  virtual ~StereoMatcher() {}
+
+  virtual void compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                       cv::Mat_<int16_t>& disparity) = 0;
+
+  // Window outside which compute() rejects every pixel of a width x height pair
+  virtual cv::Rect validWindow(const MatcherParams& params, int width, int height) const = 0;
+};
+
+/**
+ * Block matching, using cv::StereoBM. The image can be split into horizontal stripes
+ * matched in parallel on the image_proc worker pool. Each stripe is matched with
+ * enough extra rows above and below for the prefilter and SAD windows, so stitching
+ * gives the same result as matching the whole image; speckle filtering (SpeckleFilter,
+ * rather than StereoBM's own) then runs once on the stitched image so that regions
+ * spanning stripes are measured whole.
+ */
+class BlockMatcher : public StereoMatcher
+{
+public:
+  BlockMatcher();
+
+  virtual void compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                       cv::Mat_<int16_t>& disparity);
+
+  virtual cv::Rect validWindow(const MatcherParams& params, int width, int height) const;
+
+private:
+  cv::StereoBM block_matcher_; // contains scratch buffers for block matching
+
+  // Per-stripe matchers and outputs, so that stripes share no scratch buffers
+  std::vector< boost::shared_ptr<cv::StereoBM> > stripe_matchers_;
+  std::vector< cv::Mat_<int16_t> > stripe_disparities_;
+  SpeckleFilter speckle_filter_;
+
+  void computeStripes(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                      cv::Mat_<int16_t>& disparity, int num_stripes, int begin, int end);
+};
+
+/**
+ * Semi-global matching (Hirschmuller 2008). Birchfield-Tomasi costs on the x-Sobel
+ * prefiltered images are averaged over a correlation window (at most 11 pixels wide),
+ * then aggregated along 4 or 8 paths with SSE2. The image is processed in fixed bands
+ * of rows, with overlap so paths can settle, in parallel on the image_proc worker pool.
+ * The result does not depend on the number of threads.
+ */
+class SemiGlobalMatcher : public StereoMatcher
+{
+public:
+  virtual void compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                       cv::Mat_<int16_t>& disparity);
+
+  // Every row, and every column with a match within the right image at some disparity
+  virtual cv::Rect validWindow(const MatcherParams& params, int width, int height) const;
+
+  struct Scratch;
+
+private:
+  // Filtered inputs, shared by all bands
+  cv::Mat_<uint8_t> left_filtered_, right_filtered_;
+  SpeckleFilter speckle_filter_;
+
+  // Per-band buffers, reused across bands and frames
+  boost::mutex scratch_mutex_;
+  std::vector< boost::shared_ptr<Scratch> > free_scratch_;
+
+  void computeBands(const MatcherParams& params, cv::Mat_<int16_t>& disparity,
+                    int begin, int end);
+};
+
+/**
+ * Census transform matching, for pairs with different brightness or exposure. Each pixel
+ * is described by 62 bits comparing it with its 9x7 neighborhood, and the cost of a
+ * disparity is the Hamming distance of the descriptors summed over the correlation window
+ * (at most 21 pixels wide). Popcounts use the POPCNT instruction where the CPU has it;
+ * window sums and disparity selection use SSE2. Uniqueness, texture (on the x-Sobel
+ * prefiltered left image) and speckle filtering work as for StereoBM. Rows are matched
+ * in parallel on the image_proc worker pool.
+ */
+class CensusMatcher : public StereoMatcher
+{
+public:
+  virtual void compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                       cv::Mat_<int16_t>& disparity);
+
+  virtual cv::Rect validWindow(const MatcherParams& params, int width, int height) const;
+
+  struct Scratch;
+
+private:
+  std::vector<uint64_t> left_census_, right_census_;
+  cv::Mat_<uint8_t> left_filtered_; // for the texture threshold
+  SpeckleFilter speckle_filter_;
+
+  // Per-band buffers, reused across bands and frames
+  boost::mutex scratch_mutex_;
+  std::vector< boost::shared_ptr<Scratch> > free_scratch_;
+
+  void censusRows(const cv::Mat& left, const cv::Mat& right, int begin, int end);
+  void matchRows(const MatcherParams& params, cv::Mat_<int16_t>& disparity, int begin, int end);
+};
+
+/**
+ * Block matching where each pixel searches only its own range of disparities, given as
+ * a map of ranges over blocks of 2^range_shift_ pixels. SAD costs of x-Sobel prefiltered
+ * images are computed per tile over the union of its pixels' ranges; tiles are refined
+ * in parallel on the image_proc worker pool.
+ */
+class RangeMatcher : public StereoMatcher
+{
+public:
+  virtual cv::Rect validWindow(const MatcherParams& params, int width, int height) const;
+
+protected:
+  cv::Mat_<int16_t> range_lo_, range_hi_; // inclusive disparity search range per block
+  int range_shift_;
+
+  RangeMatcher() : range_shift_(0) {}
+
+  // Sets the range of each block to refine_radius beyond the disparities of its 3x3
+  // neighborhood, given as the min and max of each block in units of scale / 16 pixels
+  // (min > max where there are none). Blocks get the full range where their whole
+  // neighborhood has none, or where full_search is set anywhere in it.
+  void rangesFromNeighbors(const cv::Mat_<int16_t>& min16, const cv::Mat_<int16_t>& max16, int scale,
+                           const cv::Mat_<uint8_t>& full_search, const MatcherParams& params);
+
+  void refine(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+              cv::Mat_<int16_t>& disparity);
+
+private:
+  cv::Mat_<uint8_t> left_filtered_, right_filtered_;
+  SpeckleFilter speckle_filter_;
+
+  void refineTiles(const MatcherParams& params, cv::Mat_<int16_t>& disparity, int begin, int end);
+};
+
+/**
+ * Coarse-to-fine block matching, for wide disparity ranges. The pair is downsampled by
+ * 2^coarse_levels and block matched over the correspondingly smaller range. At full
+ * resolution each pixel then only searches refine_radius pixels beyond the coarse
+ * disparities of its 3x3 coarse neighborhood (the full range where all of those were
+ * rejected).
+ */
+class HierarchicalMatcher : public RangeMatcher
+{
+public:
+  virtual void compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                       cv::Mat_<int16_t>& disparity);
+
+  virtual cv::Rect validWindow(const MatcherParams& params, int width, int height) const;
+
+private:
+  BlockMatcher coarse_matcher_;
+  cv::Mat left_coarse_, right_coarse_;
+  cv::Mat_<int16_t> coarse_disparity_, coarse_min_, coarse_max_;
+};
+
+/**
+ * Block matching for video, using the previous disparity image as a prior. Each pixel
+ * searches refine_radius pixels beyond the previous disparities around it, and the full
+ * range where those were rejected or the left image changed by more than
+ * motion_threshold since the previous frame. The first frame, and any after the image
+ * size or disparity range changes, is matched in full.
+ */
+class TemporalMatcher : public RangeMatcher
+{
+public:
+  TemporalMatcher();
+
+  virtual void compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                       cv::Mat_<int16_t>& disparity);
+
+private:
+  HierarchicalMatcher full_matcher_;
+  cv::Mat_<uint8_t> prev_left_;
+  cv::Mat_<int16_t> prev_disparity_;
+  int prev_min_disparity_, prev_disparity_range_;
+  cv::Mat_<int16_t> prior_min_, prior_max_; // per block
+  cv::Mat_<uint8_t> motion_;                // per block
+};
+
+/**
+ * Subpixel refinement of matcher output. The SAD costs of the x-Sobel prefiltered pair
+ * at each pixel's rounded disparity and its two neighbors are recomputed with PSADBW,
+ * over the correlation window (at most 21 pixels wide), and the fractional part is
+ * replaced by the minimum of a parabola through the three costs, or of two lines of
+ * opposite slopes (the equiangular fit, closer to the V shape of SAD costs). Pixels
+ * whose disparity is not a minimum of the three costs are left alone. Rows are refined
+ * in parallel on the image_proc worker pool.
+ */
+class SubpixelRefiner
+{
+public:
+  void refine(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+              cv::Mat_<int16_t>& disparity);
+
+private:
+  cv::Mat_<uint8_t> left_padded_, right_padded_; // rows padded for 16 byte loads
+  cv::Mat_<uint8_t> left_filtered_, right_filtered_; // prefiltered, views into the padded buffers
+
+  void refineRows(const MatcherParams& params, cv::Mat_<int16_t>& disparity, int begin, int end);
+};
+
+/**
+ * One matcher of each kind, chosen per frame by the algorithm and params. With
+ * params.disp12_max_diff >= 0 the pair is also matched right-to-left (as the mirrored
+ * pair, by a second set of matchers, in parallel with the left-to-right pass), and
+ * pixels whose disparity differs by more than disp12_max_diff from that of the right
+ * pixel they match are rejected. Pixels matching a rejected right pixel are kept.
+ * Subpixel refinement, if any, then runs on the pixels left.
+ */
+class MatcherSet
+{
+public:
+  void compute(int algorithm, const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+               cv::Mat_<int16_t>& disparity);
+
+  // Window outside which compute() rejects every pixel, for the matcher it picks
+  cv::Rect validWindow(int algorithm, const MatcherParams& params, int width, int height) const;
+
+private:
+  struct Matchers
+  {
+    BlockMatcher block;
+    SemiGlobalMatcher sgm;
+    CensusMatcher census;
+    HierarchicalMatcher hierarchical;
+    TemporalMatcher temporal;
+
+    StereoMatcher& select(int algorithm, const MatcherParams& params);
+    const StereoMatcher& select(int algorithm, const MatcherParams& params) const;
+  };
+
+  Matchers forward_, backward_;
+  SubpixelRefiner refiner_;
+  cv::Mat left_flipped_, right_flipped_;
+  cv::Mat_<int16_t> backward_disparity_;
+
+  void computePasses(int algorithm, const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                     cv::Mat_<int16_t>& disparity, int begin, int end);
+};
+
+} // namespace stereo_image_proc
+
+#endif
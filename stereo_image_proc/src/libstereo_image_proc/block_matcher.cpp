@@ -0,0 +1,96 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include "matcher_internal.h"
+#include <image_proc/parallel.h>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+#include <algorithm>
+
+namespace stereo_image_proc {
+
+namespace {
+
+// Stripes narrower than this are not worth the extra rows matched around them
+const int MIN_STRIPE_ROWS = 32;
+
+void setState(CvStereoBMState* state, const MatcherParams& params)
+{
+  state->preFilterSize       = params.prefilter_size;
+  state->preFilterCap        = params.prefilter_cap;
+  state->SADWindowSize       = params.correlation_window_size;
+  state->minDisparity        = params.min_disparity;
+  state->numberOfDisparities = params.disparity_range;
+  state->uniquenessRatio     = params.uniqueness_ratio;
+  state->textureThreshold    = params.texture_threshold;
+  state->speckleWindowSize   = params.speckle_size;
+  state->speckleRange        = params.speckle_range;
+}
+
+// Rows above and below a stripe that affect its disparities: half the SAD window, plus
+// half the prefilter window (and the 3x3 x-Sobel) for the rows in the SAD window
+inline int stripeOverlap(const MatcherParams& params)
+{
+  return params.correlation_window_size / 2 + params.prefilter_size / 2 + 1;
+}
+
+} // namespace
+
+BlockMatcher::BlockMatcher()
+  : block_matcher_(cv::StereoBM::BASIC_PRESET)
+{
+}
+
+void BlockMatcher::compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                           cv::Mat_<int16_t>& disparity)
+{
+  int num_stripes = params.stripes > 0 ? params.stripes : image_proc::globalWorkerPool()->numThreads();
+  int min_rows = std::max(MIN_STRIPE_ROWS, stripeOverlap(params));
+  num_stripes = std::min(num_stripes, std::max(left.rows / min_rows, 1));
+
+  if (num_stripes <= 1) {
+    setState(block_matcher_.state, params);
+    block_matcher_.state->speckleWindowSize = 0; // done below, in parallel
+    block_matcher_(left, right, disparity);
+  }
+  else {
+    while ((int)stripe_matchers_.size() < num_stripes)
+      stripe_matchers_.push_back(boost::make_shared<cv::StereoBM>(cv::StereoBM::BASIC_PRESET));
+    stripe_disparities_.resize(num_stripes);
+
+    disparity.create(left.rows, left.cols);
+    image_proc::parallelFor(0, num_stripes, boost::bind(&BlockMatcher::computeStripes, this,
+                                                        boost::cref(left), boost::cref(right),
+                                                        boost::cref(params), boost::ref(disparity),
+                                                        num_stripes, _1, _2));
+  }
+
+  filterSpeckles(disparity, validWindow(params, disparity.cols, disparity.rows), params, speckle_filter_);
+}
+
+cv::Rect BlockMatcher::validWindow(const MatcherParams& params, int width, int height) const
+{
+  return validDisparityWindow(params, width, height);
+}
+
+void BlockMatcher::computeStripes(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                                  cv::Mat_<int16_t>& disparity, int num_stripes, int begin, int end)
+{
+  const int overlap = stripeOverlap(params);
+  for (int i = begin; i < end; ++i) {
+    // Output rows [y0, y1), matched from input rows [e0, e1)
+    int y0 = left.rows * i / num_stripes;
+    int y1 = left.rows * (i + 1) / num_stripes;
+    int e0 = std::max(0, y0 - overlap);
+    int e1 = std::min(left.rows, y1 + overlap);
+
+    cv::StereoBM& matcher = *stripe_matchers_[i];
+    setState(matcher.state, params);
+    matcher.state->speckleWindowSize = 0; // done on the stitched image
+    cv::Mat_<int16_t>& stripe = stripe_disparities_[i];
+    matcher(left.rowRange(e0, e1), right.rowRange(e0, e1), stripe);
+
+    cv::Mat_<int16_t> out = disparity.rowRange(y0, y1);
+    stripe.rowRange(y0 - e0, y1 - e0).copyTo(out);
+  }
+}
+
+} // namespace stereo_image_proc
@@ -0,0 +1,405 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include "matcher_internal.h"
+#include <image_proc/parallel.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <climits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace stereo_image_proc {
+
+struct CensusMatcher::Scratch
+{
+  std::vector<uint64_t> rev;     // right row reversed, padded
+  std::vector<uint8_t> hamming;  // ring of Hamming distance rows, width x D each
+  std::vector<int16_t> vsum;     // width x D
+  std::vector<int16_t> acc;      // D
+  std::vector<int> texture_col;  // width
+};
+
+namespace {
+
+// Census window; 9 * 7 - 1 = 62 bits per pixel
+const int CENSUS_RX = 4;
+const int CENSUS_RY = 3;
+
+// Window sums of up to 21 * 21 Hamming distances of at most 62 fit in int16
+const int MAX_WINDOW = 21;
+
+// Rows per band are at least this many, to amortize filling the window at the top
+const int MIN_BAND_ROWS = 32;
+
+// Offsets of the census window around the center, in bit order
+struct CensusOffsets
+{
+  int u[64], v[64];
+  int count;
+
+  CensusOffsets() : count(0)
+  {
+    for (int v0 = -CENSUS_RY; v0 <= CENSUS_RY; ++v0) {
+      for (int u0 = -CENSUS_RX; u0 <= CENSUS_RX; ++u0) {
+        if (u0 == 0 && v0 == 0)
+          continue;
+        u[count] = u0;
+        v[count] = v0;
+        ++count;
+      }
+    }
+    // Pad to 64 with the center itself, which never sets a bit
+    for (int i = count; i < 64; ++i)
+      u[i] = v[i] = 0;
+  }
+};
+
+const CensusOffsets CENSUS_OFFSETS;
+
+// Bit i of a descriptor is set where neighbor i is darker than the center
+inline uint64_t censusPixel(const uint8_t* center, int step)
+{
+  uint64_t bits = 0;
+  for (int i = 0; i < CENSUS_OFFSETS.count; ++i)
+    bits |= (uint64_t)(center[CENSUS_OFFSETS.v[i] * step + CENSUS_OFFSETS.u[i]] < *center) << i;
+  return bits;
+}
+
+void censusRow(const cv::Mat& src, int y, uint64_t* out)
+{
+  const int W = src.cols;
+  const int step = src.step[0];
+  std::fill(out, out + W, 0);
+  if (y < CENSUS_RY || y >= src.rows - CENSUS_RY)
+    return;
+  const uint8_t* row = src.ptr<uint8_t>(y);
+  int x = CENSUS_RX;
+#if defined(__SSE2__)
+  // 16 pixels at a time: byte k of each descriptor comes from offsets 8k .. 8k+7, then
+  // the 8 byte planes are transposed into 16 descriptors
+  const __m128i sign = _mm_set1_epi8((char)0x80);
+  for ( ; x + 16 <= W - CENSUS_RX; x += 16) {
+    const __m128i c = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(row + x)), sign);
+    __m128i planes[8];
+    for (int k = 0; k < 8; ++k) {
+      __m128i acc = _mm_setzero_si128();
+      for (int j = 0; j < 8; ++j) {
+        int i = 8 * k + j;
+        const uint8_t* n = row + x + CENSUS_OFFSETS.v[i] * step + CENSUS_OFFSETS.u[i];
+        __m128i darker = _mm_cmpgt_epi8(c, _mm_xor_si128(_mm_loadu_si128((const __m128i*)n), sign));
+        acc = _mm_or_si128(acc, _mm_and_si128(darker, _mm_set1_epi8((char)(1 << j))));
+      }
+      planes[k] = acc;
+    }
+    __m128i a0 = _mm_unpacklo_epi8(planes[0], planes[1]), a1 = _mm_unpackhi_epi8(planes[0], planes[1]);
+    __m128i b0 = _mm_unpacklo_epi8(planes[2], planes[3]), b1 = _mm_unpackhi_epi8(planes[2], planes[3]);
+    __m128i c0 = _mm_unpacklo_epi8(planes[4], planes[5]), c1 = _mm_unpackhi_epi8(planes[4], planes[5]);
+    __m128i d0 = _mm_unpacklo_epi8(planes[6], planes[7]), d1 = _mm_unpackhi_epi8(planes[6], planes[7]);
+    __m128i e[4] = { _mm_unpacklo_epi16(a0, b0), _mm_unpackhi_epi16(a0, b0),
+                     _mm_unpacklo_epi16(a1, b1), _mm_unpackhi_epi16(a1, b1) };
+    __m128i f[4] = { _mm_unpacklo_epi16(c0, d0), _mm_unpackhi_epi16(c0, d0),
+                     _mm_unpacklo_epi16(c1, d1), _mm_unpackhi_epi16(c1, d1) };
+    __m128i* dst = (__m128i*)(out + x);
+    for (int k = 0; k < 4; ++k) {
+      _mm_storeu_si128(dst + 2 * k,     _mm_unpacklo_epi32(e[k], f[k]));
+      _mm_storeu_si128(dst + 2 * k + 1, _mm_unpackhi_epi32(e[k], f[k]));
+    }
+  }
+#endif
+  for ( ; x < W - CENSUS_RX; ++x)
+    out[x] = censusPixel(row + x, step);
+}
+
+#if defined(__GNUC__)
+#define CENSUS_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define CENSUS_ALWAYS_INLINE inline
+#endif
+
+// Hamming distances of the left descriptors in [x0, x1) to the right descriptors at D
+// consecutive disparities, read from the reversed right row at rev[k0 - x + i]. Always
+// inlined, so that each caller compiles the popcounts for its own target.
+CENSUS_ALWAYS_INLINE void hammingRowGeneric(const uint64_t* left, const uint64_t* rev, int x0, int x1,
+                                            int D, int k0, uint8_t* out)
+{
+  for (int x = x0; x < x1; ++x) {
+    const uint64_t l = left[x];
+    const uint64_t* r = rev + k0 - x;
+    uint8_t* o = out + x * D;
+    for (int i = 0; i < D; ++i)
+      o[i] = __builtin_popcountll(l ^ r[i]);
+  }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Same code, compiled to the POPCNT instruction; only called if the CPU has it
+__attribute__((target("popcnt")))
+void hammingRowPopcnt(const uint64_t* left, const uint64_t* rev, int x0, int x1, int D, int k0, uint8_t* out)
+{
+  hammingRowGeneric(left, rev, x0, x1, D, k0, out);
+}
+
+void hammingRow(const uint64_t* left, const uint64_t* rev, int x0, int x1, int D, int k0, uint8_t* out)
+{
+  static const bool has_popcnt = __builtin_cpu_supports("popcnt");
+  if (has_popcnt)
+    hammingRowPopcnt(left, rev, x0, x1, D, k0, out);
+  else
+    hammingRowGeneric(left, rev, x0, x1, D, k0, out);
+}
+#else
+void hammingRow(const uint64_t* left, const uint64_t* rev, int x0, int x1, int D, int k0, uint8_t* out)
+{
+  hammingRowGeneric(left, rev, x0, x1, D, k0, out);
+}
+#endif
+
+#if defined(__SSE2__)
+
+// sum[i] += add[i] - sub[i] (sub may be NULL)
+inline void accumulate(int16_t* sum, const int16_t* add, const int16_t* sub, int D)
+{
+  for (int i = 0; i < D; i += 8) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(sum + i));
+    s = _mm_add_epi16(s, _mm_loadu_si128((const __m128i*)(add + i)));
+    if (sub)
+      s = _mm_sub_epi16(s, _mm_loadu_si128((const __m128i*)(sub + i)));
+    _mm_storeu_si128((__m128i*)(sum + i), s);
+  }
+}
+
+// sum[i] += sign * row[i], for rows of Hamming distances (n a multiple of 16)
+template <int sign>
+inline void accumulateRow(int16_t* sum, const uint8_t* row, int n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(row + i));
+    __m128i lo = _mm_loadu_si128((const __m128i*)(sum + i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(sum + i + 8));
+    if (sign > 0) {
+      lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(a, zero));
+      hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(a, zero));
+    }
+    else {
+      lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(a, zero));
+      hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(a, zero));
+    }
+    _mm_storeu_si128((__m128i*)(sum + i), lo);
+    _mm_storeu_si128((__m128i*)(sum + i + 8), hi);
+  }
+}
+
+inline int minCost(const int16_t* C, int D)
+{
+  __m128i m = _mm_loadu_si128((const __m128i*)C);
+  for (int i = 8; i < D; i += 8)
+    m = _mm_min_epi16(m, _mm_loadu_si128((const __m128i*)(C + i)));
+  m = _mm_min_epi16(m, _mm_srli_si128(m, 8));
+  m = _mm_min_epi16(m, _mm_srli_si128(m, 4));
+  m = _mm_min_epi16(m, _mm_srli_si128(m, 2));
+  return (int16_t)_mm_cvtsi128_si32(m);
+}
+
+// Number of costs <= thresh
+inline int countAtMost(const int16_t* C, int D, int thresh)
+{
+  const __m128i t = _mm_set1_epi16(thresh);
+  int count = 0;
+  for (int i = 0; i < D; i += 8) {
+    __m128i gt = _mm_cmpgt_epi16(_mm_loadu_si128((const __m128i*)(C + i)), t);
+    count += 8 - __builtin_popcount(_mm_movemask_epi8(gt)) / 2;
+  }
+  return count;
+}
+
+#else
+
+inline void accumulate(int16_t* sum, const int16_t* add, const int16_t* sub, int D)
+{
+  for (int i = 0; i < D; ++i)
+    sum[i] += add[i] - (sub ? sub[i] : 0);
+}
+
+template <int sign>
+inline void accumulateRow(int16_t* sum, const uint8_t* row, int n)
+{
+  for (int i = 0; i < n; ++i)
+    sum[i] += sign * row[i];
+}
+
+inline int minCost(const int16_t* C, int D)
+{
+  return *std::min_element(C, C + D);
+}
+
+inline int countAtMost(const int16_t* C, int D, int thresh)
+{
+  int count = 0;
+  for (int i = 0; i < D; ++i)
+    count += C[i] <= thresh;
+  return count;
+}
+
+#endif
+
+} // namespace
+
+void CensusMatcher::compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                            cv::Mat_<int16_t>& disparity)
+{
+  CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+  CV_Assert(params.disparity_range > 0 && params.disparity_range % 16 == 0);
+
+  left_census_.resize(left.rows * left.cols);
+  right_census_.resize(right.rows * right.cols);
+  image_proc::parallelFor(0, left.rows, boost::bind(&CensusMatcher::censusRows, this,
+                                                    boost::cref(left), boost::cref(right), _1, _2),
+                          MIN_BAND_ROWS);
+  if (params.texture_threshold > 0) {
+    int cap = std::min(std::max(params.prefilter_cap, 1), 63);
+    prefilterXSobel(left, left_filtered_, cap);
+  }
+
+  disparity.create(left.rows, left.cols);
+  image_proc::parallelFor(0, left.rows, boost::bind(&CensusMatcher::matchRows, this,
+                                                    boost::cref(params), boost::ref(disparity), _1, _2),
+                          MIN_BAND_ROWS);
+
+  filterSpeckles(disparity, validWindow(params, disparity.cols, disparity.rows), params, speckle_filter_);
+}
+
+cv::Rect CensusMatcher::validWindow(const MatcherParams& params, int width, int height) const
+{
+  // The pixels matchRows() matches
+  const int r = std::min(std::max(params.correlation_window_size | 1, 1), MAX_WINDOW) / 2;
+  const int min_d = params.min_disparity, max_d = params.min_disparity + params.disparity_range - 1;
+  return clippedWindow(std::max(r, max_d + r), r, std::min(width - r, width - r + min_d), height - r,
+                       width, height);
+}
+
+void CensusMatcher::censusRows(const cv::Mat& left, const cv::Mat& right, int begin, int end)
+{
+  for (int y = begin; y < end; ++y) {
+    censusRow(left, y, &left_census_[y * left.cols]);
+    censusRow(right, y, &right_census_[y * right.cols]);
+  }
+}
+
+void CensusMatcher::matchRows(const MatcherParams& params, cv::Mat_<int16_t>& disparity, int begin, int end)
+{
+  const int W = disparity.cols, H = disparity.rows, D = params.disparity_range;
+  const int min_d = params.min_disparity;
+  const int r = std::min(std::max(params.correlation_window_size | 1, 1), MAX_WINDOW) / 2;
+  const int ring = 2 * r + 2;
+  const int row_len = W * D;
+  const int uniqueness = (int)params.uniqueness_ratio;
+  const bool check_texture = params.texture_threshold > 0;
+  const int cap = std::min(std::max(params.prefilter_cap, 1), 63);
+  const int16_t invalid = (min_d - 1) * 16;
+
+  // Only pixels whose window is inside both images at every disparity, as for StereoBM
+  const int x_begin = std::max(r, min_d + D - 1 + r);
+  const int x_end = std::min(W - r, W - r + min_d);
+  // Columns of Hamming distances those windows cover
+  const int c0 = std::max(x_begin - r, 0), c1 = std::min(x_end + r, W);
+
+  // Reversed right rows, so that increasing disparity reads increasing addresses:
+  // right[x - min_d - i] = rev[k0 - x + i]
+  const int pad = std::max(0, -min_d) + 1;
+  const int k0 = pad + W - 1 + min_d;
+  boost::shared_ptr<Scratch> scratch;
+  {
+    boost::lock_guard<boost::mutex> lock(scratch_mutex_);
+    if (free_scratch_.empty()) {
+      scratch.reset(new Scratch);
+    }
+    else {
+      scratch = free_scratch_.back();
+      free_scratch_.pop_back();
+    }
+  }
+  std::vector<uint64_t>& rev = scratch->rev;
+  std::vector<uint8_t>& hamming = scratch->hamming;
+  std::vector<int16_t>& vsum = scratch->vsum;
+  std::vector<int16_t>& acc = scratch->acc;
+  std::vector<int>& texture_col = scratch->texture_col;
+  rev.assign(pad + W + std::max(0, min_d) + D + 1, 0);
+  hamming.resize(ring * row_len);
+  vsum.assign(row_len, 0);
+  acc.resize(D);
+  texture_col.assign(W, 0);
+
+  int next_add = std::max(begin - r, 0), next_remove = next_add;
+  for (int y = begin; y < end; ++y) {
+    // Bring vsum to the Hamming distances summed over rows [y - r, y + r] within the image
+    for ( ; next_add <= std::min(y + r, H - 1); ++next_add) {
+      const uint64_t* r_row = &right_census_[next_add * W];
+      for (int x = 0; x < W; ++x)
+        rev[pad + W - 1 - x] = r_row[x];
+      uint8_t* h = &hamming[(next_add % ring) * row_len];
+      if (c0 < c1) {
+        hammingRow(&left_census_[next_add * W], &rev[0], c0, c1, D, k0, h);
+        accumulateRow<1>(&vsum[c0 * D], h + c0 * D, (c1 - c0) * D);
+      }
+      if (check_texture) {
+        const uint8_t* t = left_filtered_[next_add];
+        for (int x = 0; x < W; ++x)
+          texture_col[x] += std::abs(t[x] - cap);
+      }
+    }
+    for ( ; next_remove < y - r; ++next_remove) {
+      const uint8_t* h = &hamming[(next_remove % ring) * row_len];
+      if (c0 < c1)
+        accumulateRow<-1>(&vsum[c0 * D], h + c0 * D, (c1 - c0) * D);
+      if (check_texture) {
+        const uint8_t* t = left_filtered_[next_remove];
+        for (int x = 0; x < W; ++x)
+          texture_col[x] -= std::abs(t[x] - cap);
+      }
+    }
+
+    int16_t* out = disparity[y];
+    std::fill(out, out + W, invalid);
+    if (y < r || y >= H - r || x_begin >= x_end)
+      continue;
+
+    // Slide the window along the row
+    std::fill(acc.begin(), acc.end(), 0);
+    int texture = 0;
+    for (int x = x_begin - r; x < x_begin + r; ++x) {
+      accumulate(&acc[0], &vsum[x * D], NULL, D);
+      texture += texture_col[x];
+    }
+    for (int x = x_begin; x < x_end; ++x) {
+      accumulate(&acc[0], &vsum[(x + r) * D], x - r - 1 >= x_begin - r ? &vsum[(x - r - 1) * D] : NULL, D);
+      texture += texture_col[x + r] - (x - r - 1 >= x_begin - r ? texture_col[x - r - 1] : 0);
+      if (check_texture && texture < params.texture_threshold)
+        continue;
+
+      const int16_t* C = &acc[0];
+      int best_cost = minCost(C, D);
+      int best = std::find(C, C + D, best_cost) - C;
+
+      // Reject if anything but the best and its neighbors is within the uniqueness ratio
+      int thresh = best_cost + best_cost * uniqueness / 100;
+      int near = 1 + (best > 0 && C[best - 1] <= thresh) + (best < D - 1 && C[best + 1] <= thresh);
+      if (countAtMost(C, D, thresh) > near)
+        continue;
+
+      // Parabola through the neighbors for subpixel accuracy
+      int d16 = best * 16;
+      if (best > 0 && best < D - 1) {
+        int denom2 = std::max(C[best - 1] + C[best + 1] - 2 * C[best], 1);
+        d16 += ((C[best - 1] - C[best + 1]) * 16 + denom2) / (denom2 * 2);
+      }
+      out[x] = min_d * 16 + d16;
+    }
+  }
+
+  boost::lock_guard<boost::mutex> lock(scratch_mutex_);
+  free_scratch_.push_back(scratch);
+}
+
+} // namespace stereo_image_proc
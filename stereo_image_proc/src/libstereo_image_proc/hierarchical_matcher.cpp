@@ -0,0 +1,72 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include "matcher_internal.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <climits>
+
+namespace stereo_image_proc {
+
+namespace {
+
+const int MAX_LEVELS = 3;
+
+} // namespace
+
+void HierarchicalMatcher::compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                                  cv::Mat_<int16_t>& disparity)
+{
+  int levels = std::min(std::max(params.coarse_levels, 0), MAX_LEVELS);
+  if (levels == 0) {
+    coarse_matcher_.compute(left, right, params, disparity);
+    return;
+  }
+  CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+
+  // Block match the downsampled pair over the downsampled range
+  const int f = 1 << levels;
+  left_coarse_ = left;
+  right_coarse_ = right;
+  for (int i = 0; i < levels; ++i) {
+    cv::Mat l, r;
+    cv::pyrDown(left_coarse_, l);
+    cv::pyrDown(right_coarse_, r);
+    left_coarse_ = l;
+    right_coarse_ = r;
+  }
+
+  const int min_d = params.min_disparity;
+  const int max_d = params.min_disparity + params.disparity_range - 1;
+  MatcherParams coarse = params;
+  coarse.min_disparity = floorDiv(min_d, f);
+  coarse.disparity_range = (ceilDiv(max_d, f) - coarse.min_disparity + 1 + 15) / 16 * 16;
+  coarse.correlation_window_size = std::max(params.correlation_window_size / f, 5) | 1;
+  coarse.speckle_size = params.speckle_size / (f * f);
+  coarse.speckle_range = std::max(params.speckle_range / f, 1);
+  coarse_matcher_.compute(left_coarse_, right_coarse_, coarse, coarse_disparity_);
+
+  // Full resolution search range of each coarse pixel, from its 3x3 neighborhood
+  const int coarse_invalid = coarse.min_disparity * 16;
+  coarse_min_.create(coarse_disparity_.rows, coarse_disparity_.cols);
+  coarse_max_.create(coarse_disparity_.rows, coarse_disparity_.cols);
+  for (int y = 0; y < coarse_disparity_.rows; ++y) {
+    for (int x = 0; x < coarse_disparity_.cols; ++x) {
+      int16_t d16 = coarse_disparity_(y, x);
+      bool valid = d16 >= coarse_invalid;
+      coarse_min_(y, x) = valid ? d16 : SHRT_MAX;
+      coarse_max_(y, x) = valid ? d16 : SHRT_MIN;
+    }
+  }
+  range_shift_ = levels;
+  rangesFromNeighbors(coarse_min_, coarse_max_, f, cv::Mat_<uint8_t>(), params);
+
+  refine(left, right, params, disparity);
+}
+
+cv::Rect HierarchicalMatcher::validWindow(const MatcherParams& params, int width, int height) const
+{
+  if (params.coarse_levels <= 0)
+    return coarse_matcher_.validWindow(params, width, height);
+  return RangeMatcher::validWindow(params, width, height);
+}
+
+} // namespace stereo_image_proc
@@ -0,0 +1,63 @@
+#ifndef STEREO_IMAGE_PROC_MATCHER_INTERNAL_H
+#define STEREO_IMAGE_PROC_MATCHER_INTERNAL_H
+
+#include "stereo_image_proc/stereo_matcher.h"
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+
+namespace stereo_image_proc {
+
+// Helpers shared by the matcher implementations
+
+inline int floorDiv(int a, int b)
+{
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+inline int ceilDiv(int a, int b)
+{
+  return -floorDiv(-a, b);
+}
+
+// x-Sobel prefilter clipped to [-cap, cap] and offset to [0, 2*cap]
+inline void prefilterXSobel(const cv::Mat& src, cv::Mat_<uint8_t>& dst, int cap)
+{
+  dst.create(src.rows, src.cols);
+  for (int y = 0; y < src.rows; ++y) {
+    const uint8_t* prev = src.ptr<uint8_t>(std::max(y - 1, 0));
+    const uint8_t* cur  = src.ptr<uint8_t>(y);
+    const uint8_t* next = src.ptr<uint8_t>(std::min(y + 1, src.rows - 1));
+    uint8_t* out = dst[y];
+    out[0] = out[src.cols - 1] = cap;
+    for (int x = 1; x < src.cols - 1; ++x) {
+      int v = (prev[x+1] - prev[x-1]) + 2*(cur[x+1] - cur[x-1]) + (next[x+1] - next[x-1]);
+      out[x] = std::min(std::max(v, -cap), cap) + cap;
+    }
+  }
+}
+
+// Window of columns [x0, x1) and rows [y0, y1), clipped to a width x height image;
+// possibly empty
+inline cv::Rect clippedWindow(int x0, int y0, int x1, int y1, int width, int height)
+{
+  x0 = std::min(std::max(x0, 0), width);
+  y0 = std::min(std::max(y0, 0), height);
+  x1 = std::min(std::max(x1, x0), width);
+  y1 = std::min(std::max(y1, y0), height);
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Speckle filtering of the matcher output, within the matcher's window of valid
+// disparities (the rest is rejected anyway)
+inline void filterSpeckles(cv::Mat_<int16_t>& disparity, const cv::Rect& window, const MatcherParams& params,
+                           SpeckleFilter& filter)
+{
+  if (params.speckle_size <= 0 || params.speckle_range < 0 || window.area() == 0)
+    return;
+  cv::Mat_<int16_t> valid = disparity(window);
+  filter.filter(valid, (params.min_disparity - 1) * 16, params.speckle_size, params.speckle_range);
+}
+
+} // namespace stereo_image_proc
+
+#endif
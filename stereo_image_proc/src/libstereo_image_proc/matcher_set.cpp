@@ -0,0 +1,94 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include "matcher_internal.h"
+#include <image_proc/parallel.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstdlib>
+
+namespace stereo_image_proc {
+
+cv::Rect validDisparityWindow(const MatcherParams& params, int width, int height)
+{
+  // cv::getValidDisparityROI for a pair with no invalid borders of its own
+  const int border = params.correlation_window_size / 2;
+  const int min_d = params.min_disparity;
+  const int max_d = params.min_disparity + params.disparity_range - 1;
+  return clippedWindow(std::max(0, max_d) + border, border,
+                       std::min(width, width - min_d) - border, height - border, width, height);
+}
+
+StereoMatcher& MatcherSet::Matchers::select(int algorithm, const MatcherParams& params)
+{
+  if (algorithm == STEREO_SGM)
+    return sgm;
+  if (algorithm == STEREO_CENSUS)
+    return census;
+  if (params.temporal_prior)
+    return temporal;
+  if (params.coarse_levels > 0)
+    return hierarchical;
+  return block;
+}
+
+const StereoMatcher& MatcherSet::Matchers::select(int algorithm, const MatcherParams& params) const
+{
+  return const_cast<Matchers*>(this)->select(algorithm, params);
+}
+
+cv::Rect MatcherSet::validWindow(int algorithm, const MatcherParams& params, int width, int height) const
+{
+  // The right-to-left pass and subpixel refinement only ever reject more pixels
+  return forward_.select(algorithm, params).validWindow(params, width, height);
+}
+
+void MatcherSet::compute(int algorithm, const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                         cv::Mat_<int16_t>& disparity)
+{
+  if (params.disp12_max_diff < 0) {
+    forward_.select(algorithm, params).compute(left, right, params, disparity);
+    if (params.subpixel_fit != SUBPIXEL_NONE)
+      refiner_.refine(left, right, params, disparity);
+    return;
+  }
+
+  // Matching the mirrored pair right-to-left gives the right disparities, mirrored
+  cv::flip(right, left_flipped_, 1);
+  cv::flip(left, right_flipped_, 1);
+  image_proc::parallelFor(0, 2, boost::bind(&MatcherSet::computePasses, this, algorithm,
+                                            boost::cref(left), boost::cref(right), boost::cref(params),
+                                            boost::ref(disparity), _1, _2));
+
+  const int W = disparity.cols;
+  const int16_t invalid = (params.min_disparity - 1) * 16;
+  const int max_diff = params.disp12_max_diff * 16;
+  for (int y = 0; y < disparity.rows; ++y) {
+    int16_t* d = disparity[y];
+    const int16_t* backward = backward_disparity_[y];
+    for (int x = 0; x < W; ++x) {
+      if (d[x] == invalid)
+        continue;
+      int x_right = x - floorDiv(d[x] + 8, 16);
+      if (x_right < 0 || x_right >= W)
+        continue;
+      int d_right = backward[W - 1 - x_right];
+      if (d_right != invalid && std::abs(d[x] - d_right) > max_diff)
+        d[x] = invalid;
+    }
+  }
+
+  if (params.subpixel_fit != SUBPIXEL_NONE)
+    refiner_.refine(left, right, params, disparity);
+}
+
+void MatcherSet::computePasses(int algorithm, const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                               cv::Mat_<int16_t>& disparity, int begin, int end)
+{
+  for (int i = begin; i < end; ++i) {
+    if (i == 0)
+      forward_.select(algorithm, params).compute(left, right, params, disparity);
+    else
+      backward_.select(algorithm, params).compute(left_flipped_, right_flipped_, params, backward_disparity_);
+  }
+}
+
+} // namespace stereo_image_proc
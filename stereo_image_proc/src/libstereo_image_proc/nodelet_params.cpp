@@ -0,0 +1,72 @@
+#include "stereo_image_proc/nodelet_params.h"
+#include <ros/console.h>
+#include <limits>
+#include <string>
+
+namespace stereo_image_proc {
+
+void fixDisparityConfig(DisparityConfig& config)
+{
+  config.prefilter_size |= 0x1; // must be odd
+  config.correlation_window_size |= 0x1; // must be odd
+  config.disparity_range = (config.disparity_range / 16) * 16; // must be multiple of 16
+}
+
+void applyDisparityConfig(const DisparityConfig& config, StereoProcessor& processor)
+{
+  processor.setStereoAlgorithm(config.stereo_algorithm);
+  processor.setPreFilterSize(config.prefilter_size);
+  processor.setPreFilterCap(config.prefilter_cap);
+  processor.setCorrelationWindowSize(config.correlation_window_size);
+  processor.setMinDisparity(config.min_disparity);
+  processor.setDisparityRange(config.disparity_range);
+  processor.setUniquenessRatio(config.uniqueness_ratio);
+  processor.setTextureThreshold(config.texture_threshold);
+  processor.setSpeckleSize(config.speckle_size);
+  processor.setSpeckleRange(config.speckle_range);
+  processor.setDisp12MaxDiff(config.disp12_max_diff);
+  processor.setP1(config.P1);
+  processor.setP2(config.P2);
+  processor.setSgmPaths(config.sgm_paths);
+  processor.setStripes(config.stripes);
+  processor.setCoarseLevels(config.coarse_levels);
+  processor.setRefineRadius(config.refine_radius);
+  processor.setTemporalPrior(config.temporal_prior);
+  processor.setMotionThreshold(config.motion_threshold);
+  processor.setSubpixelFit(config.subpixel_fit);
+  processor.setCompactDisparity(config.compact_disparity);
+}
+
+CloudParams loadCloudParams(const ros::NodeHandle& private_nh)
+{
+  CloudParams params;
+
+  // Points to keep
+  const double inf = std::numeric_limits<double>::infinity();
+  double min_range, max_range;
+  private_nh.param("min_range", min_range, 0.0);
+  private_nh.param("max_range", max_range, inf);
+  params.filter.min_range = min_range;
+  params.filter.max_range = max_range;
+  const char* axes[3] = { "x", "y", "z" };
+  for (int i = 0; i < 3; ++i) {
+    double lo, hi;
+    private_nh.param(std::string("crop_min_") + axes[i], lo, -inf);
+    private_nh.param(std::string("crop_max_") + axes[i], hi, inf);
+    params.filter.box_min[i] = lo;
+    params.filter.box_max[i] = hi;
+  }
+
+  private_nh.param("dense", params.dense, false);
+
+  std::string layout;
+  private_nh.param("point_layout", layout, std::string("xyzrgb"));
+  if (!pointLayout(layout, params.layout)) {
+    ROS_ERROR("[%s] Unknown point_layout '%s', using xyzrgb", private_nh.getNamespace().c_str(), layout.c_str());
+    params.layout = LAYOUT_XYZRGB;
+  }
+
+  return params;
+}
+
+} // namespace stereo_image_proc
@@ -1,35 +1,58 @@
 #include <ros/assert.h>
 #include "stereo_image_proc/processor.h"
+#include "stereo_image_proc/disparity_encoding.h"
+#include <image_proc/parallel.h>
 #include <sensor_msgs/image_encodings.h>
+#include <boost/bind.hpp>
 #include <cmath>
 #include <limits>
 
 namespace stereo_image_proc {
 
-bool StereoProcessor::process(const sensor_msgs::ImageConstPtr& left_raw,
-                              const sensor_msgs::ImageConstPtr& right_raw,
-                              const image_geometry::StereoCameraModel& model,
-                              StereoImageSet& output, int flags) const
+namespace {
+
+struct EyeJobs
+{
+  const image_proc::Processor* processor;
+  const sensor_msgs::ImageConstPtr* raw[2];
+  const image_geometry::PinholeCameraModel* model[2];
+  image_proc::ImageSet* output[2];
+  int flags[2];
+  bool ok[2];
+};
+
+void processEyes(EyeJobs& eyes, int begin, int end)
+{
+  for (int i = begin; i < end; ++i)
+    eyes.ok[i] = eyes.processor->process(*eyes.raw[i], *eyes.model[i], *eyes.output[i], eyes.flags[i]);
+}
+
+} // namespace
+
+int StereoProcessor::neededFlags(int flags)
 {
-  // Do monocular processing on left and right images
-  int left_flags = flags & LEFT_ALL;
-  int right_flags = flags & RIGHT_ALL;
   if (flags & STEREO_ALL) {
     // Need the rectified images for stereo processing
-    left_flags |= LEFT_RECT;
-    right_flags |= RIGHT_RECT;
+    flags |= LEFT_RECT | RIGHT_RECT;
   }
   if (flags & (POINT_CLOUD | POINT_CLOUD2)) {
     flags |= DISPARITY;
     // Need the color channels for the point cloud
-    left_flags |= LEFT_RECT_COLOR;
+    flags |= LEFT_RECT_COLOR;
   }
-  if (!mono_processor_.process(left_raw, model.left(), output.left, left_flags))
-    return false;
-  if (!mono_processor_.process(right_raw, model.right(), output.right, right_flags >> 4))
+  return flags;
+}
+
+bool StereoProcessor::process(const sensor_msgs::ImageConstPtr& left_raw,
+                              const sensor_msgs::ImageConstPtr& right_raw,
+                              const image_geometry::StereoCameraModel& model,
+                              StereoImageSet& output, int flags) const
+{
+  flags = neededFlags(flags);
+  if (!processMonocular(left_raw, right_raw, model, output, flags))
     return false;
 
-  // Do block matching to produce the disparity image
+  // Do stereo matching to produce the disparity image
   if (flags & DISPARITY) {
     processDisparity(output.left.rect, output.right.rect, model, output.disparity);
   }
@@ -47,125 +70,110 @@ bool StereoProcessor::process(const sensor_msgs::ImageConstPtr& left_raw,
   return true;
 }
 
+bool StereoProcessor::processMonocular(const sensor_msgs::ImageConstPtr& left_raw,
+                                       const sensor_msgs::ImageConstPtr& right_raw,
+                                       const image_geometry::StereoCameraModel& model,
+                                       StereoImageSet& output, int flags) const
+{
+  // The two eyes are independent, so process them concurrently. Each writes only its
+  // own ImageSet, so the output does not depend on scheduling.
+  EyeJobs eyes = { &mono_processor_,
+                   { &left_raw, &right_raw },
+                   { &model.left(), &model.right() },
+                   { &output.left, &output.right },
+                   { flags & LEFT_ALL, (flags & RIGHT_ALL) >> 4 },
+                   { false, false } };
+  image_proc::parallelFor(0, 2, boost::bind(processEyes, boost::ref(eyes), _1, _2));
+  return eyes.ok[0] && eyes.ok[1];
+}
+
 void StereoProcessor::processDisparity(const cv::Mat& left_rect, const cv::Mat& right_rect,
                                        const image_geometry::StereoCameraModel& model,
                                        stereo_msgs::DisparityImage& disparity) const
+{
+  matchDisparity(left_rect, right_rect, disparity16_);
+  convertDisparity(disparity16_, model, disparity);
+}
+
+void StereoProcessor::matchDisparity(const cv::Mat& left_rect, const cv::Mat& right_rect,
+                                     cv::Mat_<int16_t>& disparity16) const
+{
+  // Matcher produces 16-bit signed (fixed point) disparity image
+  matchers_.compute(algorithm_, left_rect, right_rect, params_, disparity16);
+}
+
+void StereoProcessor::convertDisparity(const cv::Mat_<int16_t>& disparity16,
+                                       const image_geometry::StereoCameraModel& model,
+                                       stereo_msgs::DisparityImage& disparity) const
 {
   // Fixed-point disparity is 16 times the true value: d = d_fp / 16.0 = x_l - x_r.
   static const int DPP = 16; // disparities per pixel
   static const double inv_dpp = 1.0 / DPP;
 
-  // Block matcher produces 16-bit signed (fixed point) disparity image
-  block_matcher_(left_rect, right_rect, disparity16_);
-
-  // Fill in DisparityImage image data, converting to 32-bit float
+  // Window of (potentially) valid disparities; the selected matcher rejects everything
+  // outside it, so only the window is converted and the rest is filled with the rejected value
+  const cv::Rect window = matchers_.validWindow(algorithm_, params_, disparity16.cols, disparity16.rows);
+  disparity.valid_window.x_offset = window.x;
+  disparity.valid_window.y_offset = window.y;
+  disparity.valid_window.width    = window.width;
+  disparity.valid_window.height   = window.height;
+  const int rejected16 = (getMinDisparity() - 1) * DPP;
+
+  // Fill in DisparityImage image data. We also adjust for any x-offset between the principal
+  // points: d = d_fp*inv_dpp - (cx_l - cx_r)
   sensor_msgs::Image& dimage = disparity.image;
-  dimage.height = disparity16_.rows;
-  dimage.width = disparity16_.cols;
-  dimage.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
-  dimage.step = dimage.width * sizeof(float);
-  dimage.data.resize(dimage.step * dimage.height);
-  cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  // We convert from fixed-point to float disparity and also adjust for any x-offset between
-  // the principal points: d = d_fp*inv_dpp - (cx_l - cx_r)
-  disparity16_.convertTo(dmat, dmat.type(), inv_dpp, -(model.left().cx() - model.right().cx()));
-  ROS_ASSERT(dmat.data == &dimage.data[0]);
+  dimage.height = disparity16.rows;
+  dimage.width = disparity16.cols;
+  double cx_offset = model.left().cx() - model.right().cx();
+  if (compact_disparity_) {
+    // Keep the fixed point format, rounding the offset to the nearest 1/16 pixel
+    dimage.encoding = sensor_msgs::image_encodings::TYPE_16SC1;
+    dimage.step = dimage.width * sizeof(int16_t);
+    dimage.data.resize(dimage.step * dimage.height);
+    cv::Mat_<int16_t> dmat(dimage.height, dimage.width, (int16_t*)&dimage.data[0], dimage.step);
+    const int offset16 = cvRound(cx_offset * DPP);
+    cv::Mat_<int16_t> dwindow = dmat(window);
+    disparity16(window).convertTo(dwindow, dmat.type(), 1, -offset16);
+    fillOutside(dmat, window, cv::saturate_cast<int16_t>(rejected16 - offset16));
+    ROS_ASSERT(window.area() == 0 || dwindow.data == dmat.ptr(window.y) + window.x * sizeof(int16_t));
+  }
+  else {
+    // Convert from fixed-point to float disparity
+    dimage.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
+    dimage.step = dimage.width * sizeof(float);
+    dimage.data.resize(dimage.step * dimage.height);
+    cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
+    cv::Mat_<float> dwindow = dmat(window);
+    disparity16(window).convertTo(dwindow, dmat.type(), inv_dpp, -cx_offset);
+    fillOutside(dmat, window, (float)(rejected16 * inv_dpp - cx_offset));
+    ROS_ASSERT(window.area() == 0 || dwindow.data == dmat.ptr(window.y) + window.x * sizeof(float));
+  }
   /// @todo is_bigendian? :)
 
   // Stereo parameters
   disparity.f = model.right().fx();
   disparity.T = model.baseline();
 
-  /// @todo Window of (potentially) valid disparities
-
   // Disparity search range
   disparity.min_disparity = getMinDisparity();
   disparity.max_disparity = getMinDisparity() + getDisparityRange() - 1;
   disparity.delta_d = inv_dpp;
 }
 
-inline bool isValidPoint(const cv::Vec3f& pt)
-{
-  // Check both for disparities explicitly marked as invalid (where OpenCV maps pt.z to MISSING_Z)
-  // and zero disparities (point mapped to infinity).
-  return pt[2] != image_geometry::StereoCameraModel::MISSING_Z && !std::isinf(pt[2]);
-}
-
 void StereoProcessor::processPoints(const stereo_msgs::DisparityImage& disparity,
                                     const cv::Mat& color, const std::string& encoding,
                                     const image_geometry::StereoCameraModel& model,
                                     sensor_msgs::PointCloud& points) const
 {
-  // Calculate dense point cloud
-  const sensor_msgs::Image& dimage = disparity.image;
-  const cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  model.projectDisparityImageTo3d(dmat, dense_points_, true);
-
-  // Fill in sparse point cloud message
-  points.points.resize(0);
-  points.channels.resize(3);
-  points.channels[0].name = "rgb";
-  points.channels[0].values.resize(0);
-  points.channels[1].name = "u";
-  points.channels[1].values.resize(0);
-  points.channels[2].name = "v";
-  points.channels[2].values.resize(0);
-  
-  for (int32_t u = 0; u < dense_points_.rows; ++u) {
-    for (int32_t v = 0; v < dense_points_.cols; ++v) {
-      if (isValidPoint(dense_points_(u,v))) {
-        // x,y,z
-        geometry_msgs::Point32 pt;
-        pt.x = dense_points_(u,v)[0];
-        pt.y = dense_points_(u,v)[1];
-        pt.z = dense_points_(u,v)[2];
-        points.points.push_back(pt);
-        // u,v
-        points.channels[1].values.push_back(u);
-        points.channels[2].values.push_back(v);
-      }
-    }
-  }
+  const cv::Mat_<float> dmat = floatDisparity(disparity, float_disparity_);
+  ROS_ASSERT(!dmat.empty());
 
-  // Fill in color
-  namespace enc = sensor_msgs::image_encodings;
-  points.channels[0].values.reserve(points.points.size());
-  if (encoding == enc::MONO8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v) {
-        if (isValidPoint(dense_points_(u,v))) {
-          uint8_t g = color.at<uint8_t>(u,v);
-          int32_t rgb = (g << 16) | (g << 8) | g;
-          points.channels[0].values.push_back(*(float*)(&rgb));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::RGB8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& rgb = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
-          points.channels[0].values.push_back(*(float*)(&rgb_packed));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::BGR8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& bgr = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (bgr[2] << 16) | (bgr[1] << 8) | bgr[0];
-          points.channels[0].values.push_back(*(float*)(&rgb_packed));
-        }
-      }
-    }
-  }
-  else {
+  // Fill in sparse point cloud message, reprojecting and filling in color in one pass
+  PointColor color_format = pointColor(encoding);
+  if (color_format == COLOR_NONE)
     ROS_WARN("Could not fill color channel of the point cloud, unrecognized encoding '%s'", encoding.c_str());
-  }
+  reprojector_.update(model.reprojectionMatrix(), dmat.cols, dmat.rows);
+  reprojector_.projectSparse(dmat, color, color_format, validWindow(disparity), points);
 }
 
 void StereoProcessor::processPoints2(const stereo_msgs::DisparityImage& disparity,
@@ -173,103 +181,17 @@ void StereoProcessor::processPoints2(const stereo_msgs::DisparityImage& disparit
                                      const image_geometry::StereoCameraModel& model,
                                      sensor_msgs::PointCloud2& points) const
 {
-  // Calculate dense point cloud
-  const sensor_msgs::Image& dimage = disparity.image;
-  const cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  model.projectDisparityImageTo3d(dmat, dense_points_, true);
+  const cv::Mat_<float> dmat = floatDisparity(disparity, float_disparity_);
+  ROS_ASSERT(!dmat.empty());
 
-  // Fill in sparse point cloud message
-  points.height = dense_points_.rows;
-  points.width  = dense_points_.cols;
-  points.fields.resize (4);
-  points.fields[0].name = "x";
-  points.fields[0].offset = 0;
-  points.fields[0].count = 1;
-  points.fields[0].datatype = sensor_msgs::PointField::FLOAT32;
-  points.fields[1].name = "y";
-  points.fields[1].offset = 4;
-  points.fields[1].count = 1;
-  points.fields[1].datatype = sensor_msgs::PointField::FLOAT32;
-  points.fields[2].name = "z";
-  points.fields[2].offset = 8;
-  points.fields[2].count = 1;
-  points.fields[2].datatype = sensor_msgs::PointField::FLOAT32;
-  points.fields[3].name = "rgb";
-  points.fields[3].offset = 12;
-  points.fields[3].count = 1;
-  points.fields[3].datatype = sensor_msgs::PointField::FLOAT32;
-  //points.is_bigendian = false; ???
-  points.point_step = 16;
-  points.row_step = points.point_step * points.width;
-  points.data.resize (points.row_step * points.height);
-  points.is_dense = false; // there may be invalid points
- 
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-  int i = 0;
-  for (int32_t u = 0; u < dense_points_.rows; ++u) {
-    for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-      if (isValidPoint(dense_points_(u,v))) {
-        // x,y,z,rgba
-        memcpy (&points.data[i * points.point_step + 0], &dense_points_(u,v)[0], sizeof (float));
-        memcpy (&points.data[i * points.point_step + 4], &dense_points_(u,v)[1], sizeof (float));
-        memcpy (&points.data[i * points.point_step + 8], &dense_points_(u,v)[2], sizeof (float));
-      }
-      else {
-        memcpy (&points.data[i * points.point_step + 0], &bad_point, sizeof (float));
-        memcpy (&points.data[i * points.point_step + 4], &bad_point, sizeof (float));
-        memcpy (&points.data[i * points.point_step + 8], &bad_point, sizeof (float));
-      }
-    }
-  }
-
-  // Fill in color
-  namespace enc = sensor_msgs::image_encodings;
-  i = 0;
-  if (encoding == enc::MONO8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-        if (isValidPoint(dense_points_(u,v))) {
-          uint8_t g = color.at<uint8_t>(u,v);
-          int32_t rgb = (g << 16) | (g << 8) | g;
-          memcpy (&points.data[i * points.point_step + 12], &rgb, sizeof (int32_t));
-        }
-        else {
-          memcpy (&points.data[i * points.point_step + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::RGB8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& rgb = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
-          memcpy (&points.data[i * points.point_step + 12], &rgb_packed, sizeof (int32_t));
-        }
-        else {
-          memcpy (&points.data[i * points.point_step + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::BGR8) {
-    for (int32_t u = 0; u < dense_points_.rows; ++u) {
-      for (int32_t v = 0; v < dense_points_.cols; ++v, ++i) {
-        if (isValidPoint(dense_points_(u,v))) {
-          const cv::Vec3b& bgr = color.at<cv::Vec3b>(u,v);
-          int32_t rgb_packed = (bgr[2] << 16) | (bgr[1] << 8) | bgr[0];
-          memcpy (&points.data[i * points.point_step + 12], &rgb_packed, sizeof (int32_t));
-        }
-        else {
-          memcpy (&points.data[i * points.point_step + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
-  }
-  else {
+  // Fill in point cloud message, reprojecting and filling in color in one pass
+  PointColor color_format = pointColor(encoding);
+  if (color_format == COLOR_NONE)
     ROS_WARN("Could not fill color channel of the point cloud, unrecognized encoding '%s'", encoding.c_str());
-  }
+  PointFilter filter = point_filter_;
+  filter.window = validWindow(disparity);
+  reprojector_.update(model.reprojectionMatrix(), dmat.cols, dmat.rows);
+  reprojector_.projectCloud(dmat, color, color_format, filter, dense_cloud_, point_layout_, points);
 }
 
 } //namespace stereo_image_proc
@@ -0,0 +1,257 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include "matcher_internal.h"
+#include <image_proc/parallel.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+namespace stereo_image_proc {
+
+namespace {
+
+const int TILE = 32;
+
+struct Tile
+{
+  int x0, x1, y0, y1;
+};
+
+// Absolute difference of the prefiltered pair at disparity d
+struct SadTerm
+{
+  const cv::Mat_<uint8_t>& left;
+  const cv::Mat_<uint8_t>& right;
+  int d;
+
+  SadTerm(const cv::Mat_<uint8_t>& l, const cv::Mat_<uint8_t>& r, int d) : left(l), right(r), d(d) {}
+
+  void operator()(int y, int x0, int x1, int* out) const
+  {
+    const uint8_t* l = left[y];
+    const uint8_t* r = right[y];
+    int begin = std::max(x0, d), end = std::min(x1, right.cols + d);
+    for (int x = x0; x < begin; ++x)
+      out[x - x0] = 0;
+    for (int x = begin; x < end; ++x)
+      out[x - x0] = std::abs(l[x] - r[x - d]);
+    for (int x = std::max(end, x0); x < x1; ++x)
+      out[x - x0] = 0;
+  }
+};
+
+// Prefiltered response, as for the StereoBM texture threshold
+struct TextureTerm
+{
+  const cv::Mat_<uint8_t>& left;
+  int cap;
+
+  TextureTerm(const cv::Mat_<uint8_t>& l, int cap) : left(l), cap(cap) {}
+
+  void operator()(int y, int x0, int x1, int* out) const
+  {
+    const uint8_t* l = left[y];
+    for (int x = x0; x < x1; ++x)
+      out[x - x0] = std::abs(l[x] - cap);
+  }
+};
+
+// Sums of term over the (2r+1)^2 window around each tile pixel whose window lies
+// within the image. out is tile rows x tile columns; other pixels are left alone.
+template <class Term>
+void windowSums(const Tile& t, int r, int rows, int cols, const Term& term,
+                std::vector<int>& row_buf, std::vector<int>& col_sums, int* out)
+{
+  const int cx0 = std::max(t.x0 - r, 0), cx1 = std::min(t.x1 + r, cols);
+  const int n = cx1 - cx0;
+  const int tw = t.x1 - t.x0;
+  row_buf.resize(n);
+  col_sums.assign(n, 0);
+
+  // Column sums over rows [y - r, y + r] within the image
+  int next_add = std::max(t.y0 - r, 0), next_remove = next_add;
+  for (int y = t.y0; y < t.y1; ++y) {
+    for ( ; next_add <= std::min(y + r, rows - 1); ++next_add) {
+      term(next_add, cx0, cx1, &row_buf[0]);
+      for (int j = 0; j < n; ++j)
+        col_sums[j] += row_buf[j];
+    }
+    for ( ; next_remove < y - r; ++next_remove) {
+      term(next_remove, cx0, cx1, &row_buf[0]);
+      for (int j = 0; j < n; ++j)
+        col_sums[j] -= row_buf[j];
+    }
+    if (y < r || y >= rows - r)
+      continue;
+
+    int x_begin = std::max(t.x0, r), x_end = std::min(t.x1, cols - r);
+    if (x_begin >= x_end)
+      continue;
+    int sum = 0;
+    for (int x = x_begin - r; x <= x_begin + r; ++x)
+      sum += col_sums[x - cx0];
+    int* row_out = out + (y - t.y0) * tw - t.x0;
+    row_out[x_begin] = sum;
+    for (int x = x_begin + 1; x < x_end; ++x) {
+      sum += col_sums[x + r - cx0] - col_sums[x - r - 1 - cx0];
+      row_out[x] = sum;
+    }
+  }
+}
+
+} // namespace
+
+void RangeMatcher::rangesFromNeighbors(const cv::Mat_<int16_t>& min16, const cv::Mat_<int16_t>& max16, int scale,
+                                       const cv::Mat_<uint8_t>& full_search, const MatcherParams& params)
+{
+  const int min_d = params.min_disparity;
+  const int max_d = params.min_disparity + params.disparity_range - 1;
+  const int radius = std::max(params.refine_radius, 1);
+  const int rows = min16.rows, cols = min16.cols;
+  range_lo_.create(rows, cols);
+  range_hi_.create(rows, cols);
+  for (int y = 0; y < rows; ++y) {
+    for (int x = 0; x < cols; ++x) {
+      int lo = INT_MAX, hi = INT_MIN;
+      bool full = false;
+      for (int v = std::max(y - 1, 0); v <= std::min(y + 1, rows - 1); ++v) {
+        for (int u = std::max(x - 1, 0); u <= std::min(x + 1, cols - 1); ++u) {
+          lo = std::min(lo, (int)min16(v, u));
+          hi = std::max(hi, (int)max16(v, u));
+          if (!full_search.empty() && full_search(v, u))
+            full = true;
+        }
+      }
+      if (full || lo > hi) {
+        range_lo_(y, x) = min_d;
+        range_hi_(y, x) = max_d;
+      }
+      else {
+        range_lo_(y, x) = std::max(floorDiv(lo * scale, 16) - radius, min_d);
+        range_hi_(y, x) = std::min(ceilDiv(hi * scale, 16) + radius, max_d);
+      }
+    }
+  }
+}
+
+void RangeMatcher::refine(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                          cv::Mat_<int16_t>& disparity)
+{
+  int cap = std::min(std::max(params.prefilter_cap, 1), 63);
+  prefilterXSobel(left, left_filtered_, cap);
+  prefilterXSobel(right, right_filtered_, cap);
+
+  disparity.create(left.rows, left.cols);
+  int num_tiles = ((left.rows + TILE - 1) / TILE) * ((left.cols + TILE - 1) / TILE);
+  image_proc::parallelFor(0, num_tiles, boost::bind(&RangeMatcher::refineTiles, this,
+                                                    boost::cref(params), boost::ref(disparity), _1, _2));
+
+  filterSpeckles(disparity, RangeMatcher::validWindow(params, disparity.cols, disparity.rows), params,
+                 speckle_filter_);
+}
+
+cv::Rect RangeMatcher::validWindow(const MatcherParams& params, int width, int height) const
+{
+  // Pixels whose window is within both images for some disparity of the full range; see
+  // the search ranges in refineTiles()
+  const int r = (params.correlation_window_size | 1) / 2;
+  const int min_d = params.min_disparity, max_d = params.min_disparity + params.disparity_range - 1;
+  return clippedWindow(std::max(r, r + min_d), r, std::min(width - r, width - r + max_d), height - r,
+                       width, height);
+}
+
+void RangeMatcher::refineTiles(const MatcherParams& params, cv::Mat_<int16_t>& disparity,
+                                      int begin, int end)
+{
+  const int rows = disparity.rows, cols = disparity.cols;
+  const int tiles_x = (cols + TILE - 1) / TILE;
+  const int r = (params.correlation_window_size | 1) / 2;
+  const int cap = std::min(std::max(params.prefilter_cap, 1), 63);
+  const int uniqueness = (int)params.uniqueness_ratio;
+  const int16_t invalid = (params.min_disparity - 1) * 16;
+
+  std::vector<int> lo(TILE * TILE), hi(TILE * TILE), texture(TILE * TILE), sums(TILE * TILE);
+  std::vector<int> costs, row_buf, col_sums;
+
+  for (int i = begin; i < end; ++i) {
+    Tile t;
+    t.x0 = (i % tiles_x) * TILE;
+    t.y0 = (i / tiles_x) * TILE;
+    t.x1 = std::min(t.x0 + TILE, cols);
+    t.y1 = std::min(t.y0 + TILE, rows);
+    const int tw = t.x1 - t.x0, th = t.y1 - t.y0;
+
+    // Search ranges, limited to where the windows lie within both images
+    int d_lo = INT_MAX, d_hi = INT_MIN;
+    for (int y = t.y0; y < t.y1; ++y) {
+      int cy = std::min(y >> range_shift_, range_lo_.rows - 1);
+      for (int x = t.x0; x < t.x1; ++x) {
+        int cx = std::min(x >> range_shift_, range_lo_.cols - 1);
+        int k = (y - t.y0) * tw + (x - t.x0);
+        lo[k] = std::max((int)range_lo_(cy, cx), x + r - (cols - 1));
+        hi[k] = std::min((int)range_hi_(cy, cx), x - r);
+        if (y < r || y >= rows - r || x < r || x >= cols - r)
+          hi[k] = lo[k] - 1;
+        if (lo[k] <= hi[k]) {
+          d_lo = std::min(d_lo, lo[k]);
+          d_hi = std::max(d_hi, hi[k]);
+        }
+      }
+    }
+    if (d_lo > d_hi) {
+      for (int y = t.y0; y < t.y1; ++y)
+        std::fill(&disparity(y, t.x0), &disparity(y, t.x0) + tw, invalid);
+      continue;
+    }
+
+    // SAD costs of the union of the ranges
+    const int n = d_hi - d_lo + 1;
+    costs.resize(tw * th * n);
+    for (int d = d_lo; d <= d_hi; ++d) {
+      windowSums(t, r, rows, cols, SadTerm(left_filtered_, right_filtered_, d), row_buf, col_sums, &sums[0]);
+      for (int k = 0; k < tw * th; ++k)
+        costs[k * n + d - d_lo] = sums[k];
+    }
+    if (params.texture_threshold > 0)
+      windowSums(t, r, rows, cols, TextureTerm(left_filtered_, cap), row_buf, col_sums, &texture[0]);
+
+    // Pick the best disparity in each pixel's own range
+    for (int y = t.y0; y < t.y1; ++y) {
+      int16_t* out = &disparity(y, 0);
+      for (int x = t.x0; x < t.x1; ++x) {
+        int k = (y - t.y0) * tw + (x - t.x0);
+        if (lo[k] > hi[k] || (params.texture_threshold > 0 && texture[k] < params.texture_threshold)) {
+          out[x] = invalid;
+          continue;
+        }
+        const int* C = &costs[k * n - d_lo];
+        int best = lo[k];
+        for (int d = lo[k] + 1; d <= hi[k]; ++d) {
+          if (C[d] < C[best])
+            best = d;
+        }
+
+        int thresh = C[best] + C[best] * uniqueness / 100;
+        bool valid = true;
+        for (int d = lo[k]; d <= hi[k] && valid; ++d) {
+          if ((d < best - 1 || d > best + 1) && C[d] <= thresh)
+            valid = false;
+        }
+        if (!valid) {
+          out[x] = invalid;
+          continue;
+        }
+
+        // Parabola through the neighbors for subpixel accuracy
+        int d16 = best * 16;
+        if (best > lo[k] && best < hi[k]) {
+          int denom2 = std::max(C[best - 1] + C[best + 1] - 2 * C[best], 1);
+          d16 += ((C[best - 1] - C[best + 1]) * 16 + denom2) / (denom2 * 2);
+        }
+        out[x] = d16;
+      }
+    }
+  }
+}
+
+} // namespace stereo_image_proc
@@ -0,0 +1,680 @@
+#include "stereo_image_proc/reprojection.h"
+#include <image_proc/parallel.h>
+#include <sensor_msgs/image_encodings.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace stereo_image_proc {
+
+namespace {
+
+// Rows per band, so each band writes at least a few pages of points
+const int MIN_BAND_ROWS = 16;
+
+// Rows reprojected at once when voxelizing, small enough for the scratch points to stay in cache
+const int VOXEL_CHUNK_ROWS = 8;
+
+// Packs columns [begin, end) of a row of colors as 0x00RRGGBB
+void packColors(const cv::Mat& color, PointColor format, int v, int begin, int end, uint32_t* rgb)
+{
+  if (format == COLOR_MONO8) {
+    const uint8_t* g = color.ptr<uint8_t>(v);
+    for (int u = begin; u < end; ++u)
+      rgb[u] = (g[u] << 16) | (g[u] << 8) | g[u];
+  }
+  else if (format == COLOR_RGB8 || format == COLOR_BGR8) {
+    const uint8_t* c = color.ptr<uint8_t>(v) + 3 * begin;
+    const int r = format == COLOR_RGB8 ? 0 : 2, b = 2 - r;
+    for (int u = begin; u < end; ++u, c += 3)
+      rgb[u] = (c[r] << 16) | (c[1] << 8) | c[b];
+  }
+  else {
+    std::fill(rgb + begin, rgb + end, 0);
+  }
+}
+
+// Window clipped to the image, the whole image if empty
+cv::Rect clipWindow(const cv::Rect& window, int width, int height)
+{
+  if (window.width <= 0 || window.height <= 0)
+    return cv::Rect(0, 0, width, height);
+  const int x0 = std::min(std::max(window.x, 0), width), y0 = std::min(std::max(window.y, 0), height);
+  const int x1 = std::max(std::min(window.x + window.width, width), x0);
+  const int y1 = std::max(std::min(window.y + window.height, height), y0);
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Same rule as reprojectImageTo3D with handleMissingValues, the lowest disparity being
+// looked for within window only. Pixels outside it all hold the rejected value, so one of
+// them stands for the rest.
+float missingDisparity(const cv::Mat_<float>& disparity, const cv::Rect& window)
+{
+  double min_d = std::numeric_limits<double>::infinity();
+  if (window.width > 0 && window.height > 0)
+    cv::minMaxLoc(disparity(window), &min_d, NULL);
+  if (window.x > 0 || window.y > 0)
+    min_d = std::min<double>(min_d, disparity(0, 0));
+  else if (window.width < disparity.cols || window.height < disparity.rows)
+    min_d = std::min<double>(min_d, disparity(disparity.rows - 1, disparity.cols - 1));
+  return (float)min_d;
+}
+
+// Bytes per point of each PointLayout
+const int POINT_STEP[4] = { 16, 12, 6, 6 };
+
+// LAYOUT_XYZ_MM scale and range, in millimeters
+const float MM_PER_M = 1000.0f;
+const float FIXED_MAX = 32767.0f;
+
+#if defined(__SSE2__)
+// halfFloat() of 4 floats, in the low 16 bits of each lane (sign extended)
+inline __m128i halfFloats(__m128 f)
+{
+  const __m128 sign = _mm_and_ps(f, _mm_castsi128_ps(_mm_set1_epi32(0x80000000)));
+  const __m128 abs_f = _mm_xor_ps(f, sign);
+  const __m128i abs_i = _mm_castps_si128(abs_f);
+
+  const __m128i is_nan = _mm_castps_si128(_mm_cmpunord_ps(abs_f, abs_f));
+  const __m128i special = _mm_or_si128(_mm_and_si128(is_nan, _mm_set1_epi32(0x200)), _mm_set1_epi32(0x7c00));
+  const __m128i regular = _mm_cmpgt_epi32(_mm_set1_epi32((127 + 16) << 23), abs_i);
+  const __m128i subnormal = _mm_cmpgt_epi32(_mm_set1_epi32((127 - 14) << 23), abs_i);
+
+  const __m128i magic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+  const __m128i sub = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(abs_f, _mm_castsi128_ps(magic))), magic);
+  const __m128i odd = _mm_and_si128(_mm_srli_epi32(abs_i, 13), _mm_set1_epi32(1));
+  const __m128i normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(abs_i, odd),
+                                                      _mm_set1_epi32(0xfff - ((127 - 15) << 23))), 13);
+
+  __m128i h = _mm_or_si128(_mm_and_si128(subnormal, sub), _mm_andnot_si128(subnormal, normal));
+  h = _mm_or_si128(_mm_and_si128(regular, h), _mm_andnot_si128(regular, special));
+  return _mm_or_si128(h, _mm_srai_epi32(_mm_castps_si128(sign), 16));
+}
+#endif
+
+// Fills in the fields of a layout
+void describeLayout(PointLayout layout, sensor_msgs::PointCloud2& points)
+{
+  const char* float_names[4] = { "x", "y", "z", "rgb" };
+  const char* mm_names[3] = { "x_mm", "y_mm", "z_mm" };
+  const char* half_names[3] = { "x_f16", "y_f16", "z_f16" };
+  const char** names = float_names;
+  int count = 3, size = 4;
+  uint8_t datatype = sensor_msgs::PointField::FLOAT32;
+  if (layout == LAYOUT_XYZRGB) {
+    count = 4;
+  }
+  else if (layout == LAYOUT_XYZ_MM) {
+    names = mm_names;
+    size = 2;
+    datatype = sensor_msgs::PointField::INT16;
+  }
+  else if (layout == LAYOUT_XYZ_HALF) {
+    // There is no half float datatype, so the fields hold the raw bits
+    names = half_names;
+    size = 2;
+    datatype = sensor_msgs::PointField::UINT16;
+  }
+
+  points.fields.resize(count);
+  for (int i = 0; i < count; ++i) {
+    points.fields[i].name = names[i];
+    points.fields[i].offset = size * i;
+    points.fields[i].count = 1;
+    points.fields[i].datatype = datatype;
+  }
+  points.point_step = POINT_STEP[layout];
+}
+
+// Writes count invalid points of a layout: NaN in all fields, zero for LAYOUT_XYZ_MM
+template <int Layout>
+void fillInvalid(uint8_t* out, int count)
+{
+  if (Layout == LAYOUT_XYZ_MM) {
+    memset(out, 0, count * POINT_STEP[Layout]);
+  }
+  else if (Layout == LAYOUT_XYZ_HALF) {
+    std::fill((uint16_t*)out, (uint16_t*)out + 3 * count, (uint16_t)0x7e00);
+  }
+  else {
+    const int fields = Layout == LAYOUT_XYZRGB ? 4 : 3;
+    std::fill((float*)out, (float*)out + fields * count, std::numeric_limits<float>::quiet_NaN());
+  }
+}
+
+} // namespace
+
+uint16_t halfFloat(float value)
+{
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+  const uint32_t sign = f & 0x80000000u;
+  f ^= sign;
+  uint32_t h;
+  if (f >= (127 + 16) << 23) {
+    h = f > 0x7f800000u ? 0x7e00 : 0x7c00;
+  }
+  else if (f < (127 - 14) << 23) {
+    // Subnormal or zero: adding a magic number lets the float adder do the rounding
+    const uint32_t magic_bits = ((127 - 15) + (23 - 10) + 1) << 23;
+    float magic, g;
+    memcpy(&magic, &magic_bits, sizeof(magic));
+    memcpy(&g, &f, sizeof(g));
+    g += magic;
+    memcpy(&h, &g, sizeof(h));
+    h -= magic_bits;
+  }
+  else {
+    // Rebias the exponent and round the dropped mantissa bits, ties to even
+    h = (f - ((127 - 15) << 23) + 0xfff + ((f >> 13) & 1)) >> 13;
+  }
+  return h | (sign >> 16);
+}
+
+PointColor pointColor(const std::string& encoding)
+{
+  namespace enc = sensor_msgs::image_encodings;
+  if (encoding == enc::MONO8)
+    return COLOR_MONO8;
+  if (encoding == enc::RGB8)
+    return COLOR_RGB8;
+  if (encoding == enc::BGR8)
+    return COLOR_BGR8;
+  return COLOR_NONE;
+}
+
+cv::Mat colorPixels(const sensor_msgs::Image& image, PointColor format)
+{
+  const int channels = format == COLOR_MONO8 ? 1 : 3;
+  if (image.height == 0 || image.width == 0 || image.step < image.width * channels ||
+      image.data.size() < (size_t)image.height * image.step)
+    return cv::Mat();
+  return cv::Mat(image.height, image.width, channels == 1 ? CV_8UC1 : CV_8UC3,
+                 const_cast<uint8_t*>(&image.data[0]), image.step);
+}
+
+bool pointLayout(const std::string& name, PointLayout& layout)
+{
+  const char* names[4] = { "xyzrgb", "xyz", "xyz_mm", "xyz_half" };
+  for (int i = 0; i < 4; ++i) {
+    if (name == names[i]) {
+      layout = PointLayout(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+PointFilter::PointFilter()
+  : min_range(0.0f), max_range(std::numeric_limits<float>::infinity())
+{
+  for (int i = 0; i < 3; ++i) {
+    box_min[i] = -std::numeric_limits<float>::infinity();
+    box_max[i] = std::numeric_limits<float>::infinity();
+  }
+}
+
+bool PointFilter::keepsAll() const
+{
+  const float inf = std::numeric_limits<float>::infinity();
+  bool all = min_range <= 0.0f && max_range == inf;
+  for (int i = 0; i < 3; ++i)
+    all = all && box_min[i] == -inf && box_max[i] == inf;
+  return all;
+}
+
+Reprojector::Reprojector()
+  : ray_z_(0.0f), w_d_(0.0f), w_0_(0.0f)
+{
+  for (int i = 0; i < 16; ++i)
+    Q_.val[i] = 0.0;
+}
+
+void Reprojector::update(const cv::Matx44d& Q, int width, int height)
+{
+  bool same = (int)ray_x_.size() == width && (int)ray_y_.size() == height;
+  for (int i = 0; i < 16 && same; ++i)
+    same = Q.val[i] == Q_.val[i];
+  if (same)
+    return;
+
+  Q_ = Q;
+  ray_x_.resize(width);
+  for (int u = 0; u < width; ++u)
+    ray_x_[u] = Q(0,0) * u + Q(0,3);
+  ray_y_.resize(height);
+  for (int v = 0; v < height; ++v)
+    ray_y_[v] = Q(1,1) * v + Q(1,3);
+  ray_z_ = Q(2,3);
+  w_d_ = Q(3,2);
+  w_0_ = Q(3,3);
+}
+
+struct Reprojector::Job
+{
+  const cv::Mat_<float>* disparity;
+  const cv::Mat* color;
+  PointColor color_format;
+  float missing;
+  const PointFilter* filter;
+  cv::Rect window;    // within the image; pixels outside are invalid
+  uint8_t* points;    // NULL to only count the kept points
+  size_t row_step;    // organized output
+  int first_row;      // organized output: row stored at points
+  const int* offsets; // dense output: index of the first kept point of each row
+  int* counts;        // kept points of each row, when only counting
+};
+
+template <int Layout>
+void Reprojector::rows(const Job* job, int begin, int end) const
+{
+  // The layout is a template argument, so the per-point branches on it compile away
+  const bool COLOR  = Layout == LAYOUT_XYZRGB;
+  const bool FLOATS = Layout == LAYOUT_XYZRGB || Layout == LAYOUT_XYZ;
+  const bool FIXED  = Layout == LAYOUT_XYZ_MM;
+  const int STEP = POINT_STEP[Layout];
+  const cv::Mat_<float>& disparity = *job->disparity;
+  const int width = disparity.cols;
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float missing = job->missing;
+  const bool count_only = job->points == NULL;
+  const bool dense = job->offsets != NULL;
+
+  const PointFilter& filter = *job->filter;
+  const bool filtered = !filter.keepsAll();
+  const float min_r2 = filter.min_range * filter.min_range;
+  const float max_r2 = filter.max_range * filter.max_range;
+  const int x0 = job->window.x, x1 = job->window.x + job->window.width;
+  const int y0 = job->window.y, y1 = job->window.y + job->window.height;
+
+  std::vector<uint32_t> rgb(COLOR ? width : 0);
+  for (int v = begin; v < end; ++v) {
+    const float* d = disparity[v];
+    uint8_t* out = NULL;
+    if (!count_only) {
+      out = dense ? job->points + STEP * job->offsets[v]
+                  : job->points + (v - job->first_row) * job->row_step;
+    }
+
+    // Pixels outside the window are not looked at
+    if (v < y0 || v >= y1) {
+      if (count_only)
+        job->counts[v] = 0;
+      else if (!dense)
+        fillInvalid<Layout>(out, width);
+      continue;
+    }
+    if (!count_only && !dense) {
+      fillInvalid<Layout>(out, x0);
+      fillInvalid<Layout>(out + STEP * x1, width - x1);
+    }
+
+    if (COLOR && !count_only)
+      packColors(*job->color, job->color_format, v, x0, x1, &rgb[0]);
+    const float y = ray_y_[v];
+    int kept = 0;
+
+    int u = x0;
+#if defined(__SSE2__)
+    const __m128 nan4 = _mm_set1_ps(nan), zero4 = _mm_setzero_ps(), one4 = _mm_set1_ps(1.0f);
+    const __m128 missing4 = _mm_set1_ps(missing);
+    const __m128 w_d = _mm_set1_ps(w_d_), w_0 = _mm_set1_ps(w_0_);
+    const __m128 y4 = _mm_set1_ps(y), z4 = _mm_set1_ps(ray_z_);
+    for (; u < x1 - 3; u += 4) {
+      __m128 d4 = _mm_loadu_ps(d + u);
+      __m128 w = _mm_add_ps(_mm_mul_ps(w_d, d4), w_0);
+      __m128 iw = _mm_div_ps(one4, w);
+      __m128 valid = _mm_and_ps(_mm_cmpneq_ps(d4, missing4), _mm_cmpneq_ps(w, zero4));
+      iw = _mm_or_ps(_mm_and_ps(valid, iw), _mm_andnot_ps(valid, nan4));
+
+      __m128 px = _mm_mul_ps(_mm_loadu_ps(&ray_x_[u]), iw);
+      __m128 py = _mm_mul_ps(y4, iw);
+      __m128 pz = _mm_mul_ps(z4, iw);
+      if (filtered) {
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(r2, _mm_set1_ps(min_r2)),
+                                             _mm_cmple_ps(r2, _mm_set1_ps(max_r2))));
+        const __m128 p[3] = { px, py, pz };
+        for (int i = 0; i < 3; ++i) {
+          valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(p[i], _mm_set1_ps(filter.box_min[i])),
+                                               _mm_cmple_ps(p[i], _mm_set1_ps(filter.box_max[i]))));
+        }
+      }
+      if (FIXED) {
+        // Points out of the int16 range are dropped
+        const __m128 mm = _mm_set1_ps(MM_PER_M), lo = _mm_set1_ps(-FIXED_MAX), hi = _mm_set1_ps(FIXED_MAX);
+        px = _mm_mul_ps(px, mm);
+        py = _mm_mul_ps(py, mm);
+        pz = _mm_mul_ps(pz, mm);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(px, lo), _mm_cmple_ps(px, hi)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(py, lo), _mm_cmple_ps(py, hi)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(pz, lo), _mm_cmple_ps(pz, hi)));
+      }
+      const int mask = _mm_movemask_ps(valid);
+      if (count_only) {
+        kept += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+        continue;
+      }
+      if (dense && mask == 0)
+        continue;
+
+      if (FIXED) {
+        // Invalid and filtered out points are all zero
+        px = _mm_and_ps(valid, px);
+        py = _mm_and_ps(valid, py);
+        pz = _mm_and_ps(valid, pz);
+      }
+      else if (!dense) {
+        // Invalid and filtered out points become NaN in all fields
+        px = _mm_or_ps(_mm_and_ps(valid, px), _mm_andnot_ps(valid, nan4));
+        py = _mm_or_ps(_mm_and_ps(valid, py), _mm_andnot_ps(valid, nan4));
+        pz = _mm_or_ps(_mm_and_ps(valid, pz), _mm_andnot_ps(valid, nan4));
+      }
+
+      if (FLOATS) {
+        __m128 pc = zero4;
+        if (COLOR) {
+          pc = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)&rgb[u]));
+          if (!dense)
+            pc = _mm_or_ps(_mm_and_ps(valid, pc), _mm_andnot_ps(valid, nan4));
+        }
+        // Columns x, y, z, rgb to one point per register
+        _MM_TRANSPOSE4_PS(px, py, pz, pc);
+        const __m128 p[4] = { px, py, pz, pc };
+        for (int i = 0; i < 4; ++i) {
+          if (dense && !(mask & (1 << i)))
+            continue;
+          float* dst = (float*)(out + STEP * (dense ? kept++ : u + i));
+          if (COLOR) {
+            _mm_storeu_ps(dst, p[i]);
+          }
+          else {
+            _mm_storel_pi((__m64*)dst, p[i]);
+            _mm_store_ss(dst + 2, _mm_movehl_ps(p[i], p[i]));
+          }
+        }
+      }
+      else {
+        // 16-bit columns, interleaved per point
+        __m128i cx, cy, cz;
+        if (FIXED) {
+          cx = _mm_cvtps_epi32(px);
+          cy = _mm_cvtps_epi32(py);
+          cz = _mm_cvtps_epi32(pz);
+        }
+        else {
+          cx = halfFloats(px);
+          cy = halfFloats(py);
+          cz = halfFloats(pz);
+        }
+        int16_t c[12];
+        _mm_storeu_si128((__m128i*)c, _mm_packs_epi32(cx, cy));
+        _mm_storel_epi64((__m128i*)(c + 8), _mm_packs_epi32(cz, cz));
+        for (int i = 0; i < 4; ++i) {
+          if (dense && !(mask & (1 << i)))
+            continue;
+          int16_t* dst = (int16_t*)(out + STEP * (dense ? kept++ : u + i));
+          dst[0] = c[i];
+          dst[1] = c[4 + i];
+          dst[2] = c[8 + i];
+        }
+      }
+    }
+#endif
+    for (; u < x1; ++u) {
+      float w = w_d_ * d[u] + w_0_;
+      bool valid = d[u] != missing && w != 0.0f;
+      float iw = 1.0f / w;
+      float px = ray_x_[u] * iw, py = y * iw, pz = ray_z_ * iw;
+      if (valid && filtered) {
+        float r2 = px * px + py * py + pz * pz;
+        valid = r2 >= min_r2 && r2 <= max_r2 &&
+                px >= filter.box_min[0] && px <= filter.box_max[0] &&
+                py >= filter.box_min[1] && py <= filter.box_max[1] &&
+                pz >= filter.box_min[2] && pz <= filter.box_max[2];
+      }
+      if (FIXED) {
+        px *= MM_PER_M;
+        py *= MM_PER_M;
+        pz *= MM_PER_M;
+        valid = valid && px >= -FIXED_MAX && px <= FIXED_MAX && py >= -FIXED_MAX && py <= FIXED_MAX &&
+                pz >= -FIXED_MAX && pz <= FIXED_MAX;
+      }
+      if (count_only || (dense && !valid)) {
+        kept += valid;
+        continue;
+      }
+
+      uint8_t* dst = out + STEP * (dense ? kept++ : u);
+      if (FLOATS) {
+        float* p = (float*)dst;
+        if (!valid) {
+          p[0] = p[1] = p[2] = nan;
+          if (COLOR)
+            p[3] = nan;
+          continue;
+        }
+        p[0] = px;
+        p[1] = py;
+        p[2] = pz;
+        if (COLOR)
+          memcpy(&p[3], &rgb[u], sizeof(float));
+      }
+      else if (FIXED) {
+        int16_t* p = (int16_t*)dst;
+        p[0] = valid ? cvRound(px) : 0;
+        p[1] = valid ? cvRound(py) : 0;
+        p[2] = valid ? cvRound(pz) : 0;
+      }
+      else {
+        uint16_t* p = (uint16_t*)dst;
+        p[0] = halfFloat(valid ? px : nan);
+        p[1] = halfFloat(valid ? py : nan);
+        p[2] = halfFloat(valid ? pz : nan);
+      }
+    }
+
+    if (count_only)
+      job->counts[v] = kept;
+  }
+}
+
+void Reprojector::projectCloud(const cv::Mat_<float>& disparity, const cv::Mat& color,
+                               PointColor color_format, const PointFilter& filter, bool dense,
+                               PointLayout layout, sensor_msgs::PointCloud2& points) const
+{
+  CV_Assert(disparity.cols == (int)ray_x_.size() && disparity.rows == (int)ray_y_.size());
+  CV_Assert(color_format == COLOR_NONE ||
+            (color.rows == disparity.rows && color.cols == disparity.cols));
+
+  const cv::Rect window = clipWindow(filter.window, disparity.cols, disparity.rows);
+  Job job = { &disparity, &color, color_format, missingDisparity(disparity, window), &filter, window,
+              NULL, 0, 0, NULL, NULL };
+
+  typedef void (Reprojector::*RowsFunction)(const Job*, int, int) const;
+  RowsFunction kernel = &Reprojector::rows<LAYOUT_XYZRGB>;
+  if (layout == LAYOUT_XYZ)
+    kernel = &Reprojector::rows<LAYOUT_XYZ>;
+  else if (layout == LAYOUT_XYZ_MM)
+    kernel = &Reprojector::rows<LAYOUT_XYZ_MM>;
+  else if (layout == LAYOUT_XYZ_HALF)
+    kernel = &Reprojector::rows<LAYOUT_XYZ_HALF>;
+
+  // Dense clouds: count the kept points of each row first, for the offset of each row's first point
+  std::vector<int> offsets;
+  if (dense) {
+    offsets.resize(disparity.rows + 1, 0);
+    job.counts = &offsets[1];
+    image_proc::parallelFor(0, disparity.rows, boost::bind(kernel, this, &job, _1, _2), MIN_BAND_ROWS);
+    for (int v = 0; v < disparity.rows; ++v)
+      offsets[v + 1] += offsets[v];
+    job.counts = NULL;
+    job.offsets = &offsets[0];
+    points.height = 1;
+    points.width  = offsets[disparity.rows];
+  }
+  else {
+    points.height = disparity.rows;
+    points.width  = disparity.cols;
+  }
+
+  describeLayout(layout, points);
+  points.row_step = points.point_step * points.width;
+  points.data.resize(points.row_step * points.height);
+  points.is_dense = dense; // organized clouds may have invalid points
+  if (points.data.empty())
+    return;
+
+  job.points = &points.data[0];
+  job.row_step = points.row_step;
+  image_proc::parallelFor(0, disparity.rows, boost::bind(kernel, this, &job, _1, _2), MIN_BAND_ROWS);
+}
+
+void Reprojector::voxelRows(const Job* job, float leaf_size, std::vector<image_proc::VoxelGrid>* grids,
+                            int begin, int end) const
+{
+  // Each chunk of rows is reprojected to a scratch buffer and voxelized on its own
+  const int width = job->disparity->cols, rows_total = job->disparity->rows;
+  std::vector<float> scratch(4 * width * VOXEL_CHUNK_ROWS);
+  Job chunk = *job;
+  chunk.points = (uint8_t*)&scratch[0];
+  chunk.row_step = 4 * width * sizeof(float);
+  const int x0 = job->window.x, y0 = job->window.y;
+  const int y1 = job->window.y + job->window.height;
+  for (int c = begin; c < end; ++c) {
+    // Only the rows and columns of the window hold valid points
+    const int v0 = std::max(c * VOXEL_CHUNK_ROWS, y0);
+    const int v1 = std::min(std::min((c + 1) * VOXEL_CHUNK_ROWS, rows_total), y1);
+    (*grids)[c].reset(leaf_size);
+    if (v0 >= v1)
+      continue;
+    chunk.first_row = v0;
+    rows<LAYOUT_XYZRGB>(&chunk, v0, v1);
+    for (int v = v0; v < v1; ++v)
+      (*grids)[c].addPoints(&scratch[4 * ((v - v0) * width + x0)], job->window.width);
+  }
+}
+
+void Reprojector::voxelize(const cv::Mat_<float>& disparity, const cv::Mat& color,
+                           PointColor color_format, const PointFilter& filter,
+                           image_proc::VoxelGrid& grid)
+{
+  CV_Assert(disparity.cols == (int)ray_x_.size() && disparity.rows == (int)ray_y_.size());
+  CV_Assert(color_format == COLOR_NONE ||
+            (color.rows == disparity.rows && color.cols == disparity.cols));
+
+  const cv::Rect window = clipWindow(filter.window, disparity.cols, disparity.rows);
+  Job job = { &disparity, &color, color_format, missingDisparity(disparity, window), &filter, window,
+              NULL, 0, 0, NULL, NULL };
+
+  // Chunks are merged in order, so the result does not depend on the number of threads.
+  // The chunk grids are reset and reused from frame to frame, keeping their tables.
+  const int chunks = (disparity.rows + VOXEL_CHUNK_ROWS - 1) / VOXEL_CHUNK_ROWS;
+  if ((int)chunk_grids_.size() < chunks)
+    chunk_grids_.resize(chunks);
+  image_proc::parallelFor(0, chunks, boost::bind(&Reprojector::voxelRows, this, &job, grid.leafSize(),
+                                                 &chunk_grids_, _1, _2));
+  grid.reset(grid.leafSize());
+  for (int c = 0; c < chunks; ++c)
+    grid.merge(chunk_grids_[c]);
+}
+
+void Reprojector::countRows(const Job* job, int begin, int end) const
+{
+  const cv::Mat_<float>& disparity = *job->disparity;
+  const float missing = job->missing;
+  const int x0 = job->window.x, x1 = job->window.x + job->window.width;
+  for (int v = begin; v < end; ++v) {
+    const float* d = disparity[v];
+    int count = 0;
+    if (v >= job->window.y && v < job->window.y + job->window.height) {
+      for (int u = x0; u < x1; ++u)
+        count += d[u] != missing && w_d_ * d[u] + w_0_ != 0.0f;
+    }
+    job->counts[v] = count;
+  }
+}
+
+void Reprojector::sparseRows(const Job* job, sensor_msgs::PointCloud* points, int begin, int end) const
+{
+  const cv::Mat_<float>& disparity = *job->disparity;
+  const float missing = job->missing;
+  const bool has_color = job->color_format != COLOR_NONE;
+  const int x0 = job->window.x, x1 = job->window.x + job->window.width;
+  begin = std::max(begin, job->window.y);
+  end = std::min(end, job->window.y + job->window.height);
+  std::vector<uint32_t> rgb(disparity.cols);
+  for (int v = begin; v < end; ++v) {
+    const float* d = disparity[v];
+    if (has_color)
+      packColors(*job->color, job->color_format, v, x0, x1, &rgb[0]);
+
+    int i = job->offsets[v];
+    geometry_msgs::Point32* pt = &points->points[0];
+    float* rgb_out = has_color ? &points->channels[0].values[0] : NULL;
+    float* u_out = &points->channels[1].values[0];
+    float* v_out = &points->channels[2].values[0];
+    for (int u = x0; u < x1; ++u) {
+      float w = w_d_ * d[u] + w_0_;
+      if (d[u] == missing || w == 0.0f)
+        continue;
+      float iw = 1.0f / w;
+      pt[i].x = ray_x_[u] * iw;
+      pt[i].y = ray_y_[v] * iw;
+      pt[i].z = ray_z_ * iw;
+      if (has_color)
+        memcpy(&rgb_out[i], &rgb[u], sizeof(float));
+      // For historical reasons, (u,v) = (row, column)
+      u_out[i] = v;
+      v_out[i] = u;
+      ++i;
+    }
+  }
+}
+
+void Reprojector::projectSparse(const cv::Mat_<float>& disparity, const cv::Mat& color,
+                                PointColor color_format, const cv::Rect& window,
+                                sensor_msgs::PointCloud& points) const
+{
+  CV_Assert(disparity.cols == (int)ray_x_.size() && disparity.rows == (int)ray_y_.size());
+  CV_Assert(color_format == COLOR_NONE ||
+            (color.rows == disparity.rows && color.cols == disparity.cols));
+  const cv::Rect clipped = clipWindow(window, disparity.cols, disparity.rows);
+  PointFilter keep_all;
+  Job job = { &disparity, &color, color_format, missingDisparity(disparity, clipped), &keep_all, clipped,
+              NULL, 0, 0, NULL, NULL };
+
+  // Offset of each row's first point
+  std::vector<int> offsets(disparity.rows + 1, 0);
+  job.counts = &offsets[1];
+  image_proc::parallelFor(0, disparity.rows, boost::bind(&Reprojector::countRows, this, &job, _1, _2),
+                          MIN_BAND_ROWS);
+  for (int v = 0; v < disparity.rows; ++v)
+    offsets[v + 1] += offsets[v];
+  const int count = offsets[disparity.rows];
+  job.counts = NULL;
+  job.offsets = &offsets[0];
+
+  points.points.resize(count);
+  points.channels.resize(3);
+  points.channels[0].name = "rgb";
+  points.channels[0].values.resize(color_format != COLOR_NONE ? count : 0);
+  points.channels[1].name = "u";
+  points.channels[1].values.resize(count);
+  points.channels[2].name = "v";
+  points.channels[2].values.resize(count);
+  if (count == 0)
+    return;
+
+  image_proc::parallelFor(0, disparity.rows,
+                          boost::bind(&Reprojector::sparseRows, this, &job, &points, _1, _2),
+                          MIN_BAND_ROWS);
+}
+
+} // namespace stereo_image_proc
@@ -0,0 +1,444 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include "matcher_internal.h"
+#include <image_proc/parallel.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace stereo_image_proc {
+
+namespace {
+
+// Rows of disparity output per band, and rows aggregated above and below each band
+// so that the paths entering it have settled. Fixed, so the output does not depend
+// on how many threads run the bands.
+const int BAND_ROWS = 96;
+const int BAND_OVERLAP = 16;
+
+const int MAX_WINDOW = 11;
+// Costs are scaled to at most 8 * 126, so the sum of 8 paths stays within int16
+const int MAX_P2 = 3000;
+
+// Path cost buffers hold the D costs with this many entries of PAD_COST on either side,
+// so the d-1 and d+1 neighbors can be loaded without special cases
+const int PAD = 8;
+const int16_t PAD_COST = SHRT_MAX;
+
+// Range of the linearly interpolated signal within half a pixel of each sample, for
+// the Birchfield-Tomasi sampling-insensitive dissimilarity
+void btRange(const uint8_t* row, int width, uint8_t* lo, uint8_t* hi, int stride)
+{
+  for (int x = 0; x < width; ++x) {
+    int v = row[x];
+    int a = x > 0 ? (v + row[x-1]) / 2 : v;
+    int b = x < width - 1 ? (v + row[x+1]) / 2 : v;
+    lo[x * stride] = std::min(v, std::min(a, b));
+    hi[x * stride] = std::max(v, std::max(a, b));
+  }
+}
+
+#if defined(__SSE2__)
+
+inline int16_t horizontalMin(__m128i v)
+{
+  v = _mm_min_epi16(v, _mm_srli_si128(v, 8));
+  v = _mm_min_epi16(v, _mm_srli_si128(v, 4));
+  v = _mm_min_epi16(v, _mm_srli_si128(v, 2));
+  return (int16_t)_mm_cvtsi128_si32(v);
+}
+
+// Lr(p,d) = C(p,d) + min(Lr(q,d), Lr(q,d-1) + P1, Lr(q,d+1) + P1, min_k Lr(q,k) + P2) - min_k Lr(q,k)
+// for the previous pixel q on the path. Adds Lr(p,.) into sum if given, returns min_d Lr(p,d).
+inline int16_t aggregate(const int16_t* cost, const int16_t* prev, int16_t prev_min, int16_t* cur,
+                         int16_t* sum, int D, int P1, int P2)
+{
+  const __m128i p1 = _mm_set1_epi16(P1);
+  const __m128i jump = _mm_set1_epi16(prev_min + P2);
+  const __m128i offset = _mm_set1_epi16(prev_min);
+  __m128i min_cost = _mm_set1_epi16(SHRT_MAX);
+  for (int d = 0; d < D; d += 8) {
+    __m128i same = _mm_loadu_si128((const __m128i*)(prev + d));
+    __m128i lower = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(prev + d - 1)), p1);
+    __m128i upper = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(prev + d + 1)), p1);
+    __m128i m = _mm_min_epi16(_mm_min_epi16(same, jump), _mm_min_epi16(lower, upper));
+    __m128i L = _mm_sub_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i*)(cost + d)), m), offset);
+    _mm_storeu_si128((__m128i*)(cur + d), L);
+    min_cost = _mm_min_epi16(min_cost, L);
+    if (sum) {
+      __m128i s = _mm_loadu_si128((const __m128i*)(sum + d));
+      _mm_storeu_si128((__m128i*)(sum + d), _mm_adds_epi16(s, L));
+    }
+  }
+  return horizontalMin(min_cost);
+}
+
+// Birchfield-Tomasi cost of one left pixel against 16 consecutive disparities
+inline void btCost16(uint8_t l, uint8_t l_lo, uint8_t l_hi, const uint8_t* r, const uint8_t* r_lo,
+                     const uint8_t* r_hi, uint8_t* out)
+{
+  __m128i L = _mm_set1_epi8(l), L_lo = _mm_set1_epi8(l_lo), L_hi = _mm_set1_epi8(l_hi);
+  __m128i R = _mm_loadu_si128((const __m128i*)r);
+  __m128i R_lo = _mm_loadu_si128((const __m128i*)r_lo);
+  __m128i R_hi = _mm_loadu_si128((const __m128i*)r_hi);
+  __m128i d1 = _mm_max_epu8(_mm_subs_epu8(L, R_hi), _mm_subs_epu8(R_lo, L));
+  __m128i d2 = _mm_max_epu8(_mm_subs_epu8(R, L_hi), _mm_subs_epu8(L_lo, R));
+  _mm_storeu_si128((__m128i*)out, _mm_min_epu8(d1, d2));
+}
+
+#else
+
+inline int16_t aggregate(const int16_t* cost, const int16_t* prev, int16_t prev_min, int16_t* cur,
+                         int16_t* sum, int D, int P1, int P2)
+{
+  int jump = prev_min + P2;
+  int min_cost = SHRT_MAX;
+  for (int d = 0; d < D; ++d) {
+    int m = std::min(std::min((int)prev[d], jump),
+                     std::min(prev[d-1] + P1, prev[d+1] + P1));
+    int L = cost[d] + m - prev_min;
+    cur[d] = L;
+    min_cost = std::min(min_cost, L);
+    if (sum)
+      sum[d] = std::min(sum[d] + L, (int)SHRT_MAX);
+  }
+  return min_cost;
+}
+
+inline void btCost16(uint8_t l, uint8_t l_lo, uint8_t l_hi, const uint8_t* r, const uint8_t* r_lo,
+                     const uint8_t* r_hi, uint8_t* out)
+{
+  for (int i = 0; i < 16; ++i) {
+    int d1 = std::max(std::max(l - r_hi[i], r_lo[i] - l), 0);
+    int d2 = std::max(std::max(r[i] - l_hi, l_lo - r[i]), 0);
+    out[i] = std::min(d1, d2);
+  }
+}
+
+#endif
+
+} // namespace
+
+struct SemiGlobalMatcher::Scratch
+{
+  std::vector<int16_t> cost;   // band rows x width x D
+  std::vector<int16_t> sum;    // output rows x width x D
+  std::vector<uint16_t> hsum;  // ring of horizontally box-filtered pixel cost rows
+  std::vector<uint16_t> vsum;  // width x D
+  std::vector<uint16_t> acc;   // D
+  std::vector<uint8_t> pixel;  // width x D
+  std::vector<uint8_t> left_lo, left_hi;
+  std::vector<uint8_t> right_rev, right_lo_rev, right_hi_rev; // right row reversed, padded
+  std::vector<int16_t> paths;  // padded path costs of the previous and current rows
+  std::vector<int16_t> path_min;
+  std::vector<int16_t> start;  // padded zero costs, for pixels where a path starts
+};
+
+namespace {
+
+struct Band
+{
+  int width, height, D, min_d;
+  int y0, y1; // output rows
+  int e0, e1; // aggregated rows
+};
+
+// Pixel costs of row y, with the right image sampled at x - d for d = min_d .. min_d + D - 1
+void pixelCostRow(SemiGlobalMatcher::Scratch& s, const Band& b, const cv::Mat_<uint8_t>& left,
+                  const cv::Mat_<uint8_t>& right, int y, int max_cost)
+{
+  const int W = b.width, D = b.D;
+  const uint8_t* l = left[y];
+  const uint8_t* r = right[y];
+
+  // Reverse the right row so that increasing d reads increasing addresses:
+  // r[x - d] = rev[base + W - 1 - x + d]
+  int base = std::max(0, -b.min_d) + 16;
+  size_t rev_len = base + W + std::max(0, b.min_d) + D + 32;
+  s.right_rev.assign(rev_len, 0);
+  s.right_lo_rev.assign(rev_len, 0);
+  s.right_hi_rev.assign(rev_len, 0);
+  for (int x = 0; x < W; ++x)
+    s.right_rev[base + W - 1 - x] = r[x];
+  btRange(r, W, &s.right_lo_rev[base + W - 1], &s.right_hi_rev[base + W - 1], -1);
+  s.left_lo.resize(W);
+  s.left_hi.resize(W);
+  btRange(l, W, &s.left_lo[0], &s.left_hi[0], 1);
+
+  for (int x = 0; x < W; ++x) {
+    int k = base + W - 1 - x + b.min_d;
+    uint8_t* out = &s.pixel[x * D];
+    for (int i = 0; i < D; i += 16)
+      btCost16(l[x], s.left_lo[x], s.left_hi[x], &s.right_rev[k + i], &s.right_lo_rev[k + i],
+               &s.right_hi_rev[k + i], out + i);
+
+    // Disparities that would look outside the right image get the maximum cost
+    int valid_begin = std::max(0, x - W + 1 - b.min_d);
+    int valid_end = std::min(D, x - b.min_d + 1);
+    for (int i = 0; i < std::min(valid_begin, D); ++i)
+      out[i] = max_cost;
+    for (int i = std::max(valid_end, 0); i < D; ++i)
+      out[i] = max_cost;
+  }
+}
+
+// Fills s.cost for the aggregated rows of the band with the pixel costs averaged over
+// the correlation window, scaled to 8 * (mean pixel cost)
+void windowCosts(SemiGlobalMatcher::Scratch& s, const Band& b, const cv::Mat_<uint8_t>& left,
+                 const cv::Mat_<uint8_t>& right, int window, int max_cost)
+{
+  const int W = b.width, H = b.height, D = b.D;
+  const int row_len = W * D;
+  const int r = window / 2;
+  const int ring = 2 * r + 2;
+  const int scale = (8 << 16) / (window * window);
+
+  s.pixel.resize(row_len);
+  s.acc.resize(D);
+  s.hsum.resize(ring * row_len);
+  s.vsum.assign(row_len, 0);
+  s.cost.resize((b.e1 - b.e0) * row_len);
+
+  int next_add = std::max(0, b.e0 - r);
+  int next_remove = next_add;
+  for (int y = b.e0; y < b.e1; ++y) {
+    // Bring vsum to the sum of rows [y - r, y + r] within the image
+    for ( ; next_add <= std::min(H - 1, y + r); ++next_add) {
+      pixelCostRow(s, b, left, right, next_add, max_cost);
+      // Horizontal box filter, running along the row for all disparities at once
+      uint16_t* h = &s.hsum[(next_add % ring) * row_len];
+      const uint8_t* p = &s.pixel[0];
+      uint16_t* acc = &s.acc[0];
+      std::fill(acc, acc + D, 0);
+      for (int x = 0; x < std::min(r, W); ++x)
+        for (int i = 0; i < D; ++i)
+          acc[i] += p[x * D + i];
+      for (int x = 0; x < W; ++x) {
+        if (x + r < W) {
+          const uint8_t* add = p + (x + r) * D;
+          for (int i = 0; i < D; ++i)
+            acc[i] += add[i];
+        }
+        if (x - r - 1 >= 0) {
+          const uint8_t* remove = p + (x - r - 1) * D;
+          for (int i = 0; i < D; ++i)
+            acc[i] -= remove[i];
+        }
+        std::copy(acc, acc + D, h + x * D);
+      }
+      uint16_t* v = &s.vsum[0];
+      for (int j = 0; j < row_len; ++j)
+        v[j] += h[j];
+    }
+    for ( ; next_remove < y - r; ++next_remove) {
+      const uint16_t* h = &s.hsum[(next_remove % ring) * row_len];
+      uint16_t* v = &s.vsum[0];
+      for (int j = 0; j < row_len; ++j)
+        v[j] -= h[j];
+    }
+
+    int16_t* c = &s.cost[(y - b.e0) * row_len];
+    const uint16_t* v = &s.vsum[0];
+    for (int j = 0; j < row_len; ++j)
+      c[j] = (v[j] * scale) >> 16;
+  }
+}
+
+void resetPaths(SemiGlobalMatcher::Scratch& s, const Band& b, int num_row_paths)
+{
+  const int DS = b.D + 2 * PAD;
+  const int slots = num_row_paths * 2 * (b.width + 2);
+  s.paths.resize(slots * DS);
+  for (int k = 0; k < slots; ++k) {
+    int16_t* p = &s.paths[k * DS];
+    std::fill(p, p + PAD, PAD_COST);
+    std::fill(p + PAD, p + PAD + b.D, 0);
+    std::fill(p + PAD + b.D, p + DS, PAD_COST);
+  }
+  s.path_min.assign(slots, 0);
+}
+
+// One aggregation pass over the band, top-down (dir = 1) or bottom-up (dir = -1). Covers
+// the horizontal path running in the same direction, the vertical path from the rows
+// already visited and, with 8 paths, both diagonals from those rows.
+void aggregatePass(SemiGlobalMatcher::Scratch& s, const Band& b, int dir, bool eight_paths,
+                   int P1, int P2)
+{
+  const int W = b.width, D = b.D, DS = D + 2 * PAD;
+  const int num_row_paths = eight_paths ? 3 : 1;
+  const int row_slots = W + 2;
+  resetPaths(s, b, num_row_paths);
+
+  std::vector<int16_t> horizontal(2 * DS);
+  for (int k = 0; k < 2; ++k) {
+    std::fill(&horizontal[k * DS], &horizontal[k * DS] + DS, PAD_COST);
+  }
+  const int16_t* start = &s.start[PAD];
+
+  int rows = b.e1 - b.e0;
+  for (int step = 0; step < rows; ++step) {
+    int y = dir > 0 ? b.e0 + step : b.e1 - 1 - step;
+    int parity = step & 1;
+    const int16_t* cost_row = &s.cost[(y - b.e0) * W * D];
+    int16_t* sum_row = (y >= b.y0 && y < b.y1) ? &s.sum[(y - b.y0) * W * D] : NULL;
+
+    // Path k uses slots [2k + parity] for the previous row and [2k + 1 - parity] for this row
+    int16_t* prev[3];
+    int16_t* cur[3];
+    int16_t* prev_min[3];
+    int16_t* cur_min[3];
+    for (int k = 0; k < num_row_paths; ++k) {
+      prev[k] = &s.paths[(2*k + parity) * row_slots * DS] + PAD;
+      cur[k]  = &s.paths[(2*k + 1 - parity) * row_slots * DS] + PAD;
+      prev_min[k] = &s.path_min[(2*k + parity) * row_slots];
+      cur_min[k]  = &s.path_min[(2*k + 1 - parity) * row_slots];
+    }
+
+    const int16_t* h_prev = start;
+    int16_t h_prev_min = 0;
+    for (int i = 0; i < W; ++i) {
+      int x = dir > 0 ? i : W - 1 - i;
+      const int16_t* cost = cost_row + x * D;
+      int16_t* sum = sum_row ? sum_row + x * D : NULL;
+      int slot = x + 1; // slots 0 and W + 1 are the path starts beyond the image edges
+
+      // Horizontal
+      int16_t* h_cur = &horizontal[(i & 1) * DS] + PAD;
+      h_prev_min = aggregate(cost, h_prev, h_prev_min, h_cur, sum, D, P1, P2);
+      h_prev = h_cur;
+
+      // Vertical
+      cur_min[0][slot] = aggregate(cost, prev[0] + slot * DS, prev_min[0][slot],
+                                   cur[0] + slot * DS, sum, D, P1, P2);
+      if (eight_paths) {
+        // Diagonals, from x - 1 and x + 1 on the previous row
+        cur_min[1][slot] = aggregate(cost, prev[1] + (slot - 1) * DS, prev_min[1][slot - 1],
+                                     cur[1] + slot * DS, sum, D, P1, P2);
+        cur_min[2][slot] = aggregate(cost, prev[2] + (slot + 1) * DS, prev_min[2][slot + 1],
+                                     cur[2] + slot * DS, sum, D, P1, P2);
+      }
+    }
+  }
+}
+
+// Picks the disparity with the lowest aggregated cost for each output pixel
+void selectDisparities(const SemiGlobalMatcher::Scratch& s, const Band& b, const MatcherParams& params,
+                       cv::Mat_<int16_t>& disparity)
+{
+  const int W = b.width, D = b.D;
+  const int uniqueness = (int)params.uniqueness_ratio;
+  const int16_t invalid = (b.min_d - 1) * 16;
+  for (int y = b.y0; y < b.y1; ++y) {
+    const int16_t* sum_row = &s.sum[(y - b.y0) * W * D];
+    int16_t* out = disparity[y];
+    for (int x = 0; x < W; ++x) {
+      const int16_t* S = sum_row + x * D;
+      int best = 0;
+      int best_cost = S[0];
+      for (int d = 1; d < D; ++d) {
+        if (S[d] < best_cost) {
+          best_cost = S[d];
+          best = d;
+        }
+      }
+
+      int x_right = x - (b.min_d + best);
+      bool valid = x_right >= 0 && x_right < W;
+      for (int d = 0; d < D && valid; ++d) {
+        if (S[d] * (100 - uniqueness) < best_cost * 100 && std::abs(d - best) > 1)
+          valid = false;
+      }
+      if (!valid) {
+        out[x] = invalid;
+        continue;
+      }
+
+      // Parabola through the neighbors for subpixel accuracy
+      int d16 = best * 16;
+      if (best > 0 && best < D - 1) {
+        int denom2 = std::max(S[best - 1] + S[best + 1] - 2 * S[best], 1);
+        d16 += ((S[best - 1] - S[best + 1]) * 16 + denom2) / (denom2 * 2);
+      }
+      out[x] = b.min_d * 16 + d16;
+    }
+  }
+}
+
+} // namespace
+
+void SemiGlobalMatcher::compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                                cv::Mat_<int16_t>& disparity)
+{
+  CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+  CV_Assert(params.disparity_range > 0 && params.disparity_range % 16 == 0);
+
+  int cap = std::min(std::max(params.prefilter_cap, 1), 63);
+  prefilterXSobel(left, left_filtered_, cap);
+  prefilterXSobel(right, right_filtered_, cap);
+
+  disparity.create(left.rows, left.cols);
+  int num_bands = (left.rows + BAND_ROWS - 1) / BAND_ROWS;
+  image_proc::parallelFor(0, num_bands, boost::bind(&SemiGlobalMatcher::computeBands, this,
+                                                    boost::cref(params), boost::ref(disparity), _1, _2));
+
+  filterSpeckles(disparity, validWindow(params, disparity.cols, disparity.rows), params, speckle_filter_);
+}
+
+cv::Rect SemiGlobalMatcher::validWindow(const MatcherParams& params, int width, int height) const
+{
+  const int min_d = params.min_disparity, max_d = params.min_disparity + params.disparity_range - 1;
+  return clippedWindow(std::max(min_d, 0), 0, std::min(width, width + max_d), height, width, height);
+}
+
+void SemiGlobalMatcher::computeBands(const MatcherParams& params, cv::Mat_<int16_t>& disparity,
+                                     int begin, int end)
+{
+  boost::shared_ptr<Scratch> scratch;
+  {
+    boost::lock_guard<boost::mutex> lock(scratch_mutex_);
+    if (free_scratch_.empty()) {
+      scratch.reset(new Scratch);
+    }
+    else {
+      scratch = free_scratch_.back();
+      free_scratch_.pop_back();
+    }
+  }
+  Scratch& s = *scratch;
+
+  int window = std::min(std::max(params.correlation_window_size | 1, 1), MAX_WINDOW);
+  int P1 = std::max(params.P1, 0);
+  int P2 = std::min(std::max(params.P2, P1 + 1), MAX_P2);
+  bool eight_paths = params.sgm_paths >= 8;
+  int max_cost = 2 * std::min(std::max(params.prefilter_cap, 1), 63);
+
+  for (int band = begin; band < end; ++band) {
+    Band b;
+    b.width = disparity.cols;
+    b.height = disparity.rows;
+    b.D = params.disparity_range;
+    b.min_d = params.min_disparity;
+    b.y0 = band * BAND_ROWS;
+    b.y1 = std::min(b.height, b.y0 + BAND_ROWS);
+    b.e0 = std::max(0, b.y0 - BAND_OVERLAP);
+    b.e1 = std::min(b.height, b.y1 + BAND_OVERLAP);
+
+    s.start.assign(b.D + 2 * PAD, PAD_COST);
+    std::fill(s.start.begin() + PAD, s.start.begin() + PAD + b.D, 0);
+
+    windowCosts(s, b, left_filtered_, right_filtered_, window, max_cost);
+    s.sum.assign((b.y1 - b.y0) * b.width * b.D, 0);
+    aggregatePass(s, b, 1, eight_paths, P1, P2);
+    aggregatePass(s, b, -1, eight_paths, P1, P2);
+    selectDisparities(s, b, params, disparity);
+  }
+
+  boost::lock_guard<boost::mutex> lock(scratch_mutex_);
+  free_scratch_.push_back(scratch);
+}
+
+} // namespace stereo_image_proc
@@ -0,0 +1,117 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include <image_proc/parallel.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstdlib>
+
+namespace stereo_image_proc {
+
+namespace {
+
+// Rows labeled by one task; the union-find trees are joined across band borders afterwards
+const int BAND_ROWS = 32;
+
+// Root of pixel i, halving the path on the way
+inline int findRoot(int* parent, int i)
+{
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+// Joins the regions of pixels a and b, the smaller tree under the larger
+inline void unite(int* parent, int* size, int a, int b)
+{
+  a = findRoot(parent, a);
+  b = findRoot(parent, b);
+  if (a == b)
+    return;
+  if (size[a] < size[b])
+    std::swap(a, b);
+  parent[b] = a;
+  size[a] += size[b];
+}
+
+} // namespace
+
+void SpeckleFilter::filter(cv::Mat_<int16_t>& disparity, int16_t new_val, int max_size, int max_diff)
+{
+  const int N = disparity.rows * disparity.cols;
+  if (N == 0)
+    return;
+  parent_.resize(N);
+  size_.resize(N);
+
+  // Bands are labeled on their own, then joined serially: only a row of pixels per border
+  const int num_bands = (disparity.rows + BAND_ROWS - 1) / BAND_ROWS;
+  image_proc::parallelFor(0, num_bands, boost::bind(&SpeckleFilter::labelBands, this, boost::cref(disparity),
+                                                    new_val, max_diff, _1, _2));
+  const int W = disparity.cols;
+  for (int y = BAND_ROWS; y < disparity.rows; y += BAND_ROWS) {
+    const int16_t* d = disparity[y];
+    const int16_t* up = disparity[y - 1];
+    for (int x = 0; x < W; ++x) {
+      if (d[x] != new_val && up[x] != new_val && std::abs(d[x] - up[x]) <= max_diff)
+        unite(&parent_[0], &size_[0], y * W + x, (y - 1) * W + x);
+    }
+  }
+
+  // Region sizes are final at the roots; the trees are only read from here on
+  image_proc::parallelFor(0, num_bands, boost::bind(&SpeckleFilter::clearBands, this, boost::ref(disparity),
+                                                    new_val, max_size, _1, _2));
+}
+
+void SpeckleFilter::labelBands(const cv::Mat_<int16_t>& disparity, int16_t new_val, int max_diff,
+                               int begin, int end)
+{
+  const int W = disparity.cols;
+  int* parent = &parent_[0];
+  int* size = &size_[0];
+  for (int b = begin; b < end; ++b) {
+    const int y0 = b * BAND_ROWS, y1 = std::min(y0 + BAND_ROWS, disparity.rows);
+    for (int y = y0; y < y1; ++y) {
+      const int16_t* d = disparity[y];
+      const int16_t* up = y > y0 ? disparity[y - 1] : NULL;
+      for (int x = 0, i = y * W; x < W; ++x, ++i) {
+        if (d[x] == new_val) {
+          parent[i] = -1;
+          continue;
+        }
+        parent[i] = i;
+        size[i] = 1;
+        // 4-connected to the left and upper neighbors within the band
+        if (x > 0 && d[x - 1] != new_val && std::abs(d[x] - d[x - 1]) <= max_diff)
+          unite(parent, size, i, i - 1);
+        if (up && up[x] != new_val && std::abs(d[x] - up[x]) <= max_diff)
+          unite(parent, size, i, i - W);
+      }
+    }
+  }
+}
+
+void SpeckleFilter::clearBands(cv::Mat_<int16_t>& disparity, int16_t new_val, int max_size,
+                               int begin, int end) const
+{
+  const int W = disparity.cols;
+  const int* parent = &parent_[0];
+  const int* size = &size_[0];
+  for (int b = begin; b < end; ++b) {
+    const int y0 = b * BAND_ROWS, y1 = std::min(y0 + BAND_ROWS, disparity.rows);
+    for (int y = y0; y < y1; ++y) {
+      int16_t* d = disparity[y];
+      for (int x = 0, i = y * W; x < W; ++x, ++i) {
+        if (parent[i] < 0)
+          continue;
+        int root = i;
+        while (parent[root] != root)
+          root = parent[root];
+        if (size[root] <= max_size)
+          d[x] = new_val;
+      }
+    }
+  }
+}
+
+} // namespace stereo_image_proc
@@ -0,0 +1,126 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include "matcher_internal.h"
+#include <image_proc/parallel.h>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace stereo_image_proc {
+
+namespace {
+
+const int MIN_BAND_ROWS = 16;
+
+// Widest window the costs are recomputed over; the fit only needs the shape of the cost
+// around the winner
+const int MAX_FIT_WINDOW = 21;
+
+// Columns past the end of each prefiltered row, so 16 byte loads never leave the buffer
+const int PAD = 16;
+
+#if defined(__SSE2__)
+// First n bytes set, from a load at MASK_BYTES + 16 - n
+const uint8_t MASK_BYTES[32] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                                 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+#endif
+
+// SADs of a window of width columns and rows rows, step bytes apart, at l in the left image
+// against r + 2, r + 1 and r in the right image: disparities d - 1, d and d + 1 when r is
+// the window at d + 1
+inline void windowCosts(const uint8_t* l, const uint8_t* r, size_t step, int rows, int width, int* costs)
+{
+#if defined(__SSE2__)
+  __m128i sum_m = _mm_setzero_si128(), sum_0 = _mm_setzero_si128(), sum_p = _mm_setzero_si128();
+  for (int y = 0; y < rows; ++y, l += step, r += step) {
+    for (int k = 0; k < width; k += 16) {
+      const __m128i mask = _mm_loadu_si128((const __m128i*)(MASK_BYTES + 16 - std::min(width - k, 16)));
+      const __m128i L = _mm_and_si128(_mm_loadu_si128((const __m128i*)(l + k)), mask);
+      const __m128i R_p = _mm_and_si128(_mm_loadu_si128((const __m128i*)(r + k)), mask);
+      const __m128i R_0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(r + k + 1)), mask);
+      const __m128i R_m = _mm_and_si128(_mm_loadu_si128((const __m128i*)(r + k + 2)), mask);
+      sum_p = _mm_add_epi32(sum_p, _mm_sad_epu8(L, R_p));
+      sum_0 = _mm_add_epi32(sum_0, _mm_sad_epu8(L, R_0));
+      sum_m = _mm_add_epi32(sum_m, _mm_sad_epu8(L, R_m));
+    }
+  }
+  // PSADBW leaves a sum in each 64-bit half
+  costs[0] = _mm_cvtsi128_si32(_mm_add_epi32(sum_m, _mm_srli_si128(sum_m, 8)));
+  costs[1] = _mm_cvtsi128_si32(_mm_add_epi32(sum_0, _mm_srli_si128(sum_0, 8)));
+  costs[2] = _mm_cvtsi128_si32(_mm_add_epi32(sum_p, _mm_srli_si128(sum_p, 8)));
+#else
+  costs[0] = costs[1] = costs[2] = 0;
+  for (int y = 0; y < rows; ++y, l += step, r += step) {
+    for (int k = 0; k < width; ++k) {
+      costs[0] += std::abs(l[k] - r[k + 2]);
+      costs[1] += std::abs(l[k] - r[k + 1]);
+      costs[2] += std::abs(l[k] - r[k]);
+    }
+  }
+#endif
+}
+
+} // namespace
+
+void SubpixelRefiner::refine(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                             cv::Mat_<int16_t>& disparity)
+{
+  CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+  CV_Assert(disparity.rows == left.rows && disparity.cols == left.cols);
+
+  // Prefiltered into views of padded buffers
+  int cap = std::min(std::max(params.prefilter_cap, 1), 63);
+  left_padded_.create(left.rows, left.cols + PAD);
+  right_padded_.create(right.rows, right.cols + PAD);
+  left_filtered_ = left_padded_.colRange(0, left.cols);
+  right_filtered_ = right_padded_.colRange(0, right.cols);
+  prefilterXSobel(left, left_filtered_, cap);
+  prefilterXSobel(right, right_filtered_, cap);
+
+  image_proc::parallelFor(0, disparity.rows, boost::bind(&SubpixelRefiner::refineRows, this,
+                                                         boost::cref(params), boost::ref(disparity), _1, _2),
+                          MIN_BAND_ROWS);
+}
+
+void SubpixelRefiner::refineRows(const MatcherParams& params, cv::Mat_<int16_t>& disparity,
+                                 int begin, int end)
+{
+  const int r = std::min(params.correlation_window_size, MAX_FIT_WINDOW) / 2;
+  const int width = 2 * r + 1;
+  const int W = disparity.cols;
+  const int16_t invalid = (params.min_disparity - 1) * 16;
+  const size_t step = left_padded_.step[0];
+  begin = std::max(begin, r);
+  end = std::min(end, disparity.rows - r);
+
+  for (int y = begin; y < end; ++y) {
+    int16_t* disp = disparity[y];
+    for (int x = r; x < W - r; ++x) {
+      if (disp[x] == invalid)
+        continue;
+      // The window at d + 1 must start, and the one at d - 1 end, within the right image
+      const int d = floorDiv(disp[x] + 8, 16);
+      if (x - r - d - 1 < 0 || x + r - d + 1 >= W)
+        continue;
+
+      int costs[3]; // at d - 1, d, d + 1
+      windowCosts(left_filtered_[y - r] + x - r, right_filtered_[y - r] + x - r - d - 1,
+                  step, width, width, costs);
+      const int c_m = costs[0], c_0 = costs[1], c_p = costs[2];
+      if (c_0 > c_m || c_0 > c_p)
+        continue; // the winner is not a minimum of these costs
+
+      // Offset of the minimum from d, in sixteenths of a pixel: the vertex of the parabola
+      // through the three costs, or where lines of opposite slopes through them cross
+      const int denom = params.subpixel_fit == SUBPIXEL_PARABOLA ? c_m - 2 * c_0 + c_p
+                                                                 : std::max(c_m, c_p) - c_0;
+      if (denom > 0)
+        disp[x] = d * 16 + cvRound(8.0f * (c_m - c_p) / denom);
+    }
+  }
+}
+
+} // namespace stereo_image_proc
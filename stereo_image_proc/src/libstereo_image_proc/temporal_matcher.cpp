@@ -0,0 +1,74 @@
+#include "stereo_image_proc/stereo_matcher.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+namespace stereo_image_proc {
+
+namespace {
+
+// The prior and the motion test are taken over blocks of 8x8 pixels, so the 3x3 block
+// neighborhood of each pixel covers at least 8 pixels of motion in any direction
+const int BLOCK_SHIFT = 3;
+const int BLOCK = 1 << BLOCK_SHIFT;
+
+} // namespace
+
+TemporalMatcher::TemporalMatcher()
+  : prev_min_disparity_(0), prev_disparity_range_(0)
+{
+}
+
+void TemporalMatcher::compute(const cv::Mat& left, const cv::Mat& right, const MatcherParams& params,
+                              cv::Mat_<int16_t>& disparity)
+{
+  CV_Assert(left.type() == CV_8UC1 && right.type() == CV_8UC1 && left.size() == right.size());
+
+  bool have_prior = prev_disparity_.rows == left.rows && prev_disparity_.cols == left.cols &&
+                    prev_min_disparity_ == params.min_disparity &&
+                    prev_disparity_range_ == params.disparity_range;
+  if (!have_prior) {
+    full_matcher_.compute(left, right, params, disparity);
+  }
+  else {
+    // Disparity range and motion of each block
+    const int rows = (left.rows + BLOCK - 1) / BLOCK, cols = (left.cols + BLOCK - 1) / BLOCK;
+    const int16_t invalid = (params.min_disparity - 1) * 16;
+    prior_min_.create(rows, cols);
+    prior_max_.create(rows, cols);
+    motion_.create(rows, cols);
+    for (int by = 0; by < rows; ++by) {
+      int y0 = by * BLOCK, y1 = std::min(y0 + BLOCK, left.rows);
+      for (int bx = 0; bx < cols; ++bx) {
+        int x0 = bx * BLOCK, x1 = std::min(x0 + BLOCK, left.cols);
+        int lo = SHRT_MAX, hi = SHRT_MIN, change = 0;
+        for (int y = y0; y < y1; ++y) {
+          const int16_t* d = prev_disparity_[y];
+          const uint8_t* cur = left.ptr<uint8_t>(y);
+          const uint8_t* prev = prev_left_[y];
+          for (int x = x0; x < x1; ++x) {
+            if (d[x] != invalid) {
+              lo = std::min(lo, (int)d[x]);
+              hi = std::max(hi, (int)d[x]);
+            }
+            change += std::abs(cur[x] - prev[x]);
+          }
+        }
+        prior_min_(by, bx) = lo;
+        prior_max_(by, bx) = hi;
+        motion_(by, bx) = change > params.motion_threshold * (y1 - y0) * (x1 - x0);
+      }
+    }
+
+    range_shift_ = BLOCK_SHIFT;
+    rangesFromNeighbors(prior_min_, prior_max_, 1, motion_, params);
+    refine(left, right, params, disparity);
+  }
+
+  left.copyTo(prev_left_);
+  disparity.copyTo(prev_disparity_);
+  prev_min_disparity_ = params.min_disparity;
+  prev_disparity_range_ = params.disparity_range;
+}
+
+} // namespace stereo_image_proc
@@ -8,13 +8,16 @@
 #include <message_filters/sync_policies/approximate_time.h>
 
 #include <image_geometry/stereo_camera_model.h>
-#include <opencv2/calib3d/calib3d.hpp>
 
 #include <sensor_msgs/image_encodings.h>
 #include <stereo_msgs/DisparityImage.h>
 
 #include <stereo_image_proc/DisparityConfig.h>
 #include <dynamic_reconfigure/server.h>
+#include <image_proc/config_snapshot.h>
+#include <image_proc/nodelet_stats.h>
+#include <stereo_image_proc/processor.h>
+#include <stereo_image_proc/nodelet_params.h>
 
 namespace stereo_image_proc {
 
@@ -33,6 +36,8 @@ class DisparityNodelet : public nodelet::Nodelet
   typedef ApproximateTime<Image, CameraInfo, Image, CameraInfo> ApproximatePolicy;
   typedef message_filters::Synchronizer<ExactPolicy> ExactSync;
   typedef message_filters::Synchronizer<ApproximatePolicy> ApproximateSync;
+  typedef ros::MessageEvent<Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<CameraInfo const> InfoEvent;
   boost::shared_ptr<ExactSync> exact_sync_;
   boost::shared_ptr<ApproximateSync> approximate_sync_;
 
@@ -45,17 +50,22 @@ class DisparityNodelet : public nodelet::Nodelet
   typedef stereo_image_proc::DisparityConfig Config;
   typedef dynamic_reconfigure::Server<Config> ReconfigureServer;
   boost::shared_ptr<ReconfigureServer> reconfigure_server_;
+  image_proc::ConfigSnapshot<Config> config_;
   
   // Processing state (note: only safe because we're single-threaded!)
   image_geometry::StereoCameraModel model_;
-  cv::StereoBM block_matcher_; // contains scratch buffers for block matching
+  StereoProcessor processor_; // contains the matchers and their scratch buffers
+  image_proc::ConfigSnapshot<Config>::ConstPtr applied_config_; // last config given to the processor
+
+  // Frame statistics
+  image_proc::NodeletStats stats_;
 
   virtual void onInit();
 
   void connectCb();
 
-  void imageCb(const ImageConstPtr& l_image_msg, const CameraInfoConstPtr& l_info_msg,
-               const ImageConstPtr& r_image_msg, const CameraInfoConstPtr& r_info_msg);
+  void imageCb(const ImageEvent& l_image_event, const InfoEvent& l_info_event,
+               const ImageEvent& r_image_event, const InfoEvent& r_info_event);
 
   void configCb(Config &config, uint32_t level);
 };
@@ -78,16 +88,14 @@ void DisparityNodelet::onInit()
     approximate_sync_.reset( new ApproximateSync(ApproximatePolicy(queue_size),
                                                  sub_l_image_, sub_l_info_,
                                                  sub_r_image_, sub_r_info_) );
-    approximate_sync_->registerCallback(boost::bind(&DisparityNodelet::imageCb,
-                                                    this, _1, _2, _3, _4));
+    approximate_sync_->registerCallback(&DisparityNodelet::imageCb, this);
   }
   else
   {
     exact_sync_.reset( new ExactSync(ExactPolicy(queue_size),
                                      sub_l_image_, sub_l_info_,
                                      sub_r_image_, sub_r_info_) );
-    exact_sync_->registerCallback(boost::bind(&DisparityNodelet::imageCb,
-                                              this, _1, _2, _3, _4));
+    exact_sync_->registerCallback(&DisparityNodelet::imageCb, this);
   }
 
   // Set up dynamic reconfiguration
@@ -101,6 +109,8 @@ void DisparityNodelet::onInit()
   // Make sure we don't enter connectCb() between advertising and assigning to pub_disparity_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_disparity_ = nh.advertise<DisparityImage>("disparity", 1, connect_cb, connect_cb);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -127,91 +137,58 @@ void DisparityNodelet::connectCb()
   }
 }
 
-void DisparityNodelet::imageCb(const ImageConstPtr& l_image_msg,
-                               const CameraInfoConstPtr& l_info_msg,
-                               const ImageConstPtr& r_image_msg,
-                               const CameraInfoConstPtr& r_info_msg)
+void DisparityNodelet::imageCb(const ImageEvent& l_image_event,
+                               const InfoEvent& l_info_event,
+                               const ImageEvent& r_image_event,
+                               const InfoEvent& r_info_event)
 {
+  ImageConstPtr l_image_msg = l_image_event.getMessage();
+  CameraInfoConstPtr l_info_msg = l_info_event.getMessage();
+  ImageConstPtr r_image_msg = r_image_event.getMessage();
+  CameraInfoConstPtr r_info_msg = r_info_event.getMessage();
+  image_proc::FrameTimer timer(stats_, l_image_msg->header,
+                               image_proc::lastReceipt(l_image_event.getReceiptTime(),
+                                                       l_info_event.getReceiptTime(),
+                                                       r_image_event.getReceiptTime(),
+                                                       r_info_event.getReceiptTime()));
+
   /// @todo Convert (share) with new cv_bridge
   assert(l_image_msg->encoding == sensor_msgs::image_encodings::MONO8);
   assert(r_image_msg->encoding == sensor_msgs::image_encodings::MONO8);
 
   // Update the camera model
   model_.fromCameraInfo(l_info_msg, r_info_msg);
+
+  // Pick up any new settings from dynamic_reconfigure
+  image_proc::ConfigSnapshot<Config>::ConstPtr config = config_.load();
+  if (config != applied_config_)
+  {
+    applyDisparityConfig(*config, processor_);
+    applied_config_ = config;
+  }
   
-  // Allocate new disparity image message
-  DisparityImagePtr disp_msg = boost::make_shared<DisparityImage>();
-  disp_msg->header         = l_info_msg->header;
-  disp_msg->image.header   = l_info_msg->header;
-  disp_msg->image.height   = l_image_msg->height;
-  disp_msg->image.width    = l_image_msg->width;
-  disp_msg->image.encoding = sensor_msgs::image_encodings::TYPE_32FC1;
-  disp_msg->image.step     = disp_msg->image.width * sizeof(float);
-  disp_msg->image.data.resize(disp_msg->image.height * disp_msg->image.step);
-
-  // Stereo parameters
-  disp_msg->f = model_.right().fx();
-  disp_msg->T = model_.baseline();
-
-  // Compute window of (potentially) valid disparities
-  cv::Ptr<CvStereoBMState> params = block_matcher_.state;
-  int border   = params->SADWindowSize / 2;
-  int left   = params->numberOfDisparities + params->minDisparity + border - 1;
-  int wtf = (params->minDisparity >= 0) ? border + params->minDisparity : std::max(border, -params->minDisparity);
-  int right  = disp_msg->image.width - 1 - wtf;
-  int top    = border;
-  int bottom = disp_msg->image.height - 1 - border;
-  disp_msg->valid_window.x_offset = left;
-  disp_msg->valid_window.y_offset = top;
-  disp_msg->valid_window.width    = right - left;
-  disp_msg->valid_window.height   = bottom - top;
-
-  // Disparity search range
-  disp_msg->min_disparity = params->minDisparity;
-  disp_msg->max_disparity = params->minDisparity + params->numberOfDisparities - 1;
-  disp_msg->delta_d = 1.0 / 16; // OpenCV uses 16 disparities per pixel
-
-  // Create cv::Mat views onto all buffers
+  // Perform stereo matching to find the disparities
   const cv::Mat_<uint8_t> l_image(l_image_msg->height, l_image_msg->width,
                                   const_cast<uint8_t*>(&l_image_msg->data[0]),
                                   l_image_msg->step);
   const cv::Mat_<uint8_t> r_image(r_image_msg->height, r_image_msg->width,
                                   const_cast<uint8_t*>(&r_image_msg->data[0]),
                                   r_image_msg->step);
-  cv::Mat_<float> disp_image(disp_msg->image.height, disp_msg->image.width,
-                             reinterpret_cast<float*>(&disp_msg->image.data[0]),
-                             disp_msg->image.step);
-
-  // Perform block matching to find the disparities
-  block_matcher_(l_image, r_image, disp_image, CV_32F);
-
-  // Adjust for any x-offset between the principal points: d' = d - (cx_l - cx_r)
-  double cx_l = model_.left().cx();
-  double cx_r = model_.right().cx();
-  if (cx_l != cx_r)
-    cv::subtract(disp_image, cv::Scalar(cx_l - cx_r), disp_image);
+  DisparityImagePtr disp_msg = boost::make_shared<DisparityImage>();
+  processor_.processDisparity(l_image, r_image, model_, *disp_msg);
+  disp_msg->header       = l_info_msg->header;
+  disp_msg->image.header = l_info_msg->header;
 
   pub_disparity_.publish(disp_msg);
+  timer.published();
 }
 
 void DisparityNodelet::configCb(Config &config, uint32_t level)
 {
-  // Tweak all settings to be valid
-  config.prefilter_size |= 0x1; // must be odd
-  config.correlation_window_size |= 0x1; // must be odd
-  config.disparity_range = (config.disparity_range / 16) * 16; // must be multiple of 16
-
-  // Note: With single-threaded NodeHandle, configCb and imageCb can't be called
-  // concurrently, so this is thread-safe.
-  block_matcher_.state->preFilterSize       = config.prefilter_size;
-  block_matcher_.state->preFilterCap        = config.prefilter_cap;
-  block_matcher_.state->SADWindowSize       = config.correlation_window_size;
-  block_matcher_.state->minDisparity        = config.min_disparity;
-  block_matcher_.state->numberOfDisparities = config.disparity_range;
-  block_matcher_.state->uniquenessRatio     = config.uniqueness_ratio;
-  block_matcher_.state->textureThreshold    = config.texture_threshold;
-  block_matcher_.state->speckleWindowSize   = config.speckle_size;
-  block_matcher_.state->speckleRange        = config.speckle_range;
+  fixDisparityConfig(config);
+
+  // Applied to the processor by imageCb, so reconfiguring never races with matching
+  config_.store(config);
 }
 
 } // namespace stereo_image_proc
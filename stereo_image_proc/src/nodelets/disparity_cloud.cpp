@@ -0,0 +1,375 @@
+#include <ros/ros.h>
+#include <nodelet/nodelet.h>
+#include <image_transport/image_transport.h>
+#include <image_transport/subscriber_filter.h>
+#include <message_filters/subscriber.h>
+#include <message_filters/synchronizer.h>
+#include <message_filters/sync_policies/exact_time.h>
+#include <message_filters/sync_policies/approximate_time.h>
+
+#include <image_geometry/stereo_camera_model.h>
+
+#include <sensor_msgs/image_encodings.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <stereo_msgs/DisparityImage.h>
+
+#include <stereo_image_proc/DisparityConfig.h>
+#include <dynamic_reconfigure/server.h>
+#include <image_proc/config_snapshot.h>
+#include <image_proc/nodelet_stats.h>
+#include <image_proc/pipeline.h>
+#include <stereo_image_proc/processor.h>
+#include <stereo_image_proc/reprojection.h>
+#include <stereo_image_proc/nodelet_params.h>
+
+namespace stereo_image_proc {
+
+using namespace sensor_msgs;
+using namespace stereo_msgs;
+using namespace message_filters::sync_policies;
+
+/**
+ * Does the work of the disparity and point_cloud2 nodelets in one callback. The point
+ * cloud is reprojected from the disparity image just computed, so there is no second
+ * synchronizer and the camera model is built once per frame.
+ *
+ * The left color image is only subscribed to while points2 has subscribers, so the
+ * disparity output does not wait for (or need) a color stream.
+ *
+ * With ~pipeline_depth > 0, matching and reprojection run on two threads of their own,
+ * so the next frame is matched while the last one is reprojected and published. Up to
+ * pipeline_depth frames wait for each stage; when frames arrive faster than they are
+ * matched, the oldest waiting one is dropped.
+ */
+class DisparityCloudNodelet : public nodelet::Nodelet
+{
+  boost::shared_ptr<image_transport::ImageTransport> it_;
+
+  // Subscriptions
+  image_transport::SubscriberFilter sub_l_image_, sub_r_image_, sub_l_color_;
+  message_filters::Subscriber<CameraInfo> sub_l_info_, sub_r_info_;
+  typedef ExactTime<Image, CameraInfo, Image, CameraInfo> ExactPolicy;
+  typedef ApproximateTime<Image, CameraInfo, Image, CameraInfo> ApproximatePolicy;
+  typedef ExactTime<Image, CameraInfo, Image, CameraInfo, Image> ExactColorPolicy;
+  typedef ApproximateTime<Image, CameraInfo, Image, CameraInfo, Image> ApproximateColorPolicy;
+  typedef message_filters::Synchronizer<ExactPolicy> ExactSync;
+  typedef message_filters::Synchronizer<ApproximatePolicy> ApproximateSync;
+  typedef message_filters::Synchronizer<ExactColorPolicy> ExactColorSync;
+  typedef message_filters::Synchronizer<ApproximateColorPolicy> ApproximateColorSync;
+  typedef ros::MessageEvent<Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<CameraInfo const> InfoEvent;
+  boost::shared_ptr<ExactSync> exact_sync_;
+  boost::shared_ptr<ApproximateSync> approximate_sync_;
+  boost::shared_ptr<ExactColorSync> exact_color_sync_; // with the color image, while subscribed
+  boost::shared_ptr<ApproximateColorSync> approximate_color_sync_;
+
+  // Publications
+  boost::mutex connect_mutex_;
+  ros::Publisher pub_disparity_;
+  ros::Publisher pub_points2_;
+
+  // Dynamic reconfigure
+  boost::recursive_mutex config_mutex_;
+  typedef stereo_image_proc::DisparityConfig Config;
+  typedef dynamic_reconfigure::Server<Config> ReconfigureServer;
+  boost::shared_ptr<ReconfigureServer> reconfigure_server_;
+  image_proc::ConfigSnapshot<Config> config_;
+
+  // One synchronized set of inputs, and what is computed from it
+  struct Frame
+  {
+    ImageConstPtr l_image_msg, r_image_msg, l_color_msg;
+    CameraInfoConstPtr l_info_msg, r_info_msg;
+    ros::Time receipt_time;       // when the last input arrived
+    ros::WallDuration processing; // work on the frame so far, not counting waits between stages
+    image_geometry::StereoCameraModel model;
+    DisparityImagePtr disp_msg;
+  };
+
+  // Processing state (note: only safe because we're single-threaded, or each part is
+  // used by a single pipeline stage!)
+  image_geometry::StereoCameraModel model_;
+  StereoProcessor processor_; // contains the matchers and the reprojection tables
+  image_proc::ConfigSnapshot<Config>::ConstPtr applied_config_; // last config given to the processor
+
+  // Frame statistics
+  image_proc::NodeletStats stats_;
+
+  // Match and reproject stages, if pipelined; last, so it is stopped first
+  boost::shared_ptr< image_proc::Pipeline<Frame> > pipeline_;
+
+  virtual void onInit();
+
+  void connectCb();
+
+  void monoCb(const ImageEvent& l_image_event, const InfoEvent& l_info_event,
+              const ImageEvent& r_image_event, const InfoEvent& r_info_event);
+
+  void colorCb(const ImageEvent& l_image_event, const InfoEvent& l_info_event,
+               const ImageEvent& r_image_event, const InfoEvent& r_info_event,
+               const ImageEvent& l_color_event);
+
+  void imageCb(const ImageConstPtr& l_image_msg, const CameraInfoConstPtr& l_info_msg,
+               const ImageConstPtr& r_image_msg, const CameraInfoConstPtr& r_info_msg,
+               const ImageConstPtr& l_color_msg, const ros::Time& receipt_time);
+
+  void match(Frame& frame);
+
+  void reproject(Frame& frame);
+
+  void configCb(Config &config, uint32_t level);
+};
+
+void DisparityCloudNodelet::onInit()
+{
+  ros::NodeHandle &nh = getNodeHandle();
+  ros::NodeHandle &private_nh = getPrivateNodeHandle();
+
+  it_.reset(new image_transport::ImageTransport(nh));
+
+  // Synchronize inputs, with and without the color image. Topic subscriptions happen on
+  // demand in the connection callback. Optionally do approximate synchronization.
+  int queue_size;
+  private_nh.param("queue_size", queue_size, 5);
+  bool approx;
+  private_nh.param("approximate_sync", approx, false);
+  if (approx)
+  {
+    approximate_sync_.reset( new ApproximateSync(ApproximatePolicy(queue_size),
+                                                 sub_l_image_, sub_l_info_,
+                                                 sub_r_image_, sub_r_info_) );
+    approximate_sync_->registerCallback(&DisparityCloudNodelet::monoCb, this);
+    approximate_color_sync_.reset( new ApproximateColorSync(ApproximateColorPolicy(queue_size),
+                                                            sub_l_image_, sub_l_info_,
+                                                            sub_r_image_, sub_r_info_, sub_l_color_) );
+    approximate_color_sync_->registerCallback(&DisparityCloudNodelet::colorCb, this);
+  }
+  else
+  {
+    exact_sync_.reset( new ExactSync(ExactPolicy(queue_size),
+                                     sub_l_image_, sub_l_info_,
+                                     sub_r_image_, sub_r_info_) );
+    exact_sync_->registerCallback(&DisparityCloudNodelet::monoCb, this);
+    exact_color_sync_.reset( new ExactColorSync(ExactColorPolicy(queue_size),
+                                                sub_l_image_, sub_l_info_,
+                                                sub_r_image_, sub_r_info_, sub_l_color_) );
+    exact_color_sync_->registerCallback(&DisparityCloudNodelet::colorCb, this);
+  }
+
+  // Points to keep, cloud organization and point format
+  CloudParams cloud_params = loadCloudParams(private_nh);
+  processor_.setPointFilter(cloud_params.filter);
+  processor_.setDenseCloud(cloud_params.dense);
+  processor_.setPointLayout(cloud_params.layout);
+
+  // Set up dynamic reconfiguration
+  ReconfigureServer::CallbackType f = boost::bind(&DisparityCloudNodelet::configCb,
+                                                  this, _1, _2);
+  reconfigure_server_.reset(new ReconfigureServer(config_mutex_, private_nh));
+  reconfigure_server_->setCallback(f);
+
+  // Monitor whether anyone is subscribed to the outputs
+  ros::SubscriberStatusCallback connect_cb = boost::bind(&DisparityCloudNodelet::connectCb, this);
+  // Make sure we don't enter connectCb() between advertising and assigning to the publishers
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  pub_disparity_ = nh.advertise<DisparityImage>("disparity", 1, connect_cb, connect_cb);
+  pub_points2_   = nh.advertise<PointCloud2>("points2", 1, connect_cb, connect_cb);
+
+  stats_.init(nh, private_nh, getName());
+
+  // Frames waiting for each stage when pipelined, or 0 to process each in the callback
+  int pipeline_depth;
+  private_nh.param("pipeline_depth", pipeline_depth, 0);
+  if (pipeline_depth > 0)
+  {
+    std::vector<image_proc::Pipeline<Frame>::Stage> stages;
+    stages.push_back(boost::bind(&DisparityCloudNodelet::match, this, _1));
+    stages.push_back(boost::bind(&DisparityCloudNodelet::reproject, this, _1));
+    pipeline_.reset(new image_proc::Pipeline<Frame>(stages, pipeline_depth));
+  }
+}
+
+// Handles (un)subscribing when clients (un)subscribe
+void DisparityCloudNodelet::connectCb()
+{
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  if (pub_disparity_.getNumSubscribers() == 0 && pub_points2_.getNumSubscribers() == 0)
+  {
+    sub_l_image_.unsubscribe();
+    sub_l_info_ .unsubscribe();
+    sub_r_image_.unsubscribe();
+    sub_r_info_ .unsubscribe();
+    sub_l_color_.unsubscribe();
+  }
+  else
+  {
+    ros::NodeHandle &nh = getNodeHandle();
+    // Queue size 1 should be OK; the one that matters is the synchronizer queue size.
+    image_transport::TransportHints hints("raw", ros::TransportHints(), getPrivateNodeHandle());
+    if (!sub_l_image_.getSubscriber())
+    {
+      sub_l_image_.subscribe(*it_, "left/image_rect", 1, hints);
+      sub_l_info_ .subscribe(nh,   "left/camera_info", 1);
+      sub_r_image_.subscribe(*it_, "right/image_rect", 1, hints);
+      sub_r_info_ .subscribe(nh,   "right/camera_info", 1);
+    }
+    // The color image is only needed for the point cloud
+    if (pub_points2_.getNumSubscribers() == 0)
+      sub_l_color_.unsubscribe();
+    else if (!sub_l_color_.getSubscriber())
+      sub_l_color_.subscribe(*it_, "left/image_rect_color", 1, hints);
+  }
+}
+
+void DisparityCloudNodelet::monoCb(const ImageEvent& l_image_event,
+                                   const InfoEvent& l_info_event,
+                                   const ImageEvent& r_image_event,
+                                   const InfoEvent& r_info_event)
+{
+  // While the color image is subscribed, frames come through colorCb() with it
+  {
+    boost::lock_guard<boost::mutex> lock(connect_mutex_);
+    if (sub_l_color_.getSubscriber())
+      return;
+  }
+  imageCb(l_image_event.getMessage(), l_info_event.getMessage(),
+          r_image_event.getMessage(), r_info_event.getMessage(), ImageConstPtr(),
+          image_proc::lastReceipt(l_image_event.getReceiptTime(), l_info_event.getReceiptTime(),
+                                  r_image_event.getReceiptTime(), r_info_event.getReceiptTime()));
+}
+
+void DisparityCloudNodelet::colorCb(const ImageEvent& l_image_event,
+                                    const InfoEvent& l_info_event,
+                                    const ImageEvent& r_image_event,
+                                    const InfoEvent& r_info_event,
+                                    const ImageEvent& l_color_event)
+{
+  imageCb(l_image_event.getMessage(), l_info_event.getMessage(),
+          r_image_event.getMessage(), r_info_event.getMessage(), l_color_event.getMessage(),
+          image_proc::lastReceipt(l_image_event.getReceiptTime(), l_info_event.getReceiptTime(),
+                                  r_image_event.getReceiptTime(), r_info_event.getReceiptTime(),
+                                  l_color_event.getReceiptTime()));
+}
+
+void DisparityCloudNodelet::imageCb(const ImageConstPtr& l_image_msg,
+                                    const CameraInfoConstPtr& l_info_msg,
+                                    const ImageConstPtr& r_image_msg,
+                                    const CameraInfoConstPtr& r_info_msg,
+                                    const ImageConstPtr& l_color_msg,
+                                    const ros::Time& receipt_time)
+{
+  ros::WallTime start = stats_.frameReceived(l_image_msg->header);
+  assert(l_image_msg->encoding == sensor_msgs::image_encodings::MONO8);
+  assert(r_image_msg->encoding == sensor_msgs::image_encodings::MONO8);
+
+  boost::shared_ptr<Frame> frame = boost::make_shared<Frame>();
+  frame->l_image_msg = l_image_msg;
+  frame->l_info_msg  = l_info_msg;
+  frame->r_image_msg = r_image_msg;
+  frame->r_info_msg  = r_info_msg;
+  frame->l_color_msg = l_color_msg;
+  frame->receipt_time = receipt_time;
+  frame->processing = ros::WallTime::now() - start;
+  if (pipeline_)
+  {
+    if (!pipeline_->push(frame))
+    {
+      stats_.frameDropped();
+      NODELET_WARN_THROTTLE(10, "Dropped a frame waiting for stereo matching");
+    }
+    return;
+  }
+  match(*frame);
+  reproject(*frame);
+}
+
+void DisparityCloudNodelet::match(Frame& frame)
+{
+  ros::WallTime start = ros::WallTime::now();
+
+  // Update the camera model
+  model_.fromCameraInfo(frame.l_info_msg, frame.r_info_msg);
+  frame.model = model_;
+
+  // Pick up any new settings from dynamic_reconfigure. Only matching reads them, so
+  // this cannot race with the reprojection of an earlier frame.
+  image_proc::ConfigSnapshot<Config>::ConstPtr config = config_.load();
+  if (config != applied_config_)
+  {
+    applyDisparityConfig(*config, processor_);
+    applied_config_ = config;
+  }
+
+  // Perform stereo matching to find the disparities
+  const Image& l_image_msg = *frame.l_image_msg;
+  const Image& r_image_msg = *frame.r_image_msg;
+  const cv::Mat_<uint8_t> l_image(l_image_msg.height, l_image_msg.width,
+                                  const_cast<uint8_t*>(&l_image_msg.data[0]),
+                                  l_image_msg.step);
+  const cv::Mat_<uint8_t> r_image(r_image_msg.height, r_image_msg.width,
+                                  const_cast<uint8_t*>(&r_image_msg.data[0]),
+                                  r_image_msg.step);
+  frame.disp_msg = boost::make_shared<DisparityImage>();
+  processor_.processDisparity(l_image, r_image, frame.model, *frame.disp_msg);
+  frame.disp_msg->header       = frame.l_info_msg->header;
+  frame.disp_msg->image.header = frame.l_info_msg->header;
+  frame.processing += ros::WallTime::now() - start;
+}
+
+void DisparityCloudNodelet::reproject(Frame& frame)
+{
+  ros::WallTime start = ros::WallTime::now();
+  const DisparityImagePtr& disp_msg = frame.disp_msg;
+  bool published = false;
+
+  // Reproject the disparities just computed, unless the color image was not subscribed
+  // yet when the frame came in
+  if (frame.l_color_msg && pub_points2_.getNumSubscribers() > 0)
+  {
+    PointCloud2Ptr points_msg = boost::make_shared<PointCloud2>();
+    const Image& l_color_msg = *frame.l_color_msg;
+    const std::string& encoding = l_color_msg.encoding;
+    PointColor color_format = pointColor(encoding);
+    cv::Mat color;
+    if (color_format != COLOR_NONE)
+      color = colorPixels(l_color_msg, color_format);
+    if (color_format != COLOR_NONE &&
+        (color.cols != (int)disp_msg->image.width || color.rows != (int)disp_msg->image.height))
+    {
+      NODELET_ERROR_THROTTLE(30, "Color image (%ux%u, %s) does not fit the %ux%u disparity image, "
+                             "dropping the point cloud", l_color_msg.width, l_color_msg.height,
+                             encoding.c_str(), disp_msg->image.width, disp_msg->image.height);
+    }
+    else
+    {
+      processor_.processPoints2(*disp_msg, color, encoding, frame.model, *points_msg);
+      points_msg->header = disp_msg->header;
+      pub_points2_.publish(points_msg);
+      published = true;
+    }
+  }
+
+  if (pub_disparity_.getNumSubscribers() > 0)
+  {
+    pub_disparity_.publish(disp_msg);
+    published = true;
+  }
+  if (published)
+    stats_.framePublished(frame.receipt_time, ros::Time::now());
+  stats_.addProcessing(frame.processing + (ros::WallTime::now() - start));
+}
+
+void DisparityCloudNodelet::configCb(Config &config, uint32_t level)
+{
+  fixDisparityConfig(config);
+
+  // Applied to the processor by match(), so reconfiguring never races with matching
+  config_.store(config);
+}
+
+} // namespace stereo_image_proc
+
+// Register nodelet
+#include <pluginlib/class_list_macros.h>
+PLUGINLIB_DECLARE_CLASS(stereo_image_proc, disparity_cloud,
+                        stereo_image_proc::DisparityCloudNodelet, nodelet::Nodelet)
@@ -11,6 +11,9 @@
 #include <stereo_msgs/DisparityImage.h>
 #include <sensor_msgs/PointCloud.h>
 #include <sensor_msgs/image_encodings.h>
+#include <image_proc/nodelet_stats.h>
+#include "stereo_image_proc/disparity_encoding.h"
+#include "stereo_image_proc/reprojection.h"
 
 namespace stereo_image_proc {
 
@@ -30,6 +33,9 @@ class PointCloudNodelet : public nodelet::Nodelet
   typedef ApproximateTime<Image, CameraInfo, CameraInfo, DisparityImage> ApproximatePolicy;
   typedef message_filters::Synchronizer<ExactPolicy> ExactSync;
   typedef message_filters::Synchronizer<ApproximatePolicy> ApproximateSync;
+  typedef ros::MessageEvent<Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<CameraInfo const> InfoEvent;
+  typedef ros::MessageEvent<DisparityImage const> DisparityEvent;
   boost::shared_ptr<ExactSync> exact_sync_;
   boost::shared_ptr<ApproximateSync> approximate_sync_;
 
@@ -39,16 +45,20 @@ class PointCloudNodelet : public nodelet::Nodelet
 
   // Processing state (note: only safe because we're single-threaded!)
   image_geometry::StereoCameraModel model_;
-  cv::Mat_<cv::Vec3f> points_mat_; // scratch buffer
+  Reprojector reprojector_; // rays cached from the camera model
+  cv::Mat_<float> disparity_mat_; // scratch buffer
+
+  // Frame statistics
+  image_proc::NodeletStats stats_;
 
   virtual void onInit();
 
   void connectCb();
 
-  void imageCb(const ImageConstPtr& l_image_msg,
-               const CameraInfoConstPtr& l_info_msg,
-               const CameraInfoConstPtr& r_info_msg,
-               const DisparityImageConstPtr& disp_msg);
+  void imageCb(const ImageEvent& l_image_event,
+               const InfoEvent& l_info_event,
+               const InfoEvent& r_info_event,
+               const DisparityEvent& disp_event);
 };
 
 void PointCloudNodelet::onInit()
@@ -68,16 +78,14 @@ void PointCloudNodelet::onInit()
     approximate_sync_.reset( new ApproximateSync(ApproximatePolicy(queue_size),
                                                  sub_l_image_, sub_l_info_,
                                                  sub_r_info_, sub_disparity_) );
-    approximate_sync_->registerCallback(boost::bind(&PointCloudNodelet::imageCb,
-                                                    this, _1, _2, _3, _4));
+    approximate_sync_->registerCallback(&PointCloudNodelet::imageCb, this);
   }
   else
   {
     exact_sync_.reset( new ExactSync(ExactPolicy(queue_size),
                                      sub_l_image_, sub_l_info_,
                                      sub_r_info_, sub_disparity_) );
-    exact_sync_->registerCallback(boost::bind(&PointCloudNodelet::imageCb,
-                                              this, _1, _2, _3, _4));
+    exact_sync_->registerCallback(&PointCloudNodelet::imageCb, this);
   }
 
   // Monitor whether anyone is subscribed to the output
@@ -85,6 +93,8 @@ void PointCloudNodelet::onInit()
   // Make sure we don't enter connectCb() between advertising and assigning to pub_points_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_points_ = nh.advertise<PointCloud>("points", 1, connect_cb, connect_cb);
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
@@ -110,109 +120,56 @@ void PointCloudNodelet::connectCb()
   }
 }
 
-inline bool isValidPoint(const cv::Vec3f& pt)
+void PointCloudNodelet::imageCb(const ImageEvent& l_image_event,
+                                const InfoEvent& l_info_event,
+                                const InfoEvent& r_info_event,
+                                const DisparityEvent& disp_event)
 {
-  // Check both for disparities explicitly marked as invalid (where OpenCV maps pt.z to MISSING_Z)
-  // and zero disparities (point mapped to infinity).
-  return pt[2] != image_geometry::StereoCameraModel::MISSING_Z && !std::isinf(pt[2]);
-}
+  ImageConstPtr l_image_msg = l_image_event.getMessage();
+  CameraInfoConstPtr l_info_msg = l_info_event.getMessage();
+  CameraInfoConstPtr r_info_msg = r_info_event.getMessage();
+  DisparityImageConstPtr disp_msg = disp_event.getMessage();
+  image_proc::FrameTimer timer(stats_, disp_msg->header,
+                               image_proc::lastReceipt(l_image_event.getReceiptTime(),
+                                                       l_info_event.getReceiptTime(),
+                                                       r_info_event.getReceiptTime(),
+                                                       disp_event.getReceiptTime()));
 
-void PointCloudNodelet::imageCb(const ImageConstPtr& l_image_msg,
-                                const CameraInfoConstPtr& l_info_msg,
-                                const CameraInfoConstPtr& r_info_msg,
-                                const DisparityImageConstPtr& disp_msg)
-{
   // Update the camera model
   model_.fromCameraInfo(l_info_msg, r_info_msg);
 
   // Calculate point cloud
-  const Image& dimage = disp_msg->image;
-  const cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  model_.projectDisparityImageTo3d(dmat, points_mat_, true);
-  cv::Mat_<cv::Vec3f> mat = points_mat_;
+  const cv::Mat_<float> dmat = floatDisparity(*disp_msg, disparity_mat_);
+  if (dmat.empty()) {
+    NODELET_ERROR_THROTTLE(30, "Disparity image has unsupported encoding '%s' or is truncated",
+                           disp_msg->image.encoding.c_str());
+    return;
+  }
 
   // Fill in new PointCloud message (1D dense layout - no invalid points)
   PointCloudPtr points_msg = boost::make_shared<PointCloud>();
   points_msg->header = disp_msg->header;
 
-  points_msg->channels.resize(3);
-  points_msg->channels[0].name = "rgb";
-  points_msg->channels[0].values.resize(0);
-  points_msg->channels[1].name = "u";
-  points_msg->channels[1].values.resize(0);
-  points_msg->channels[2].name = "v";
-  points_msg->channels[2].values.resize(0);
-
-  // NOTE: For historical reasons, (u,v) = (row, column), the opposite of the
-  // usual convention. Good thing we're moving to sensor_msgs/PointCloud2.
-  for (int32_t u = 0; u < mat.rows; ++u) {
-    for (int32_t v = 0; v < mat.cols; ++v) {
-      if (isValidPoint(mat(u,v))) {
-        // x,y,z
-        geometry_msgs::Point32 pt;
-        pt.x = mat(u,v)[0];
-        pt.y = mat(u,v)[1];
-        pt.z = mat(u,v)[2];
-        points_msg->points.push_back(pt);
-        // u,v
-        points_msg->channels[1].values.push_back(u);
-        points_msg->channels[2].values.push_back(v);
-      }
-    }
-  }
-
-  // Fill in color
-  namespace enc = sensor_msgs::image_encodings;
-  const std::string& encoding = l_image_msg->encoding;
-  points_msg->channels[0].values.reserve(points_msg->points.size());
-  if (encoding == enc::MONO8) {
-    const cv::Mat_<uint8_t> color(l_image_msg->height, l_image_msg->width,
-                                  (uint8_t*)&l_image_msg->data[0],
-                                  l_image_msg->step);
-    for (int32_t u = 0; u < mat.rows; ++u) {
-      for (int32_t v = 0; v < mat.cols; ++v) {
-        if (isValidPoint(mat(u,v))) {
-          uint8_t g = color(u,v);
-          int32_t rgb = (g << 16) | (g << 8) | g;
-          points_msg->channels[0].values.push_back(*(float*)(&rgb));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::RGB8) {
-    const cv::Mat_<cv::Vec3b> color(l_image_msg->height, l_image_msg->width,
-                                    (cv::Vec3b*)&l_image_msg->data[0],
-                                    l_image_msg->step);
-    for (int32_t u = 0; u < mat.rows; ++u) {
-      for (int32_t v = 0; v < mat.cols; ++v) {
-        if (isValidPoint(mat(u,v))) {
-          const cv::Vec3b& rgb = color(u,v);
-          int32_t rgb_packed = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
-          points_msg->channels[0].values.push_back(*(float*)(&rgb_packed));
-        }
-      }
-    }
-  }
-  else if (encoding == enc::BGR8) {
-    const cv::Mat_<cv::Vec3b> color(l_image_msg->height, l_image_msg->width,
-                                    (cv::Vec3b*)&l_image_msg->data[0],
-                                    l_image_msg->step);
-    for (int32_t u = 0; u < mat.rows; ++u) {
-      for (int32_t v = 0; v < mat.cols; ++v) {
-        if (isValidPoint(mat(u,v))) {
-          const cv::Vec3b& bgr = color(u,v);
-          int32_t rgb_packed = (bgr[2] << 16) | (bgr[1] << 8) | bgr[0];
-          points_msg->channels[0].values.push_back(*(float*)(&rgb_packed));
-        }
-      }
-    }
+  PointColor color_format = pointColor(l_image_msg->encoding);
+  cv::Mat color;
+  if (color_format == COLOR_NONE) {
+    NODELET_WARN_THROTTLE(30, "Could not fill color channel of the point cloud, "
+                          "unsupported encoding '%s'", l_image_msg->encoding.c_str());
   }
   else {
-    NODELET_WARN_THROTTLE(30, "Could not fill color channel of the point cloud, "
-                          "unsupported encoding '%s'", encoding.c_str());
+    color = colorPixels(*l_image_msg, color_format);
+    if (color.rows != dmat.rows || color.cols != dmat.cols) {
+      NODELET_ERROR_THROTTLE(30, "Color image (%ux%u, %s) does not fit the %dx%d disparity image, "
+                             "dropping the frame", l_image_msg->width, l_image_msg->height,
+                             l_image_msg->encoding.c_str(), dmat.cols, dmat.rows);
+      return;
+    }
   }
+  reprojector_.update(model_.reprojectionMatrix(), dmat.cols, dmat.rows);
+  reprojector_.projectSparse(dmat, color, color_format, validWindow(*disp_msg), *points_msg);
 
   pub_points_.publish(points_msg);
+  timer.published();
 }
 
 } // namespace stereo_image_proc
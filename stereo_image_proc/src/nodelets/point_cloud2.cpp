@@ -11,6 +11,10 @@
 #include <stereo_msgs/DisparityImage.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/image_encodings.h>
+#include <image_proc/nodelet_stats.h>
+#include "stereo_image_proc/disparity_encoding.h"
+#include "stereo_image_proc/reprojection.h"
+#include "stereo_image_proc/nodelet_params.h"
 
 namespace stereo_image_proc {
 
@@ -30,25 +34,35 @@ class PointCloud2Nodelet : public nodelet::Nodelet
   typedef ApproximateTime<Image, CameraInfo, CameraInfo, DisparityImage> ApproximatePolicy;
   typedef message_filters::Synchronizer<ExactPolicy> ExactSync;
   typedef message_filters::Synchronizer<ApproximatePolicy> ApproximateSync;
+  typedef ros::MessageEvent<Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<CameraInfo const> InfoEvent;
+  typedef ros::MessageEvent<DisparityImage const> DisparityEvent;
   boost::shared_ptr<ExactSync> exact_sync_;
   boost::shared_ptr<ApproximateSync> approximate_sync_;
 
   // Publications
   boost::mutex connect_mutex_;
   ros::Publisher pub_points2_;
+  ros::Publisher pub_voxels_;
 
   // Processing state (note: only safe because we're single-threaded!)
   image_geometry::StereoCameraModel model_;
-  cv::Mat_<cv::Vec3f> points_mat_; // scratch buffer
+  Reprojector reprojector_; // rays cached from the camera model
+  CloudParams cloud_params_; // points kept, organization and point format
+  image_proc::VoxelGrid voxel_grid_;
+  cv::Mat_<float> disparity_mat_; // scratch buffer
   
+  // Frame statistics
+  image_proc::NodeletStats stats_;
+
   virtual void onInit();
 
   void connectCb();
 
-  void imageCb(const ImageConstPtr& l_image_msg,
-               const CameraInfoConstPtr& l_info_msg,
-               const CameraInfoConstPtr& r_info_msg,
-               const DisparityImageConstPtr& disp_msg);
+  void imageCb(const ImageEvent& l_image_event,
+               const InfoEvent& l_info_event,
+               const InfoEvent& r_info_event,
+               const DisparityEvent& disp_event);
 };
 
 void PointCloud2Nodelet::onInit()
@@ -68,30 +82,41 @@ void PointCloud2Nodelet::onInit()
     approximate_sync_.reset( new ApproximateSync(ApproximatePolicy(queue_size),
                                                  sub_l_image_, sub_l_info_,
                                                  sub_r_info_, sub_disparity_) );
-    approximate_sync_->registerCallback(boost::bind(&PointCloud2Nodelet::imageCb,
-                                                    this, _1, _2, _3, _4));
+    approximate_sync_->registerCallback(&PointCloud2Nodelet::imageCb, this);
   }
   else
   {
     exact_sync_.reset( new ExactSync(ExactPolicy(queue_size),
                                      sub_l_image_, sub_l_info_,
                                      sub_r_info_, sub_disparity_) );
-    exact_sync_->registerCallback(boost::bind(&PointCloud2Nodelet::imageCb,
-                                              this, _1, _2, _3, _4));
+    exact_sync_->registerCallback(&PointCloud2Nodelet::imageCb, this);
   }
 
+  // Points to keep, cloud organization and point format
+  cloud_params_ = loadCloudParams(private_nh);
+  // Optional downsampled cloud of voxel centroids, <= 0 to disable
+  double voxel_leaf_size;
+  private_nh.param("voxel_leaf_size", voxel_leaf_size, 0.0);
+
   // Monitor whether anyone is subscribed to the output
   ros::SubscriberStatusCallback connect_cb = boost::bind(&PointCloud2Nodelet::connectCb, this);
   // Make sure we don't enter connectCb() between advertising and assigning to pub_points2_
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
   pub_points2_  = nh.advertise<PointCloud2>("points2",  1, connect_cb, connect_cb);
+  if (voxel_leaf_size > 0.0)
+  {
+    voxel_grid_.reset(voxel_leaf_size);
+    pub_voxels_ = nh.advertise<PointCloud2>("points2_voxels", 1, connect_cb, connect_cb);
+  }
+
+  stats_.init(nh, private_nh, getName());
 }
 
 // Handles (un)subscribing when clients (un)subscribe
 void PointCloud2Nodelet::connectCb()
 {
   boost::lock_guard<boost::mutex> lock(connect_mutex_);
-  if (pub_points2_.getNumSubscribers() == 0)
+  if (pub_points2_.getNumSubscribers() == 0 && pub_voxels_.getNumSubscribers() == 0)
   {
     sub_l_image_  .unsubscribe();
     sub_l_info_   .unsubscribe();
@@ -110,155 +135,77 @@ void PointCloud2Nodelet::connectCb()
   }
 }
 
-inline bool isValidPoint(const cv::Vec3f& pt)
+void PointCloud2Nodelet::imageCb(const ImageEvent& l_image_event,
+                                 const InfoEvent& l_info_event,
+                                 const InfoEvent& r_info_event,
+                                 const DisparityEvent& disp_event)
 {
-  // Check both for disparities explicitly marked as invalid (where OpenCV maps pt.z to MISSING_Z)
-  // and zero disparities (point mapped to infinity).
-  return pt[2] != image_geometry::StereoCameraModel::MISSING_Z && !std::isinf(pt[2]);
-}
+  ImageConstPtr l_image_msg = l_image_event.getMessage();
+  CameraInfoConstPtr l_info_msg = l_info_event.getMessage();
+  CameraInfoConstPtr r_info_msg = r_info_event.getMessage();
+  DisparityImageConstPtr disp_msg = disp_event.getMessage();
+  image_proc::FrameTimer timer(stats_, disp_msg->header,
+                               image_proc::lastReceipt(l_image_event.getReceiptTime(),
+                                                       l_info_event.getReceiptTime(),
+                                                       r_info_event.getReceiptTime(),
+                                                       disp_event.getReceiptTime()));
 
-void PointCloud2Nodelet::imageCb(const ImageConstPtr& l_image_msg,
-                                 const CameraInfoConstPtr& l_info_msg,
-                                 const CameraInfoConstPtr& r_info_msg,
-                                 const DisparityImageConstPtr& disp_msg)
-{
   // Update the camera model
   model_.fromCameraInfo(l_info_msg, r_info_msg);
 
   // Calculate point cloud
-  const Image& dimage = disp_msg->image;
-  const cv::Mat_<float> dmat(dimage.height, dimage.width, (float*)&dimage.data[0], dimage.step);
-  model_.projectDisparityImageTo3d(dmat, points_mat_, true);
-  cv::Mat_<cv::Vec3f> mat = points_mat_;
-
-  // Fill in new PointCloud2 message (2D image-like layout)
-  PointCloud2Ptr points_msg = boost::make_shared<PointCloud2>();
-  points_msg->header = disp_msg->header;
-  points_msg->height = mat.rows;
-  points_msg->width  = mat.cols;
-  points_msg->fields.resize (4);
-  points_msg->fields[0].name = "x";
-  points_msg->fields[0].offset = 0;
-  points_msg->fields[0].count = 1;
-  points_msg->fields[0].datatype = PointField::FLOAT32;
-  points_msg->fields[1].name = "y";
-  points_msg->fields[1].offset = 4;
-  points_msg->fields[1].count = 1;
-  points_msg->fields[1].datatype = PointField::FLOAT32;
-  points_msg->fields[2].name = "z";
-  points_msg->fields[2].offset = 8;
-  points_msg->fields[2].count = 1;
-  points_msg->fields[2].datatype = PointField::FLOAT32;
-  points_msg->fields[3].name = "rgb";
-  points_msg->fields[3].offset = 12;
-  points_msg->fields[3].count = 1;
-  points_msg->fields[3].datatype = PointField::FLOAT32;
-  //points_msg->is_bigendian = false; ???
-  static const int STEP = 16;
-  points_msg->point_step = STEP;
-  points_msg->row_step = points_msg->point_step * points_msg->width;
-  points_msg->data.resize (points_msg->row_step * points_msg->height);
-  points_msg->is_dense = false; // there may be invalid points
- 
-  float bad_point = std::numeric_limits<float>::quiet_NaN ();
-  int offset = 0;
-  for (int v = 0; v < mat.rows; ++v)
-  {
-    for (int u = 0; u < mat.cols; ++u, offset += STEP)
-    {
-      if (isValidPoint(mat(v,u)))
-      {
-        // x,y,z,rgba
-        memcpy (&points_msg->data[offset + 0], &mat(v,u)[0], sizeof (float));
-        memcpy (&points_msg->data[offset + 4], &mat(v,u)[1], sizeof (float));
-        memcpy (&points_msg->data[offset + 8], &mat(v,u)[2], sizeof (float));
-      }
-      else
-      {
-        memcpy (&points_msg->data[offset + 0], &bad_point, sizeof (float));
-        memcpy (&points_msg->data[offset + 4], &bad_point, sizeof (float));
-        memcpy (&points_msg->data[offset + 8], &bad_point, sizeof (float));
-      }
-    }
+  const cv::Mat_<float> dmat = floatDisparity(*disp_msg, disparity_mat_);
+  if (dmat.empty()) {
+    NODELET_ERROR_THROTTLE(30, "Disparity image has unsupported encoding '%s' or is truncated",
+                           disp_msg->image.encoding.c_str());
+    return;
   }
 
-  // Fill in color
-  namespace enc = sensor_msgs::image_encodings;
-  const std::string& encoding = l_image_msg->encoding;
-  offset = 0;
-  if (encoding == enc::MONO8)
+  // Reproject and fill in color in one pass
+  PointColor color_format = pointColor(l_image_msg->encoding);
+  cv::Mat color;
+  if (color_format == COLOR_NONE)
   {
-    const cv::Mat_<uint8_t> color(l_image_msg->height, l_image_msg->width,
-                                  (uint8_t*)&l_image_msg->data[0],
-                                  l_image_msg->step);
-    for (int v = 0; v < mat.rows; ++v)
-    {
-      for (int u = 0; u < mat.cols; ++u, offset += STEP)
-      {
-        if (isValidPoint(mat(v,u)))
-        {
-          uint8_t g = color(v,u);
-          int32_t rgb = (g << 16) | (g << 8) | g;
-          memcpy (&points_msg->data[offset + 12], &rgb, sizeof (int32_t));
-        }
-        else
-        {
-          memcpy (&points_msg->data[offset + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
+    NODELET_WARN_THROTTLE(30, "Could not fill color channel of the point cloud, "
+                          "unsupported encoding '%s'", l_image_msg->encoding.c_str());
   }
-  else if (encoding == enc::RGB8)
+  else
   {
-    const cv::Mat_<cv::Vec3b> color(l_image_msg->height, l_image_msg->width,
-                                    (cv::Vec3b*)&l_image_msg->data[0],
-                                    l_image_msg->step);
-    for (int v = 0; v < mat.rows; ++v)
+    color = colorPixels(*l_image_msg, color_format);
+    if (color.rows != dmat.rows || color.cols != dmat.cols)
     {
-      for (int u = 0; u < mat.cols; ++u, offset += STEP)
-      {
-        if (isValidPoint(mat(v,u)))
-        {
-          const cv::Vec3b& rgb = color(v,u);
-          int32_t rgb_packed = (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
-          memcpy (&points_msg->data[offset + 12], &rgb_packed, sizeof (int32_t));
-        }
-        else
-        {
-          memcpy (&points_msg->data[offset + 12], &bad_point, sizeof (float));
-        }
-      }
+      NODELET_ERROR_THROTTLE(30, "Color image (%ux%u, %s) does not fit the %dx%d disparity image, "
+                             "dropping the frame", l_image_msg->width, l_image_msg->height,
+                             l_image_msg->encoding.c_str(), dmat.cols, dmat.rows);
+      return;
     }
   }
-  else if (encoding == enc::BGR8)
+  reprojector_.update(model_.reprojectionMatrix(), dmat.cols, dmat.rows);
+
+  // Pixels outside the valid window are never looked at
+  PointFilter filter = cloud_params_.filter;
+  filter.window = validWindow(*disp_msg);
+
+  // Fill in new PointCloud2 message (2D image-like layout, unless dense)
+  if (pub_points2_.getNumSubscribers() > 0)
   {
-    const cv::Mat_<cv::Vec3b> color(l_image_msg->height, l_image_msg->width,
-                                    (cv::Vec3b*)&l_image_msg->data[0],
-                                    l_image_msg->step);
-    for (int v = 0; v < mat.rows; ++v)
-    {
-      for (int u = 0; u < mat.cols; ++u, offset += STEP)
-      {
-        if (isValidPoint(mat(v,u)))
-        {
-          const cv::Vec3b& bgr = color(v,u);
-          int32_t rgb_packed = (bgr[2] << 16) | (bgr[1] << 8) | bgr[0];
-          memcpy (&points_msg->data[offset + 12], &rgb_packed, sizeof (int32_t));
-        }
-        else
-        {
-          memcpy (&points_msg->data[offset + 12], &bad_point, sizeof (float));
-        }
-      }
-    }
+    PointCloud2Ptr points_msg = boost::make_shared<PointCloud2>();
+    points_msg->header = disp_msg->header;
+    reprojector_.projectCloud(dmat, color, color_format, filter, cloud_params_.dense, cloud_params_.layout,
+                              *points_msg);
+    pub_points2_.publish(points_msg);
   }
-  else
+
+  // Voxelized straight from the disparity image, without building the full cloud
+  if (pub_voxels_.getNumSubscribers() > 0)
   {
-    NODELET_WARN_THROTTLE(30, "Could not fill color channel of the point cloud, "
-                          "unsupported encoding '%s'", encoding.c_str());
+    PointCloud2Ptr voxels_msg = boost::make_shared<PointCloud2>();
+    voxels_msg->header = disp_msg->header;
+    reprojector_.voxelize(dmat, color, color_format, filter, voxel_grid_);
+    voxel_grid_.toPointCloud2(*voxels_msg, true);
+    pub_voxels_.publish(voxels_msg);
   }
-
-  pub_points2_.publish(points_msg);
+  timer.published();
 }
 
 } // namespace stereo_image_proc
@@ -0,0 +1,318 @@
+#include <ros/ros.h>
+#include <nodelet/nodelet.h>
+#include <image_transport/image_transport.h>
+#include <image_transport/subscriber_filter.h>
+#include <message_filters/subscriber.h>
+#include <message_filters/synchronizer.h>
+#include <message_filters/sync_policies/exact_time.h>
+#include <message_filters/sync_policies/approximate_time.h>
+
+#include <image_geometry/stereo_camera_model.h>
+
+#include <sensor_msgs/PointCloud2.h>
+#include <stereo_msgs/DisparityImage.h>
+
+#include <stereo_image_proc/DisparityConfig.h>
+#include <dynamic_reconfigure/server.h>
+#include <image_proc/config_snapshot.h>
+#include <image_proc/nodelet_stats.h>
+#include <image_proc/pipeline.h>
+#include <image_proc/yuv.h>
+#include <stereo_image_proc/processor.h>
+#include <stereo_image_proc/nodelet_params.h>
+
+namespace stereo_image_proc {
+
+using namespace sensor_msgs;
+using namespace stereo_msgs;
+using namespace message_filters::sync_policies;
+
+/**
+ * Goes from the raw image pair to the disparity image and point cloud in three
+ * pipeline stages, each on its own thread: rectification (StereoProcessor::
+ * processMonocular), stereo matching (processDisparity) and reprojection
+ * (processPoints2). While one frame is matched, the next is rectified and the last
+ * one is reprojected and published.
+ *
+ * Up to ~pipeline_depth frames (default 1) wait for each stage; when frames arrive
+ * faster than they are rectified, the oldest waiting one is dropped. The rectified
+ * color image is only made while points2 has subscribers.
+ *
+ * YUV raw images are converted with ~yuv_matrix (0 for BT.601, the default, or 1 for
+ * BT.709), as by the debayer nodelet's yuv_matrix setting.
+ */
+class StereoPipelineNodelet : public nodelet::Nodelet
+{
+  boost::shared_ptr<image_transport::ImageTransport> it_;
+
+  // Subscriptions
+  image_transport::SubscriberFilter sub_l_image_, sub_r_image_;
+  message_filters::Subscriber<CameraInfo> sub_l_info_, sub_r_info_;
+  typedef ExactTime<Image, CameraInfo, Image, CameraInfo> ExactPolicy;
+  typedef ApproximateTime<Image, CameraInfo, Image, CameraInfo> ApproximatePolicy;
+  typedef message_filters::Synchronizer<ExactPolicy> ExactSync;
+  typedef message_filters::Synchronizer<ApproximatePolicy> ApproximateSync;
+  typedef ros::MessageEvent<Image const> ImageEvent; // with the receipt time, for statistics
+  typedef ros::MessageEvent<CameraInfo const> InfoEvent;
+  boost::shared_ptr<ExactSync> exact_sync_;
+  boost::shared_ptr<ApproximateSync> approximate_sync_;
+
+  // Publications
+  boost::mutex connect_mutex_;
+  ros::Publisher pub_disparity_;
+  ros::Publisher pub_points2_;
+
+  // Dynamic reconfigure
+  boost::recursive_mutex config_mutex_;
+  typedef stereo_image_proc::DisparityConfig Config;
+  typedef dynamic_reconfigure::Server<Config> ReconfigureServer;
+  boost::shared_ptr<ReconfigureServer> reconfigure_server_;
+  image_proc::ConfigSnapshot<Config> config_;
+
+  // One synchronized set of raw inputs, and what is computed from it
+  struct Frame
+  {
+    ImageConstPtr l_raw_msg, r_raw_msg;
+    CameraInfoConstPtr l_info_msg, r_info_msg;
+    ros::Time receipt_time;       // when the last input arrived
+    ros::WallDuration processing; // work on the frame so far, not counting waits between stages
+    bool rectified;               // false if the raw images could not be processed
+    image_geometry::StereoCameraModel model;
+    StereoImageSet images;        // rectified images, color only with points2 subscribers
+    DisparityImagePtr disp_msg;
+  };
+
+  // Processing state (note: only safe because each part is used by a single pipeline
+  // stage!)
+  image_geometry::StereoCameraModel model_;
+  StereoProcessor processor_; // rectification, matchers and reprojection tables
+  image_proc::ConfigSnapshot<Config>::ConstPtr applied_config_; // last config given to the processor
+
+  // Frame statistics
+  image_proc::NodeletStats stats_;
+
+  // Rectify, match and reproject stages; last, so it is stopped first
+  boost::shared_ptr< image_proc::Pipeline<Frame> > pipeline_;
+
+  virtual void onInit();
+
+  void connectCb();
+
+  void imageCb(const ImageEvent& l_raw_event, const InfoEvent& l_info_event,
+               const ImageEvent& r_raw_event, const InfoEvent& r_info_event);
+
+  void rectify(Frame& frame);
+
+  void match(Frame& frame);
+
+  void reproject(Frame& frame);
+
+  void configCb(Config &config, uint32_t level);
+};
+
+void StereoPipelineNodelet::onInit()
+{
+  ros::NodeHandle &nh = getNodeHandle();
+  ros::NodeHandle &private_nh = getPrivateNodeHandle();
+
+  it_.reset(new image_transport::ImageTransport(nh));
+
+  // Synchronize inputs. Topic subscriptions happen on demand in the connection
+  // callback. Optionally do approximate synchronization.
+  int queue_size;
+  private_nh.param("queue_size", queue_size, 5);
+  bool approx;
+  private_nh.param("approximate_sync", approx, false);
+  if (approx)
+  {
+    approximate_sync_.reset( new ApproximateSync(ApproximatePolicy(queue_size),
+                                                 sub_l_image_, sub_l_info_,
+                                                 sub_r_image_, sub_r_info_) );
+    approximate_sync_->registerCallback(&StereoPipelineNodelet::imageCb, this);
+  }
+  else
+  {
+    exact_sync_.reset( new ExactSync(ExactPolicy(queue_size),
+                                     sub_l_image_, sub_l_info_,
+                                     sub_r_image_, sub_r_info_) );
+    exact_sync_->registerCallback(&StereoPipelineNodelet::imageCb, this);
+  }
+
+  // Conversion of YUV raw images
+  int yuv_matrix;
+  private_nh.param("yuv_matrix", yuv_matrix, (int)image_proc::YUV_BT601);
+  if (yuv_matrix != image_proc::YUV_BT601 && yuv_matrix != image_proc::YUV_BT709)
+  {
+    NODELET_WARN("Unknown yuv_matrix %d, using BT.601 (0)", yuv_matrix);
+    yuv_matrix = image_proc::YUV_BT601;
+  }
+  processor_.setYuvMatrix(yuv_matrix);
+
+  // Points to keep, cloud organization and point format
+  CloudParams cloud_params = loadCloudParams(private_nh);
+  processor_.setPointFilter(cloud_params.filter);
+  processor_.setDenseCloud(cloud_params.dense);
+  processor_.setPointLayout(cloud_params.layout);
+
+  // Set up dynamic reconfiguration
+  ReconfigureServer::CallbackType f = boost::bind(&StereoPipelineNodelet::configCb,
+                                                  this, _1, _2);
+  reconfigure_server_.reset(new ReconfigureServer(config_mutex_, private_nh));
+  reconfigure_server_->setCallback(f);
+
+  stats_.init(nh, private_nh, getName());
+
+  // Frames waiting for each stage
+  int pipeline_depth;
+  private_nh.param("pipeline_depth", pipeline_depth, 1);
+  std::vector<image_proc::Pipeline<Frame>::Stage> stages;
+  stages.push_back(boost::bind(&StereoPipelineNodelet::rectify, this, _1));
+  stages.push_back(boost::bind(&StereoPipelineNodelet::match, this, _1));
+  stages.push_back(boost::bind(&StereoPipelineNodelet::reproject, this, _1));
+  pipeline_.reset(new image_proc::Pipeline<Frame>(stages, pipeline_depth));
+
+  // Monitor whether anyone is subscribed to the outputs
+  ros::SubscriberStatusCallback connect_cb = boost::bind(&StereoPipelineNodelet::connectCb, this);
+  // Make sure we don't enter connectCb() between advertising and assigning to the publishers
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  pub_disparity_ = nh.advertise<DisparityImage>("disparity", 1, connect_cb, connect_cb);
+  pub_points2_   = nh.advertise<PointCloud2>("points2", 1, connect_cb, connect_cb);
+}
+
+// Handles (un)subscribing when clients (un)subscribe
+void StereoPipelineNodelet::connectCb()
+{
+  boost::lock_guard<boost::mutex> lock(connect_mutex_);
+  if (pub_disparity_.getNumSubscribers() == 0 && pub_points2_.getNumSubscribers() == 0)
+  {
+    sub_l_image_.unsubscribe();
+    sub_l_info_ .unsubscribe();
+    sub_r_image_.unsubscribe();
+    sub_r_info_ .unsubscribe();
+  }
+  else if (!sub_l_image_.getSubscriber())
+  {
+    ros::NodeHandle &nh = getNodeHandle();
+    // Queue size 1 should be OK; the one that matters is the synchronizer queue size.
+    image_transport::TransportHints hints("raw", ros::TransportHints(), getPrivateNodeHandle());
+    sub_l_image_.subscribe(*it_, "left/image_raw", 1, hints);
+    sub_l_info_ .subscribe(nh,   "left/camera_info", 1);
+    sub_r_image_.subscribe(*it_, "right/image_raw", 1, hints);
+    sub_r_info_ .subscribe(nh,   "right/camera_info", 1);
+  }
+}
+
+void StereoPipelineNodelet::imageCb(const ImageEvent& l_raw_event,
+                                    const InfoEvent& l_info_event,
+                                    const ImageEvent& r_raw_event,
+                                    const InfoEvent& r_info_event)
+{
+  boost::shared_ptr<Frame> frame = boost::make_shared<Frame>();
+  frame->l_raw_msg  = l_raw_event.getMessage();
+  frame->l_info_msg = l_info_event.getMessage();
+  frame->r_raw_msg  = r_raw_event.getMessage();
+  frame->r_info_msg = r_info_event.getMessage();
+  frame->receipt_time = image_proc::lastReceipt(l_raw_event.getReceiptTime(), l_info_event.getReceiptTime(),
+                                                r_raw_event.getReceiptTime(), r_info_event.getReceiptTime());
+  frame->rectified = false;
+
+  ros::WallTime start = stats_.frameReceived(frame->l_raw_msg->header);
+  frame->processing = ros::WallTime::now() - start;
+  if (!pipeline_->push(frame))
+  {
+    stats_.frameDropped();
+    NODELET_WARN_THROTTLE(10, "Dropped a frame waiting for rectification");
+  }
+}
+
+void StereoPipelineNodelet::rectify(Frame& frame)
+{
+  ros::WallTime start = ros::WallTime::now();
+
+  // Update the camera model
+  model_.fromCameraInfo(frame.l_info_msg, frame.r_info_msg);
+  frame.model = model_;
+
+  // The color image is only needed for the point cloud
+  int flags = StereoProcessor::DISPARITY;
+  if (pub_points2_.getNumSubscribers() > 0)
+    flags |= StereoProcessor::POINT_CLOUD2;
+  frame.rectified = processor_.processMonocular(frame.l_raw_msg, frame.r_raw_msg, frame.model,
+                                                frame.images, StereoProcessor::neededFlags(flags));
+  if (!frame.rectified)
+    NODELET_ERROR_THROTTLE(30, "Could not process raw images (%s, %s)",
+                           frame.l_raw_msg->encoding.c_str(), frame.r_raw_msg->encoding.c_str());
+  frame.processing += ros::WallTime::now() - start;
+}
+
+void StereoPipelineNodelet::match(Frame& frame)
+{
+  if (!frame.rectified)
+    return;
+  ros::WallTime start = ros::WallTime::now();
+
+  // Pick up any new settings from dynamic_reconfigure. Only matching reads them, so
+  // this cannot race with the other stages.
+  image_proc::ConfigSnapshot<Config>::ConstPtr config = config_.load();
+  if (config != applied_config_)
+  {
+    applyDisparityConfig(*config, processor_);
+    applied_config_ = config;
+  }
+
+  // Perform stereo matching to find the disparities
+  frame.disp_msg = boost::make_shared<DisparityImage>();
+  processor_.processDisparity(frame.images.left.rect, frame.images.right.rect, frame.model,
+                              *frame.disp_msg);
+  frame.disp_msg->header       = frame.l_info_msg->header;
+  frame.disp_msg->image.header = frame.l_info_msg->header;
+  frame.processing += ros::WallTime::now() - start;
+}
+
+void StereoPipelineNodelet::reproject(Frame& frame)
+{
+  if (!frame.rectified)
+  {
+    stats_.addProcessing(frame.processing);
+    return;
+  }
+  ros::WallTime start = ros::WallTime::now();
+  const DisparityImagePtr& disp_msg = frame.disp_msg;
+  bool published = false;
+
+  // Reproject the disparities just computed, unless points2 had no subscribers yet
+  // when the frame was rectified
+  const image_proc::ImageSet& left = frame.images.left;
+  if (!left.rect_color.empty() && pub_points2_.getNumSubscribers() > 0)
+  {
+    PointCloud2Ptr points_msg = boost::make_shared<PointCloud2>();
+    processor_.processPoints2(*disp_msg, left.rect_color, left.color_encoding, frame.model, *points_msg);
+    points_msg->header = disp_msg->header;
+    pub_points2_.publish(points_msg);
+    published = true;
+  }
+
+  if (pub_disparity_.getNumSubscribers() > 0)
+  {
+    pub_disparity_.publish(disp_msg);
+    published = true;
+  }
+  if (published)
+    stats_.framePublished(frame.receipt_time, ros::Time::now());
+  stats_.addProcessing(frame.processing + (ros::WallTime::now() - start));
+}
+
+void StereoPipelineNodelet::configCb(Config &config, uint32_t level)
+{
+  fixDisparityConfig(config);
+
+  // Applied to the processor by match(), so reconfiguring never races with matching
+  config_.store(config);
+}
+
+} // namespace stereo_image_proc
+
+// Register nodelet
+#include <pluginlib/class_list_macros.h>
+PLUGINLIB_DECLARE_CLASS(stereo_image_proc, stereo_pipeline,
+                        stereo_image_proc::StereoPipelineNodelet, nodelet::Nodelet)
@@ -0,0 +1,199 @@
+#include <stereo_image_proc/processor.h>
+#include <image_proc/parallel.h>
+#include <sensor_msgs/image_encodings.h>
+#include <opencv2/highgui/highgui.hpp>
+#include <boost/make_shared.hpp>
+#include <ros/time.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Times StereoProcessor stage by stage on synthetic textured pairs at several resolutions
+// and disparity ranges, then on any stereo pairs given as image files. No ROS master or
+// camera is needed; the pairs are treated as raw images from an ideal, rectified rig.
+// For bm, a wide range is also timed with plain and coarse-to-fine block matching.
+// Usage: stereo_benchmark [bm|sgm|census] [iterations] [threads] [left right]...
+
+using namespace stereo_image_proc;
+
+namespace {
+
+// The wide range bm is also timed at, and the coarse levels for its hierarchical run
+const int WIDE_RANGE = 256;
+const int WIDE_COARSE_LEVELS = 2;
+
+struct StageTimes
+{
+  double rectify, match, convert, reproject; // ms per frame
+};
+
+sensor_msgs::ImageConstPtr toImage(const cv::Mat_<uint8_t>& mat)
+{
+  sensor_msgs::ImagePtr image = boost::make_shared<sensor_msgs::Image>();
+  image->height = mat.rows;
+  image->width = mat.cols;
+  image->encoding = sensor_msgs::image_encodings::MONO8;
+  image->step = mat.cols;
+  image->data.resize(image->step * image->height);
+  for (int y = 0; y < mat.rows; ++y)
+    memcpy(&image->data[y * image->step], mat[y], mat.cols);
+  return image;
+}
+
+// Pinhole with no distortion, about 60 degrees across, and a 10cm baseline
+void idealRig(int width, int height, image_geometry::StereoCameraModel& model)
+{
+  sensor_msgs::CameraInfo left, right;
+  const double f = 0.85 * width, cx = (width - 1) / 2.0, cy = (height - 1) / 2.0;
+  left.width = width;
+  left.height = height;
+  left.distortion_model = "plumb_bob";
+  left.D.assign(5, 0.0);
+  double K[9] = { f, 0, cx, 0, f, cy, 0, 0, 1 };
+  double R[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+  double P[12] = { f, 0, cx, 0, 0, f, cy, 0, 0, 0, 1, 0 };
+  std::copy(K, K + 9, left.K.begin());
+  std::copy(R, R + 9, left.R.begin());
+  std::copy(P, P + 12, left.P.begin());
+  right = left;
+  right.P[3] = -f * 0.1;
+  model.fromCameraInfo(left, right);
+}
+
+// Smoothed noise, with the right image shifted by a disparity that grows down the image
+// like a ground plane, from 0 to 3/4 of the range
+void syntheticPair(int width, int height, int range, cv::Mat_<uint8_t>& left, cv::Mat_<uint8_t>& right)
+{
+  cv::Mat_<uint8_t> noise(height, width + range);
+  cv::randu(noise, cv::Scalar(0), cv::Scalar(256));
+  cv::GaussianBlur(noise, noise, cv::Size(3, 3), 0);
+  left = noise.colRange(range, range + width).clone();
+  right.create(height, width);
+  for (int y = 0; y < height; ++y) {
+    const int d = (3 * range * y) / (4 * height);
+    memcpy(right[y], noise[y] + range + d, width);
+  }
+}
+
+StageTimes timeStages(const StereoProcessor& processor, const image_geometry::StereoCameraModel& model,
+                      const sensor_msgs::ImageConstPtr& left_raw, const sensor_msgs::ImageConstPtr& right_raw,
+                      int iterations)
+{
+  const int flags = StereoProcessor::neededFlags(StereoProcessor::DISPARITY | StereoProcessor::POINT_CLOUD2);
+  StereoImageSet output;
+  cv::Mat_<int16_t> disparity16;
+  StageTimes times = { 0.0, 0.0, 0.0, 0.0 };
+  // The first frame warms up, also allocates the buffers
+  for (int i = -1; i < iterations; ++i) {
+    ros::WallTime t0 = ros::WallTime::now();
+    processor.processMonocular(left_raw, right_raw, model, output, flags);
+    ros::WallTime t1 = ros::WallTime::now();
+    processor.matchDisparity(output.left.rect, output.right.rect, disparity16);
+    ros::WallTime t2 = ros::WallTime::now();
+    processor.convertDisparity(disparity16, model, output.disparity);
+    ros::WallTime t3 = ros::WallTime::now();
+    processor.processPoints2(output.disparity, output.left.rect_color, output.left.color_encoding,
+                             model, output.points2);
+    ros::WallTime t4 = ros::WallTime::now();
+    if (i < 0)
+      continue;
+    times.rectify   += (t1 - t0).toSec();
+    times.match     += (t2 - t1).toSec();
+    times.convert   += (t3 - t2).toSec();
+    times.reproject += (t4 - t3).toSec();
+  }
+  const double scale = 1000.0 / iterations;
+  times.rectify   *= scale;
+  times.match     *= scale;
+  times.convert   *= scale;
+  times.reproject *= scale;
+  return times;
+}
+
+void printTimes(const char* name, int range, const StageTimes& times)
+{
+  const double total = times.rectify + times.match + times.convert + times.reproject;
+  printf("%-20s %5d %9.3f %9.3f %9.3f %9.3f %9.3f %7.1f\n", name, range,
+         times.rectify, times.match, times.convert, times.reproject, total, 1000.0 / total);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+  int algorithm = STEREO_BM;
+  if (argc > 1) {
+    if (!strcmp(argv[1], "sgm"))         algorithm = STEREO_SGM;
+    else if (!strcmp(argv[1], "census")) algorithm = STEREO_CENSUS;
+    else if (strcmp(argv[1], "bm")) {
+      fprintf(stderr, "Unknown algorithm '%s', expected bm, sgm or census\n", argv[1]);
+      return 1;
+    }
+  }
+  int iterations = (argc > 2) ? atoi(argv[2]) : 20;
+  int threads = (argc > 3) ? atoi(argv[3]) : 0;
+  if (iterations < 1) iterations = 1;
+  if (threads > 0)
+    image_proc::setGlobalWorkerThreads(threads);
+
+  StereoProcessor processor;
+  processor.setStereoAlgorithm(algorithm);
+  if (algorithm == STEREO_SGM)
+    processor.setCorrelationWindowSize(9);
+
+  printf("%s, %d iterations, %d worker threads\n", argc > 1 ? argv[1] : "bm", iterations,
+         image_proc::globalWorkerPool()->numThreads());
+  printf("stage times in ms per frame\n");
+  printf("%-20s %5s %9s %9s %9s %9s %9s %7s\n", "image", "range",
+         "rectify", "match", "convert", "reproject", "total", "fps");
+
+  const int sizes[3][2] = { { 640, 480 }, { 1280, 960 }, { 1920, 1080 } };
+  const int ranges[2] = { 64, 128 };
+  for (int s = 0; s < 3; ++s) {
+    const int width = sizes[s][0], height = sizes[s][1];
+    image_geometry::StereoCameraModel model;
+    idealRig(width, height, model);
+    char name[32];
+    snprintf(name, sizeof(name), "%dx%d", width, height);
+    for (int r = 0; r < 2; ++r) {
+      cv::Mat_<uint8_t> left, right;
+      syntheticPair(width, height, ranges[r], left, right);
+      processor.setDisparityRange(ranges[r]);
+      printTimes(name, ranges[r], timeStages(processor, model, toImage(left), toImage(right), iterations));
+    }
+
+    // Plain and hierarchical block matching at a wide range, on the same pair
+    if (algorithm == STEREO_BM) {
+      cv::Mat_<uint8_t> left, right;
+      syntheticPair(width, height, WIDE_RANGE, left, right);
+      sensor_msgs::ImageConstPtr left_raw = toImage(left), right_raw = toImage(right);
+      processor.setDisparityRange(WIDE_RANGE);
+      printTimes(name, WIDE_RANGE, timeStages(processor, model, left_raw, right_raw, iterations));
+      char coarse_name[32];
+      snprintf(coarse_name, sizeof(coarse_name), "%s coarse %d", name, WIDE_COARSE_LEVELS);
+      processor.setCoarseLevels(WIDE_COARSE_LEVELS);
+      printTimes(coarse_name, WIDE_RANGE, timeStages(processor, model, left_raw, right_raw, iterations));
+      processor.setCoarseLevels(0);
+    }
+  }
+
+  // Recorded pairs, at the default range
+  processor.setDisparityRange(64);
+  for (int i = 4; i + 1 < argc; i += 2) {
+    cv::Mat_<uint8_t> left = cv::imread(argv[i], 0), right = cv::imread(argv[i + 1], 0);
+    if (left.empty() || right.empty() || left.size() != right.size()) {
+      fprintf(stderr, "Could not load a pair of equal size from %s and %s\n", argv[i], argv[i + 1]);
+      continue;
+    }
+    image_geometry::StereoCameraModel model;
+    idealRig(left.cols, left.rows, model);
+    std::string name = argv[i];
+    name = name.substr(name.find_last_of('/') + 1);
+    printTimes(name.c_str(), 64, timeStages(processor, model, toImage(left), toImage(right), iterations));
+  }
+
+  return 0;
+}
@@ -0,0 +1,429 @@
+#include <gtest/gtest.h>
+#include <stereo_image_proc/stereo_matcher.h>
+#include <image_proc/parallel.h>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace stereo_image_proc;
+
+namespace {
+
+const int16_t NEW_VAL = -16;
+
+bool sameImage(const cv::Mat& a, const cv::Mat& b)
+{
+  if (a.size() != b.size() || a.type() != b.type())
+    return false;
+  for (int r = 0; r < a.rows; ++r)
+    if (memcmp(a.ptr(r), b.ptr(r), a.cols * a.elemSize()) != 0)
+      return false;
+  return true;
+}
+
+// Compares SpeckleFilter with cv::filterSpeckles on a copy of disparity
+void checkSpeckles(const cv::Mat_<int16_t>& disparity, int max_size, int max_diff)
+{
+  cv::Mat_<int16_t> expected = disparity.clone(), actual = disparity.clone();
+  cv::Mat buffer;
+  cv::filterSpeckles(expected, NEW_VAL, max_size, max_diff, buffer);
+  SpeckleFilter filter;
+  filter.filter(actual, NEW_VAL, max_size, max_diff);
+  EXPECT_TRUE(sameImage(expected, actual)) << disparity.cols << "x" << disparity.rows
+                                           << " max_size " << max_size << " max_diff " << max_diff;
+}
+
+// Small integer disparities with some rejected pixels, so regions of all sizes form
+cv::Mat_<int16_t> randomDisparity(int width, int height)
+{
+  cv::Mat_<int16_t> disparity(height, width);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      disparity(y, x) = (rand() % 6 == 0) ? NEW_VAL : (rand() % 8) * 4;
+  return disparity;
+}
+
+// Random left texture, and the right image of a scene at the given integer disparities.
+// Right pixels that no left pixel maps to (occlusions) are random too.
+void makePair(const cv::Mat_<int16_t>& truth, cv::Mat_<uint8_t>& left, cv::Mat_<uint8_t>& right)
+{
+  const int W = truth.cols, H = truth.rows;
+  left.create(H, W);
+  right.create(H, W);
+  for (int y = 0; y < H; ++y) {
+    for (int x = 0; x < W; ++x) {
+      left(y, x) = rand() & 0xff;
+      right(y, x) = rand() & 0xff;
+    }
+    // The nearest surface wins where several map to the same right pixel
+    std::vector<int> nearest(W, INT_MIN);
+    for (int x = 0; x < W; ++x) {
+      int d = truth(y, x), x_right = x - d;
+      if (x_right >= 0 && x_right < W && d > nearest[x_right]) {
+        right(y, x_right) = left(y, x);
+        nearest[x_right] = d;
+      }
+    }
+  }
+}
+
+// Disparities growing down the image from min_d + 2 to min_d + range - 4 in steps of
+// 40 rows, like a terraced ground plane. The texture is noise, so the rows of each step
+// need the same disparity for the matching windows to correlate.
+cv::Mat_<int16_t> planeTruth(int width, int height, int min_d, int range)
+{
+  cv::Mat_<int16_t> truth(height, width);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      truth(y, x) = min_d + 2 + (range - 6) * (y - y % 40) / height;
+  return truth;
+}
+
+// Fraction of the pixels of window that are visible in the right image and whose disparity
+// is valid and within a pixel of the truth
+double accuracy(const cv::Mat_<int16_t>& disparity, const cv::Mat_<int16_t>& truth,
+                const MatcherParams& params, const cv::Rect& window)
+{
+  const int16_t invalid = (params.min_disparity - 1) * 16;
+  int good = 0, visible = 0;
+  for (int y = window.y; y < window.y + window.height; ++y) {
+    for (int x = window.x; x < window.x + window.width; ++x) {
+      int x_right = x - truth(y, x);
+      if (x_right < 0 || x_right >= disparity.cols)
+        continue;
+      ++visible;
+      int d16 = disparity(y, x);
+      if (d16 != invalid && std::abs(d16 - truth(y, x) * 16) <= 16)
+        ++good;
+    }
+  }
+  return visible > 0 ? (double)good / visible : 0.0;
+}
+
+// Same settings as params for a cv::StereoBM
+void setState(cv::StereoBM& matcher, const MatcherParams& params)
+{
+  matcher.state->preFilterSize       = params.prefilter_size;
+  matcher.state->preFilterCap        = params.prefilter_cap;
+  matcher.state->SADWindowSize       = params.correlation_window_size;
+  matcher.state->minDisparity        = params.min_disparity;
+  matcher.state->numberOfDisparities = params.disparity_range;
+  matcher.state->uniquenessRatio     = params.uniqueness_ratio;
+  matcher.state->textureThreshold    = params.texture_threshold;
+  matcher.state->speckleWindowSize   = params.speckle_size;
+  matcher.state->speckleRange        = params.speckle_range;
+}
+
+} // namespace
+
+TEST(SpeckleFilter, randomMaps)
+{
+  // Heights span several bands of rows, widths include single columns
+  const int sizes[][2] = { { 1, 1 }, { 1, 97 }, { 70, 1 }, { 37, 64 }, { 160, 121 }, { 641, 480 } };
+  const int max_sizes[] = { 0, 4, 100, 1000 };
+  const int max_diffs[] = { 0, 4, 16 };
+  for (int s = 0; s < 6; ++s) {
+    cv::Mat_<int16_t> disparity = randomDisparity(sizes[s][0], sizes[s][1]);
+    for (int i = 0; i < 4; ++i)
+      for (int j = 0; j < 3; ++j)
+        checkSpeckles(disparity, max_sizes[i], max_diffs[j]);
+  }
+}
+
+// Regions that are only connected through rows of other bands
+TEST(SpeckleFilter, bandBorders)
+{
+  cv::Mat_<int16_t> disparity(100, 60);
+  disparity.setTo(NEW_VAL);
+  // A U whose arms lie in one band and whose base lies in the next
+  for (int y = 20; y < 40; ++y) {
+    disparity(y, 5) = 32;
+    disparity(y, 15) = 32;
+  }
+  for (int x = 5; x <= 15; ++x)
+    disparity(39, x) = 32;
+  // A column crossing three bands, with a step of exactly max_diff at a border
+  for (int y = 10; y < 90; ++y)
+    disparity(y, 30) = y < 64 ? 48 : 52;
+  // A path zigzagging across the border between rows 31 and 32
+  for (int x = 40; x < 60; ++x) {
+    if (x % 4 != 3)
+      disparity(31, x) = 64;
+    if (x % 4 != 1)
+      disparity(32, x) = 64;
+  }
+
+  for (int max_size = 0; max_size < 100; ++max_size) {
+    checkSpeckles(disparity, max_size, 4);
+    checkSpeckles(disparity, max_size, 3);
+  }
+}
+
+// Regions of exactly max_size pixels are removed, one pixel more and they stay
+TEST(SpeckleFilter, maxSize)
+{
+  const int max_size = 50;
+  for (int extra = 0; extra <= 1; ++extra) {
+    cv::Mat_<int16_t> disparity(64, 40);
+    disparity.setTo(NEW_VAL);
+    // 10 x 5 pixels straddling the border between rows 31 and 32, plus one
+    for (int y = 27; y < 37; ++y)
+      for (int x = 10; x < 15; ++x)
+        disparity(y, x) = 80;
+    if (extra)
+      disparity(37, 10) = 80;
+
+    SpeckleFilter filter;
+    cv::Mat_<int16_t> filtered = disparity.clone();
+    filter.filter(filtered, NEW_VAL, max_size, 0);
+    EXPECT_EQ(extra ? 80 : NEW_VAL, filtered(31, 12));
+    EXPECT_EQ(extra ? 80 : NEW_VAL, filtered(32, 12));
+    checkSpeckles(disparity, max_size, 0);
+  }
+}
+
+// The result must not depend on how the bands are split between threads
+TEST(SpeckleFilter, threads)
+{
+  cv::Mat_<int16_t> disparity = randomDisparity(333, 257);
+  cv::Mat_<int16_t> serial = disparity.clone(), parallel = disparity.clone();
+  SpeckleFilter filter;
+  image_proc::setGlobalWorkerThreads(1);
+  filter.filter(serial, NEW_VAL, 20, 4);
+  image_proc::setGlobalWorkerThreads(5);
+  filter.filter(parallel, NEW_VAL, 20, 4);
+  image_proc::setGlobalWorkerThreads(0);
+  EXPECT_TRUE(sameImage(serial, parallel));
+}
+
+// Stitched stripes, speckle filtered as a whole, match one cv::StereoBM call exactly
+TEST(BlockMatcher, stripes)
+{
+  // A plane with small patches at other disparities, which make speckles
+  cv::Mat_<int16_t> truth = planeTruth(200, 240, 0, 64);
+  for (int i = 0; i < 60; ++i) {
+    int x0 = 60 + rand() % 130, y0 = rand() % 230, d = rand() % 60;
+    int x1 = x0 + 1 + rand() % 8, y1 = y0 + 1 + rand() % 8;
+    for (int y = y0; y < y1; ++y)
+      for (int x = x0; x < x1; ++x)
+        truth(y, x) = d;
+  }
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+
+  image_proc::setGlobalWorkerThreads(4);
+  for (int speckle_size = 0; speckle_size <= 100; speckle_size += 100) {
+    MatcherParams params;
+    params.speckle_size = speckle_size;
+    cv::StereoBM reference(cv::StereoBM::BASIC_PRESET);
+    setState(reference, params);
+    cv::Mat expected;
+    reference(left, right, expected);
+
+    BlockMatcher matcher;
+    for (int stripes = 1; stripes <= 7; ++stripes) {
+      params.stripes = stripes;
+      cv::Mat_<int16_t> disparity;
+      matcher.compute(left, right, params, disparity);
+      EXPECT_TRUE(sameImage(expected, disparity)) << stripes << " stripes, speckle_size " << speckle_size;
+    }
+  }
+  image_proc::setGlobalWorkerThreads(0);
+}
+
+TEST(SemiGlobalMatcher, plane)
+{
+  const int min_d = 0, range = 64;
+  cv::Mat_<int16_t> truth = planeTruth(160, 120, min_d, range);
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+
+  for (int paths = 4; paths <= 8; paths += 4) {
+    MatcherParams params;
+    params.correlation_window_size = 5;
+    params.sgm_paths = paths;
+    SemiGlobalMatcher matcher;
+    cv::Mat_<int16_t> disparity;
+    matcher.compute(left, right, params, disparity);
+    cv::Rect window = matcher.validWindow(params, disparity.cols, disparity.rows);
+    EXPECT_GT(accuracy(disparity, truth, params, window), 0.9) << paths << " paths";
+    // Unlike block matching, SGM also matches the top rows
+    EXPECT_GT(accuracy(disparity, truth, params, cv::Rect(range, 0, 16, 2)), 0.8) << paths << " paths";
+  }
+}
+
+// Bands overlap so paths settle, and must give the same result however they are threaded
+TEST(SemiGlobalMatcher, threads)
+{
+  cv::Mat_<int16_t> truth = planeTruth(160, 200, 0, 32);
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+  MatcherParams params;
+  params.disparity_range = 32;
+  params.correlation_window_size = 5;
+  SemiGlobalMatcher matcher;
+  cv::Mat_<int16_t> serial, parallel;
+  image_proc::setGlobalWorkerThreads(1);
+  matcher.compute(left, right, params, serial);
+  image_proc::setGlobalWorkerThreads(5);
+  matcher.compute(left, right, params, parallel);
+  image_proc::setGlobalWorkerThreads(0);
+  EXPECT_TRUE(sameImage(serial, parallel));
+}
+
+// Census costs only depend on the order of intensities, so a gain and offset between the
+// eyes does no harm
+TEST(CensusMatcher, brightness)
+{
+  const int min_d = -8, range = 48;
+  cv::Mat_<int16_t> truth = planeTruth(180, 120, min_d, range);
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+  cv::Mat_<uint8_t> darker(right.rows, right.cols);
+  for (int y = 0; y < right.rows; ++y)
+    for (int x = 0; x < right.cols; ++x)
+      darker(y, x) = right(y, x) / 2 + 20;
+
+  MatcherParams params;
+  params.min_disparity = min_d;
+  params.disparity_range = range;
+  params.correlation_window_size = 9;
+  CensusMatcher matcher;
+  cv::Mat_<int16_t> disparity;
+  matcher.compute(left, right, params, disparity);
+  cv::Rect window = matcher.validWindow(params, disparity.cols, disparity.rows);
+  EXPECT_GT(accuracy(disparity, truth, params, window), 0.9);
+  cv::Mat_<int16_t> darker_disparity;
+  matcher.compute(left, darker, params, darker_disparity);
+  EXPECT_GT(accuracy(darker_disparity, truth, params, window), 0.9);
+}
+
+TEST(HierarchicalMatcher, wideRange)
+{
+  const int range = 256;
+  cv::Mat_<int16_t> truth = planeTruth(512, 160, 0, range);
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+
+  MatcherParams params;
+  params.disparity_range = range;
+  params.coarse_levels = 2;
+  HierarchicalMatcher matcher;
+  cv::Mat_<int16_t> disparity;
+  matcher.compute(left, right, params, disparity);
+  cv::Rect window = validDisparityWindow(params, disparity.cols, disparity.rows);
+  EXPECT_GT(accuracy(disparity, truth, params, window), 0.9);
+
+  // Without coarse levels it is plain block matching
+  params.coarse_levels = 0;
+  BlockMatcher block;
+  cv::Mat_<int16_t> expected;
+  block.compute(left, right, params, expected);
+  matcher.compute(left, right, params, disparity);
+  EXPECT_TRUE(sameImage(expected, disparity));
+}
+
+TEST(TemporalMatcher, staticScene)
+{
+  cv::Mat_<int16_t> truth = planeTruth(200, 120, 0, 64);
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+
+  MatcherParams params;
+  params.temporal_prior = true;
+  TemporalMatcher matcher;
+  cv::Mat_<int16_t> first, second;
+  matcher.compute(left, right, params, first);
+  matcher.compute(left, right, params, second);
+  // The first frame is matched in full, by block matching; later ones also reach the
+  // left strip, within the range matcher's window
+  EXPECT_GT(accuracy(first, truth, params, validDisparityWindow(params, first.cols, first.rows)), 0.9);
+  EXPECT_GT(accuracy(second, truth, params, matcher.validWindow(params, second.cols, second.rows)), 0.9);
+
+  // After the disparity range changes the prior is dropped, and the search is full again
+  params.disparity_range = 80;
+  cv::Mat_<int16_t> third;
+  matcher.compute(left, right, params, third);
+  EXPECT_GT(accuracy(third, truth, params, validDisparityWindow(params, third.cols, third.rows)), 0.9);
+}
+
+// Every algorithm, and the temporal prior, at the widest range the nodelet allows
+TEST(MatcherSet, wideRange)
+{
+  const int min_d = -16, range = 256;
+  cv::Mat_<int16_t> truth = planeTruth(480, 120, min_d, range);
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+
+  const int algorithms[] = { STEREO_BM, STEREO_SGM, STEREO_CENSUS };
+  for (int a = 0; a < 3; ++a) {
+    MatcherParams params;
+    params.min_disparity = min_d;
+    params.disparity_range = range;
+    params.correlation_window_size = algorithms[a] == STEREO_SGM ? 5 : 9;
+    params.stripes = 3;
+    MatcherSet matchers;
+    cv::Mat_<int16_t> disparity;
+    matchers.compute(algorithms[a], left, right, params, disparity);
+    cv::Rect window = matchers.validWindow(algorithms[a], params, disparity.cols, disparity.rows);
+    EXPECT_GT(accuracy(disparity, truth, params, window), 0.9) << "algorithm " << algorithms[a];
+  }
+
+  MatcherParams params;
+  params.min_disparity = min_d;
+  params.disparity_range = range;
+  params.temporal_prior = true;
+  MatcherSet matchers;
+  cv::Mat_<int16_t> first, second;
+  matchers.compute(STEREO_BM, left, right, params, first);
+  matchers.compute(STEREO_BM, left, right, params, second);
+  cv::Rect window = matchers.validWindow(STEREO_BM, params, second.cols, second.rows);
+  EXPECT_GT(accuracy(second, truth, params, window), 0.9);
+}
+
+// The right-to-left pass rejects pixels occluded in the right image, and nothing else changes
+TEST(MatcherSet, leftRightCheck)
+{
+  // A near square in front of a far plane; the plane just left of the square is hidden
+  // from the right eye
+  const int W = 200, H = 120, near_d = 40, far_d = 8;
+  cv::Mat_<int16_t> truth(H, W);
+  truth.setTo(far_d);
+  for (int y = 30; y < 90; ++y)
+    for (int x = 110; x < 170; ++x)
+      truth(y, x) = near_d;
+  cv::Mat_<uint8_t> left, right;
+  makePair(truth, left, right);
+  const cv::Rect occluded(110 - (near_d - far_d) + 4, 40, near_d - far_d - 8, 40);
+
+  const int algorithms[] = { STEREO_BM, STEREO_SGM, STEREO_CENSUS };
+  for (int a = 0; a < 3; ++a) {
+    MatcherParams params;
+    params.correlation_window_size = algorithms[a] == STEREO_SGM ? 5 : 9;
+    params.speckle_size = 0;
+    const int16_t invalid = (params.min_disparity - 1) * 16;
+    MatcherSet matchers;
+    cv::Mat_<int16_t> unchecked, checked;
+    matchers.compute(algorithms[a], left, right, params, unchecked);
+    params.disp12_max_diff = 1;
+    matchers.compute(algorithms[a], left, right, params, checked);
+
+    int rejected = 0;
+    for (int y = 0; y < H; ++y) {
+      for (int x = 0; x < W; ++x) {
+        ASSERT_TRUE(checked(y, x) == unchecked(y, x) || checked(y, x) == invalid)
+          << "algorithm " << algorithms[a] << " at (" << x << "," << y << ")";
+        if (occluded.contains(cv::Point(x, y)))
+          rejected += checked(y, x) == invalid;
+      }
+    }
+    EXPECT_GT(rejected, occluded.area() * 8 / 10) << "algorithm " << algorithms[a];
+  }
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,370 @@
+#include <gtest/gtest.h>
+#include <stereo_image_proc/reprojection.h>
+#include <opencv2/calib3d/calib3d.hpp>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+using namespace stereo_image_proc;
+
+namespace {
+
+// Z of the missing disparities in cv::reprojectImageTo3D
+const float BIG_Z = 10000.0f;
+
+// Rejected pixels, the lowest disparity in the test images
+const float MISSING = -1.0f;
+
+// Q of a rectified pair, as StereoCameraModel::reprojectionMatrix() builds it
+cv::Matx44d reprojectionMatrix(double cx, double cy, double f, double Tx, double cx_right)
+{
+  cv::Matx44d Q;
+  for (int i = 0; i < 16; ++i)
+    Q.val[i] = 0.0;
+  Q(0,0) = 1.0;
+  Q(0,3) = -cx;
+  Q(1,1) = 1.0;
+  Q(1,3) = -cy;
+  Q(2,3) = f;
+  Q(3,2) = -1.0 / Tx;
+  Q(3,3) = (cx - cx_right) / Tx;
+  return Q;
+}
+
+// Disparities in [4, 100), about one in ten rejected
+cv::Mat_<float> randomDisparity(int width, int height)
+{
+  cv::Mat_<float> disparity(height, width);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      disparity(y, x) = (rand() % 10 == 0) ? MISSING : 4.0f + (rand() % 9600) / 100.0f;
+  return disparity;
+}
+
+cv::Mat randomColor(int width, int height)
+{
+  cv::Mat color(height, width, CV_8UC3);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < 3 * width; ++x)
+      color.ptr<uint8_t>(y)[x] = rand() & 0xff;
+  return color;
+}
+
+uint32_t floatBits(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// Rounds to the nearest integer, ties to even
+double roundEven(double value)
+{
+  double rounded = std::floor(value + 0.5);
+  if (rounded - value == 0.5 && std::fmod(rounded, 2.0) != 0.0)
+    rounded -= 1.0;
+  return rounded;
+}
+
+// Half float bits of a value, the slow way
+uint16_t referenceHalf(float value)
+{
+  const uint16_t sign = (floatBits(value) & 0x80000000u) ? 0x8000 : 0;
+  const double a = std::fabs((double)value);
+  if (a != a)
+    return sign | 0x7e00;
+  if (a >= 65520.0) // rounds up past the largest half, 65504
+    return sign | 0x7c00;
+  if (a < std::ldexp(1.0, -14))
+    return sign | (uint16_t)roundEven(std::ldexp(a, 24)); // subnormal, 2^-24 per step
+  int exponent;
+  std::frexp(a, &exponent);
+  const int mantissa = (int)roundEven(std::ldexp(a, 11 - exponent)); // 1024 to 2048
+  return sign | (uint16_t)(((exponent + 14) << 10) + mantissa - 1024);
+}
+
+// Point (x, y) of an organized cloud
+const uint8_t* point(const sensor_msgs::PointCloud2& points, int x, int y)
+{
+  return &points.data[y * points.row_step + x * points.point_step];
+}
+
+bool nearlyEqual(float actual, float expected)
+{
+  return std::fabs(actual - expected) <= 1e-5f * std::fabs(expected) + 1e-6f;
+}
+
+// Checks an organized cloud of each layout against cv::reprojectImageTo3D
+void checkLayouts(int width, int height)
+{
+  const cv::Matx44d Q = reprojectionMatrix(width / 2 + 0.3, height / 2 + 0.7, 700.0, -0.12, width / 2 - 1.7);
+  const cv::Mat_<float> disparity = randomDisparity(width, height);
+  const cv::Mat color = randomColor(width, height);
+  cv::Mat xyz;
+  cv::reprojectImageTo3D(disparity, xyz, Q, true);
+
+  Reprojector reprojector;
+  reprojector.update(Q, width, height);
+  for (int l = LAYOUT_XYZRGB; l <= LAYOUT_XYZ_HALF; ++l) {
+    const PointLayout layout = PointLayout(l);
+    sensor_msgs::PointCloud2 points;
+    reprojector.projectCloud(disparity, color, COLOR_BGR8, PointFilter(), false, layout, points);
+    ASSERT_EQ((uint32_t)width, points.width) << "layout " << l;
+    ASSERT_EQ((uint32_t)height, points.height) << "layout " << l;
+    ASSERT_EQ(points.row_step * points.height, points.data.size()) << "layout " << l;
+
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const float* expected = xyz.ptr<float>(y) + 3 * x;
+        const bool valid = expected[2] != BIG_Z;
+        const uint8_t* c = color.ptr<uint8_t>(y) + 3 * x;
+        const uint32_t rgb = (c[2] << 16) | (c[1] << 8) | c[0];
+        const uint8_t* p = point(points, x, y);
+        // LAYOUT_XYZ_MM drops points beyond 32767 mm; skip those too close to tell
+        bool fits = valid, borderline = false;
+        for (int i = 0; i < 3 && valid; ++i) {
+          const float mm = std::fabs(expected[i] * 1000.0f);
+          fits = fits && mm <= 32767.0f;
+          borderline = borderline || std::fabs(mm - 32767.0f) < 1.0f;
+        }
+        if (layout == LAYOUT_XYZ_MM && borderline)
+          continue;
+        for (int i = 0; i < 3; ++i) {
+          if (layout == LAYOUT_XYZRGB || layout == LAYOUT_XYZ) {
+            const float actual = ((const float*)p)[i];
+            if (valid)
+              ASSERT_TRUE(nearlyEqual(actual, expected[i])) << "layout " << l << " at (" << x << "," << y
+                                                            << ") field " << i << ": " << actual
+                                                            << " vs " << expected[i];
+            else
+              ASSERT_TRUE(actual != actual) << "layout " << l << " at (" << x << "," << y << ")";
+          }
+          else if (layout == LAYOUT_XYZ_MM) {
+            // Within a millimeter, all zero if invalid or dropped
+            const int actual = ((const int16_t*)p)[i];
+            const int mm = fits ? cvRound(expected[i] * 1000.0f) : 0;
+            ASSERT_LE(std::abs(actual - mm), 1) << "layout " << l << " at (" << x << "," << y
+                                                << ") field " << i;
+          }
+          else {
+            // Within a unit in the last place
+            const int actual = ((const uint16_t*)p)[i];
+            const int half = valid ? referenceHalf(expected[i]) : 0x7e00;
+            ASSERT_LE(std::abs(actual - half), valid ? 1 : 0) << "layout " << l << " at (" << x << ","
+                                                              << y << ") field " << i;
+          }
+        }
+        if (layout == LAYOUT_XYZRGB) {
+          const float actual = ((const float*)p)[3];
+          if (valid)
+            ASSERT_EQ(rgb, floatBits(actual)) << "at (" << x << "," << y << ")";
+          else
+            ASSERT_TRUE(actual != actual) << "at (" << x << "," << y << ")";
+        }
+      }
+    }
+  }
+}
+
+// Whether an organized cloud holds a point at (x, y), invalid points being NaN (all zero for
+// LAYOUT_XYZ_MM)
+bool validPoint(const sensor_msgs::PointCloud2& points, PointLayout layout, int x, int y)
+{
+  const uint8_t* p = point(points, x, y);
+  if (layout == LAYOUT_XYZ_MM) {
+    const int16_t* mm = (const int16_t*)p;
+    return mm[0] != 0 || mm[1] != 0 || mm[2] != 0;
+  }
+  if (layout == LAYOUT_XYZ_HALF)
+    return ((const uint16_t*)p)[0] != 0x7e00;
+  const float x_m = ((const float*)p)[0];
+  return x_m == x_m;
+}
+
+// Range and crop box limits that each cut some of the points of checkLayouts()
+PointFilter cuttingFilter()
+{
+  PointFilter filter;
+  filter.min_range = 2.0f;
+  filter.max_range = 30.0f;
+  filter.box_min[0] = -4.0f;
+  filter.box_max[0] = 5.0f;
+  filter.box_min[1] = -0.5f;
+  filter.box_max[1] = 0.8f;
+  filter.box_max[2] = 25.0f;
+  return filter;
+}
+
+} // namespace
+
+TEST(Reprojector, layouts)
+{
+  srand(1);
+  // Widths that are not a multiple of 4 end each row in the scalar tail
+  const int widths[] = { 1, 3, 4, 5, 7, 64, 333 };
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+    SCOPED_TRACE(widths[i]);
+    checkLayouts(widths[i], 37);
+  }
+}
+
+TEST(HalfFloat, specialValues)
+{
+  const float inf = std::numeric_limits<float>::infinity();
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float values[] = {
+    0.0f, -0.0f, 1.0f, -2.5f, 65504.0f, 65519.0f, 65520.0f, 65536.0f, 1e10f, -1e10f, inf, -inf,
+    std::ldexp(1.0f, -14), std::ldexp(1.0f, -24), std::ldexp(1.0f, -25), std::ldexp(1.5f, -25),
+    std::ldexp(3.0f, -26), std::ldexp(1023.5f, -24), std::ldexp(1.0f, -30), -std::ldexp(5.5f, -24),
+    std::numeric_limits<float>::min(), std::numeric_limits<float>::denorm_min(), 1.0f + std::ldexp(1.0f, -11),
+    1.0f + std::ldexp(3.0f, -11)
+  };
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    EXPECT_EQ(referenceHalf(values[i]), halfFloat(values[i])) << values[i];
+
+  EXPECT_EQ(0x7c00, halfFloat(65520.0f));
+  EXPECT_EQ(0x7bff, halfFloat(65519.0f));
+  EXPECT_EQ(0x0001, halfFloat(std::ldexp(1.0f, -24)));
+  EXPECT_EQ(0x0000, halfFloat(std::ldexp(1.0f, -25))); // a tie, to even
+  EXPECT_EQ(0x7e00, halfFloat(nan));
+  EXPECT_EQ(0xfe00, halfFloat(-nan));
+}
+
+TEST(HalfFloat, allExponents)
+{
+  // Every exponent and a spread of mantissas, including the ties
+  for (uint32_t bits = 0; bits < 0x80000000u; bits += 0x1001) {
+    const uint32_t values[2] = { bits, bits | 0x80001000u };
+    for (int i = 0; i < 2; ++i) {
+      float value;
+      memcpy(&value, &values[i], sizeof(value));
+      ASSERT_EQ(referenceHalf(value), halfFloat(value)) << std::hex << values[i];
+    }
+  }
+}
+
+TEST(Reprojector, halfLayout)
+{
+  // Points from far below the smallest half to far above the largest, so the vectorized
+  // conversion meets subnormals, overflows and NaNs (rejected pixels)
+  srand(2);
+  const int widths[] = { 1, 6, 333 };
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+    const int width = widths[i], height = 19;
+    cv::Matx44d Q = reprojectionMatrix(width / 2 + 0.5, height / 2 + 0.5, 1.0, -1.0, width / 2 + 0.5);
+    cv::Mat_<float> disparity(height, width);
+    for (int y = 0; y < height; ++y)
+      for (int x = 0; x < width; ++x)
+        disparity(y, x) = (rand() % 10 == 0) ? MISSING : std::pow(10.0f, (rand() % 9000) / 1000.0f - 3.0f);
+
+    Reprojector reprojector;
+    reprojector.update(Q, width, height);
+    sensor_msgs::PointCloud2 floats, halves;
+    reprojector.projectCloud(disparity, cv::Mat(), COLOR_NONE, PointFilter(), false, LAYOUT_XYZ, floats);
+    reprojector.projectCloud(disparity, cv::Mat(), COLOR_NONE, PointFilter(), false, LAYOUT_XYZ_HALF, halves);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const float* f = (const float*)point(floats, x, y);
+        const uint16_t* h = (const uint16_t*)point(halves, x, y);
+        for (int c = 0; c < 3; ++c)
+          ASSERT_EQ(referenceHalf(f[c]), h[c]) << "width " << width << " at (" << x << "," << y << ") field "
+                                               << c << ": " << f[c];
+      }
+    }
+  }
+}
+
+TEST(Reprojector, denseCloud)
+{
+  // A dense cloud is the organized one without its invalid and filtered out points
+  srand(3);
+  const int widths[] = { 5, 333 };
+  for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+    const int width = widths[i], height = 37;
+    const cv::Matx44d Q = reprojectionMatrix(width / 2 + 0.3, height / 2 + 0.7, 700.0, -0.12, width / 2 - 1.7);
+    const cv::Mat_<float> disparity = randomDisparity(width, height);
+    const cv::Mat color = randomColor(width, height);
+    Reprojector reprojector;
+    reprojector.update(Q, width, height);
+    for (int f = 0; f < 2; ++f) {
+      const PointFilter filter = f ? cuttingFilter() : PointFilter();
+      for (int l = LAYOUT_XYZRGB; l <= LAYOUT_XYZ_HALF; ++l) {
+        const PointLayout layout = PointLayout(l);
+        sensor_msgs::PointCloud2 organized, dense;
+        reprojector.projectCloud(disparity, color, COLOR_BGR8, filter, false, layout, organized);
+        reprojector.projectCloud(disparity, color, COLOR_BGR8, filter, true, layout, dense);
+        EXPECT_FALSE(organized.is_dense);
+        EXPECT_TRUE(dense.is_dense);
+        ASSERT_EQ(1u, dense.height);
+        ASSERT_EQ(organized.point_step, dense.point_step);
+        ASSERT_EQ(dense.point_step * dense.width, dense.row_step);
+
+        std::vector<uint8_t> kept;
+        for (int y = 0; y < height; ++y)
+          for (int x = 0; x < width; ++x)
+            if (validPoint(organized, layout, x, y))
+              kept.insert(kept.end(), point(organized, x, y), point(organized, x, y) + organized.point_step);
+        EXPECT_TRUE(kept == dense.data) << "width " << width << " layout " << l << " filter " << f
+                                        << ": " << kept.size() / organized.point_step << " kept vs "
+                                        << dense.width << " dense points";
+      }
+    }
+  }
+}
+
+TEST(Reprojector, filterLimits)
+{
+  // Points outside the range or crop box become invalid, the others are as without a filter
+  srand(4);
+  const int width = 333, height = 37;
+  const cv::Matx44d Q = reprojectionMatrix(width / 2 + 0.3, height / 2 + 0.7, 700.0, -0.12, width / 2 - 1.7);
+  const cv::Mat_<float> disparity = randomDisparity(width, height);
+  Reprojector reprojector;
+  reprojector.update(Q, width, height);
+  const PointFilter filter = cuttingFilter();
+  sensor_msgs::PointCloud2 all, filtered;
+  reprojector.projectCloud(disparity, cv::Mat(), COLOR_NONE, PointFilter(), false, LAYOUT_XYZ, all);
+  reprojector.projectCloud(disparity, cv::Mat(), COLOR_NONE, filter, false, LAYOUT_XYZ, filtered);
+
+  // Points cut by the range, by each axis of the box, and kept
+  int cut_range = 0, cut_box[3] = { 0, 0, 0 }, kept = 0;
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (!validPoint(all, LAYOUT_XYZ, x, y)) {
+        EXPECT_FALSE(validPoint(filtered, LAYOUT_XYZ, x, y)) << "at (" << x << "," << y << ")";
+        continue;
+      }
+      const float* p = (const float*)point(all, x, y);
+      const float r2 = p[0] * p[0] + p[1] * p[1] + p[2] * p[2];
+      bool keep = true;
+      if (r2 < filter.min_range * filter.min_range || r2 > filter.max_range * filter.max_range) {
+        ++cut_range;
+        keep = false;
+      }
+      for (int i = 0; i < 3; ++i) {
+        if (p[i] < filter.box_min[i] || p[i] > filter.box_max[i]) {
+          ++cut_box[i];
+          keep = false;
+        }
+      }
+      kept += keep;
+      ASSERT_EQ(keep, validPoint(filtered, LAYOUT_XYZ, x, y)) << "at (" << x << "," << y << "): "
+                                                              << p[0] << " " << p[1] << " " << p[2];
+      if (keep)
+        EXPECT_EQ(0, memcmp(p, point(filtered, x, y), filtered.point_step)) << "at (" << x << "," << y << ")";
+    }
+  }
+  EXPECT_GT(cut_range, 0);
+  EXPECT_GT(cut_box[0], 0);
+  EXPECT_GT(cut_box[1], 0);
+  EXPECT_GT(cut_box[2], 0);
+  EXPECT_GT(kept, 0);
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}